@@ -0,0 +1,32 @@
+#!/usr/bin/env python3
+# Generates a large BF program for benchmarking the interpreters' op dispatch.
+#
+# The program is one loop, run PASSES times, over FRAGMENTS straight-line
+# fragments that each add a small constant to a nearby cell and move it one
+# cell to the right:
+#
+#   >>>+++[->+<]<<<
+#
+# At -O1 every fragment stays a few ops, so the op array is far larger than the
+# L1 and L2 caches and each pass streams all of it through them.
+#
+# Usage: gen_large.py [FRAGMENTS [PASSES]] > large.bf
+import random
+import sys
+
+
+def main():
+    fragments = int(sys.argv[1]) if len(sys.argv) > 1 else 300000
+    passes = int(sys.argv[2]) if len(sys.argv) > 2 else 50
+    rng = random.Random(3)
+    out = ['+' * passes, '[-']
+    for _ in range(fragments):
+        distance = rng.randint(1, 6)
+        out.append('>' * distance + '+' * rng.randint(1, 5) + '[->+<]' +
+                   '<' * distance)
+    out.append(']>>>.')
+    sys.stdout.write(''.join(out))
+
+
+if __name__ == '__main__':
+    main()
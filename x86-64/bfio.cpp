@@ -0,0 +1,112 @@
+// Buffered I/O of BF programs on stdin and stdout.
+#include "bfio.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+
+#include "utils.h"
+
+constexpr size_t BfIO::kBufferSize;
+
+uint8_t BfIO::out_buffer_[kBufferSize];
+size_t BfIO::out_size_ = 0;
+size_t BfIO::out_limit_ = kBufferSize;
+bool BfIO::line_flush_ = false;
+
+uint8_t BfIO::in_buffer_[kBufferSize];
+size_t BfIO::in_pos_ = 0;
+size_t BfIO::in_size_ = 0;
+
+namespace {
+
+// Picks the flush policy at startup and flushes output at exit, including
+// exits through DIE.
+struct Setup {
+  Setup() {
+    const char* policy = getenv("BFIO_FLUSH");
+    if (!policy || !*policy) {
+      BfIO::set_flush_policy(isatty(STDOUT_FILENO)
+                                 ? BfIO::FlushPolicy::LINE
+                                 : BfIO::FlushPolicy::SIZE);
+    } else if (strcmp(policy, "line") == 0) {
+      BfIO::set_flush_policy(BfIO::FlushPolicy::LINE);
+    } else {
+      char* end;
+      unsigned long long size = strtoull(policy, &end, 10);
+      if (*end || size == 0) {
+        DIE << "bad BFIO_FLUSH: " << policy;
+      }
+      BfIO::set_flush_policy(BfIO::FlushPolicy::SIZE, size);
+    }
+  }
+
+  ~Setup() {
+    BfIO::flush();
+  }
+} setup;
+
+} // namespace
+
+void BfIO::set_flush_policy(FlushPolicy policy, size_t size) {
+  line_flush_ = policy == FlushPolicy::LINE;
+  out_limit_ = std::max<size_t>(1, std::min(size, kBufferSize));
+  if (out_size_ >= out_limit_) {
+    flush();
+  }
+}
+
+void BfIO::write(const void* data, size_t size) {
+  const uint8_t* bytes = static_cast<const uint8_t*>(data);
+  while (size > 0) {
+    size_t chunk = std::min(size, out_limit_ - out_size_);
+    memcpy(out_buffer_ + out_size_, bytes, chunk);
+    out_size_ += chunk;
+    bytes += chunk;
+    size -= chunk;
+    if (out_size_ >= out_limit_) {
+      flush();
+    }
+  }
+  if (line_flush_ && out_size_ > 0 &&
+      memchr(out_buffer_, '\n', out_size_) != nullptr) {
+    flush();
+  }
+}
+
+void BfIO::flush() {
+  // Whatever went to std::cout or stdout before was meant to come first.
+  fflush(stdout);
+  size_t written = 0;
+  while (written < out_size_) {
+    ssize_t n = ::write(STDOUT_FILENO, out_buffer_ + written,
+                        out_size_ - written);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      out_size_ = 0;
+      DIE << "unable to write to stdout: " << strerror(errno);
+    }
+    written += n;
+  }
+  out_size_ = 0;
+}
+
+bool BfIO::refill() {
+  // The program may be waiting for a reply to what it wrote.
+  flush();
+  ssize_t n;
+  do {
+    n = read(STDIN_FILENO, in_buffer_, kBufferSize);
+  } while (n < 0 && errno == EINTR);
+  if (n < 0) {
+    DIE << "unable to read from stdin: " << strerror(errno);
+  }
+  in_pos_ = 0;
+  in_size_ = n;
+  return n > 0;
+}
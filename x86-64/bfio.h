@@ -0,0 +1,67 @@
+// Buffered I/O of BF programs on stdin and stdout.
+//
+// Executors read and write one byte per op, and going through iostreams or
+// stdio for each one costs a sentry, locking and sync checks every time.
+// BfIO keeps large buffers of its own and moves them with raw read/write.
+#ifndef BFIO_H
+#define BFIO_H
+
+#include <cstddef>
+#include <cstdint>
+
+class BfIO {
+public:
+  // When buffered output is written out, besides when the buffer is full,
+  // before blocking on input and at exit.
+  enum class FlushPolicy {
+    // Only then, or every size bytes if smaller than the buffer.
+    SIZE,
+    // Also after every newline.
+    LINE,
+  };
+
+  // Capacity of each buffer.
+  static constexpr size_t kBufferSize = 64 * 1024;
+
+  // The policy defaults to LINE when stdout is a terminal and to SIZE
+  // otherwise. $BFIO_FLUSH overrides it with "line" or a size in bytes.
+  static void set_flush_policy(FlushPolicy policy,
+                               size_t size = kBufferSize);
+
+  // Writes the byte c.
+  static void put(uint8_t c) {
+    out_buffer_[out_size_++] = c;
+    if (out_size_ >= out_limit_ || (c == '\n' && line_flush_)) {
+      flush();
+    }
+  }
+
+  static void write(const void* data, size_t size);
+
+  // Returns the next byte of input, or -1 at its end like std::cin.get().
+  static int get() {
+    if (in_pos_ == in_size_ && !refill()) {
+      return -1;
+    }
+    return in_buffer_[in_pos_++];
+  }
+
+  // Writes out buffered output. Executors call it when they're done, so their
+  // output comes before whatever they print through std::cout after it.
+  static void flush();
+
+private:
+  // Reads more input after flushing output; returns false at its end.
+  static bool refill();
+
+  static uint8_t out_buffer_[kBufferSize];
+  static size_t out_size_;
+  static size_t out_limit_;
+  static bool line_flush_;
+
+  static uint8_t in_buffer_[kBufferSize];
+  static size_t in_pos_;
+  static size_t in_size_;
+};
+
+#endif /* BFIO_H */
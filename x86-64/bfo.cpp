@@ -0,0 +1,309 @@
+// Compact binary serialization of translated BF programs (.bfo files).
+#include "bfo.h"
+
+#include <cstdio>
+#include <cstring>
+
+#include "utils.h"
+
+namespace optutils {
+
+namespace {
+
+const char kBfoMagic[4] = {'B', 'F', 'O', '\0'};
+
+// Kinds at or above this value aren't valid BfOpKinds.
+constexpr uint8_t kNumKinds =
+    static_cast<uint8_t>(BfOpKind::LOOP_SCAN_CLEAR) + 1;
+
+// Set in the kind byte of ops that have a nonzero offset.
+constexpr uint8_t kHasOffset = 0x80;
+
+// Returns the kind of the jump that has to match one of the given kind.
+BfOpKind matching_jump(BfOpKind kind) {
+  switch (kind) {
+  case BfOpKind::JUMP_IF_DATA_ZERO:
+    return BfOpKind::JUMP_IF_DATA_NOT_ZERO;
+  case BfOpKind::JUMP_IF_DATA_NOT_ZERO:
+    return BfOpKind::JUMP_IF_DATA_ZERO;
+  case BfOpKind::COUNTED_LOOP_BEGIN:
+    return BfOpKind::COUNTED_LOOP_END;
+  case BfOpKind::COUNTED_LOOP_END:
+    return BfOpKind::COUNTED_LOOP_BEGIN;
+  case BfOpKind::IF_BEGIN:
+    return BfOpKind::IF_END;
+  default:
+    return BfOpKind::IF_BEGIN;
+  }
+}
+
+// Returns the kind of the operands that follow ops of the given kind, or
+// INVALID_OP if they have none.
+BfOpKind operand_kind(BfOpKind kind) {
+  switch (kind) {
+  case BfOpKind::LOOP_MUL_ADD:
+    return BfOpKind::MUL_ADD_OPERAND;
+  case BfOpKind::LOOP_CLOSED_FORM:
+    return BfOpKind::CLOSED_FORM_TERM;
+  case BfOpKind::DIVMOD:
+    return BfOpKind::DIVMOD_OPERAND;
+  default:
+    return BfOpKind::INVALID_OP;
+  }
+}
+
+bool refers_to_constant(BfOpKind kind) {
+  return kind == BfOpKind::TAPE_SNAPSHOT || kind == BfOpKind::WRITE_STRING ||
+         kind == BfOpKind::BLOCK_ADD;
+}
+
+void put_fixed(std::string* out, uint64_t v, int num_bytes) {
+  for (int i = 0; i < num_bytes; ++i) {
+    out->push_back(static_cast<char>(v >> (8 * i)));
+  }
+}
+
+void put_varint(std::string* out, int64_t v) {
+  uint64_t zigzag = (static_cast<uint64_t>(v) << 1) ^ (v >> 63);
+  while (zigzag >= 0x80) {
+    out->push_back(static_cast<char>(zigzag | 0x80));
+    zigzag >>= 7;
+  }
+  out->push_back(static_cast<char>(zigzag));
+}
+
+// Sequential reader over a mapped .bfo file; dies on truncated input.
+class BfoReader {
+public:
+  BfoReader(const std::string& path, const char* data, size_t size)
+    : path_(path), p_(reinterpret_cast<const uint8_t*>(data)), end_(p_ + size) {}
+
+  uint64_t fixed(int num_bytes) {
+    need(num_bytes);
+    uint64_t v = 0;
+    for (int i = 0; i < num_bytes; ++i) {
+      v |= static_cast<uint64_t>(*p_++) << (8 * i);
+    }
+    return v;
+  }
+
+  uint8_t byte() {
+    need(1);
+    return *p_++;
+  }
+
+  int64_t varint() {
+    uint64_t zigzag = 0;
+    for (int shift = 0;; shift += 7) {
+      uint8_t b = byte();
+      if (shift > 63) {
+        DIE << path_ << ": malformed varint";
+      }
+      zigzag |= static_cast<uint64_t>(b & 0x7F) << shift;
+      if (!(b & 0x80)) {
+        break;
+      }
+    }
+    return static_cast<int64_t>(zigzag >> 1) ^ -static_cast<int64_t>(zigzag & 1);
+  }
+
+  const char* bytes(size_t n) {
+    need(n);
+    const char* p = reinterpret_cast<const char*>(p_);
+    p_ += n;
+    return p;
+  }
+
+  const uint8_t* pos() const {
+    return p_;
+  }
+
+  size_t remaining() const {
+    return end_ - p_;
+  }
+
+private:
+  void need(size_t n) {
+    if (remaining() < n) {
+      DIE << path_ << ": truncated .bfo file";
+    }
+  }
+
+  const std::string& path_;
+  const uint8_t* p_;
+  const uint8_t* end_;
+};
+
+} // namespace
+
+void write_bfo(const std::string& path, const OpProgram& program,
+               uint64_t source_hash) {
+  const std::vector<BfOp>& ops = program.ops;
+  std::string out(kBfoMagic, sizeof(kBfoMagic));
+  put_fixed(&out, kBfoVersion, 4);
+  put_fixed(&out, source_hash, 8);
+  put_fixed(&out, ops.size(), 8);
+
+  for (size_t i = 0; i < ops.size(); ++i) {
+    const BfOp& op = ops[i];
+    uint8_t kind_byte = static_cast<uint8_t>(op.kind);
+    out.push_back(static_cast<char>(op.offset ? kind_byte | kHasOffset
+                                              : kind_byte));
+    put_varint(&out, is_jump(op.kind)
+                         ? op.argument - static_cast<int64_t>(i)
+                         : op.argument);
+    if (op.offset) {
+      put_varint(&out, op.offset);
+    }
+  }
+  put_fixed(&out, program.constants.size(), 8);
+  out += program.constants;
+
+  FILE* outfile = fopen(path.c_str(), "wb");
+  if (!outfile) {
+    DIE << "unable to open " << path << " for writing";
+  }
+  size_t written = fwrite(out.data(), 1, out.size(), outfile);
+  if (fclose(outfile) != 0 || written != out.size()) {
+    DIE << "unable to write " << path;
+  }
+}
+
+void read_bfo(const std::string& path, OpProgram* program,
+              uint64_t* source_hash) {
+  std::vector<BfOp>* ops = &program->ops;
+  MappedFile file(path);
+  BfoReader reader(path, file.data(), file.size());
+
+  if (file.size() < sizeof(kBfoMagic) ||
+      memcmp(file.data(), kBfoMagic, sizeof(kBfoMagic)) != 0) {
+    DIE << path << ": not a .bfo file";
+  }
+  reader.fixed(sizeof(kBfoMagic));
+  uint32_t version = reader.fixed(4);
+  if (version != kBfoVersion) {
+    DIE << path << ": unsupported .bfo version " << version;
+  }
+  *source_hash = reader.fixed(8);
+  uint64_t num_ops = reader.fixed(8);
+
+  // Every op takes at least two bytes, which bounds num_ops before trusting it
+  // for the allocation.
+  if (num_ops > reader.remaining() / 2) {
+    DIE << path << ": truncated .bfo file";
+  }
+  ops->clear();
+  ops->reserve(num_ops);
+
+  for (uint64_t i = 0; i < num_ops; ++i) {
+    uint8_t kind_byte = reader.byte();
+    bool has_offset = kind_byte & kHasOffset;
+    kind_byte &= ~kHasOffset;
+    if (kind_byte == 0 || kind_byte >= kNumKinds) {
+      DIE << path << ": bad op kind " << static_cast<int>(kind_byte)
+          << " at op " << i;
+    }
+    BfOpKind kind = static_cast<BfOpKind>(kind_byte);
+    int64_t argument = reader.varint();
+    if (is_jump(kind)) {
+      argument += i;
+      if (argument < 0 || static_cast<uint64_t>(argument) >= num_ops) {
+        DIE << path << ": jump out of range at op " << i;
+      }
+    }
+    int64_t offset = has_offset ? reader.varint() : 0;
+    if (offset < INT32_MIN || offset > INT32_MAX) {
+      DIE << path << ": offset out of range at op " << i;
+    }
+    ops->push_back(BfOp(kind, argument, static_cast<int32_t>(offset)));
+  }
+
+  uint64_t constants_size = reader.fixed(8);
+  if (constants_size > reader.remaining()) {
+    DIE << path << ": truncated .bfo file";
+  }
+  program->constants.assign(reader.bytes(constants_size), constants_size);
+
+  // Executors trust jumps to land on their matching bracket.
+  for (size_t i = 0; i < ops->size(); ++i) {
+    const BfOp& op = (*ops)[i];
+    if (is_jump(op.kind)) {
+      const BfOp& target = (*ops)[op.argument];
+      if (target.kind != matching_jump(op.kind) ||
+          static_cast<size_t>(target.argument) != i) {
+        DIE << path << ": unmatched jump at op " << i;
+      }
+    }
+  }
+
+  // ... and LOOP_MUL_ADD, LOOP_CLOSED_FORM and DIVMOD to be followed by exactly
+  // their operands, which only appear there.
+  for (size_t i = 0; i < ops->size(); ++i) {
+    const BfOp& op = (*ops)[i];
+    if (op.kind == BfOpKind::MUL_ADD_OPERAND ||
+        op.kind == BfOpKind::CLOSED_FORM_TERM ||
+        op.kind == BfOpKind::DIVMOD_OPERAND) {
+      DIE << path << ": stray " << BfOpKind_name(op.kind) << " at op " << i;
+    }
+    BfOpKind kind = operand_kind(op.kind);
+    if (kind != BfOpKind::INVALID_OP) {
+      if (op.argument < 1 ||
+          static_cast<uint64_t>(op.argument) >= ops->size() - i ||
+          (op.kind == BfOpKind::LOOP_CLOSED_FORM &&
+           static_cast<uint64_t>(op.argument) > kMaxClosedFormTerms)) {
+        DIE << path << ": bad " << BfOpKind_name(op.kind) << " at op " << i;
+      }
+      for (size_t j = 1; j <= static_cast<size_t>(op.argument); ++j) {
+        const BfOp& operand = (*ops)[i + j];
+        if (operand.kind != kind ||
+            (kind == BfOpKind::DIVMOD_OPERAND &&
+             decode_divmod_operand(operand.argument).role >
+                 DivmodOperand::Role::ADD_RESULT)) {
+          DIE << path << ": bad " << BfOpKind_name(op.kind) << " at op " << i;
+        }
+      }
+      i += op.argument;
+    }
+  }
+
+  // ... and constants to be whole pool entries.
+  for (size_t i = 0; i < ops->size(); ++i) {
+    const BfOp& op = (*ops)[i];
+    if (refers_to_constant(op.kind)) {
+      uint32_t length;
+      if (op.argument < 0 ||
+          static_cast<uint64_t>(op.argument) + sizeof(length) >
+              constants_size) {
+        DIE << path << ": bad constant at op " << i;
+      }
+      memcpy(&length, program->constants.data() + op.argument, sizeof(length));
+      if (length > constants_size - op.argument - sizeof(length) ||
+          (op.kind == BfOpKind::BLOCK_ADD && length != kBlockAddWidth &&
+           length != kMaxBlockAddWidth)) {
+        DIE << path << ": bad constant at op " << i;
+      }
+    }
+  }
+
+  // ... and ranges not to overlap what they're moved to, and scans to clear
+  // one cell at a time.
+  for (size_t i = 0; i < ops->size(); ++i) {
+    const BfOp& op = (*ops)[i];
+    bool bad = false;
+    if (op.kind == BfOpKind::MEMSET_RANGE) {
+      bad = op.argument < 1 || op.argument > INT32_MAX;
+    } else if (op.kind == BfOpKind::MEMMOVE_RANGE) {
+      MemmoveRange range = decode_memmove_range(op.argument);
+      int64_t distance = range.distance;
+      bad = range.length < 1 || range.length > INT32_MAX ||
+            (distance < 0 ? -distance : distance) < range.length;
+    } else if (op.kind == BfOpKind::LOOP_SCAN_CLEAR) {
+      bad = op.argument != 1 && op.argument != -1;
+    }
+    if (bad) {
+      DIE << path << ": bad " << BfOpKind_name(op.kind) << " at op " << i;
+    }
+  }
+}
+
+} // namespace optutils
@@ -0,0 +1,42 @@
+// Compact binary serialization of translated BF programs (.bfo files).
+//
+// A .bfo file holds the optimized OpProgram of a program, so that later runs
+// can skip parsing and translation altogether. Layout (all integers little
+// endian):
+//
+//   magic       4 bytes   "BFO\0"
+//   version     uint32    kBfoVersion
+//   source_hash uint64    hash_bytes() of the BF source the ops came from
+//   num_ops     uint64
+//   ops         num_ops records of:
+//                 kind      1 byte    BfOpKind; the high bit is set when an
+//                                     offset follows
+//                 argument  varint    zigzag-encoded; for jumps, relative to
+//                                     the op's own index
+//                 offset    varint    zigzag-encoded; only present if the
+//                                     kind's high bit is set
+//   constants_size uint64
+//   constants   constants_size bytes  the OpProgram's constant pool
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "optutils.h"
+
+namespace optutils {
+
+constexpr uint32_t kBfoVersion = 9;
+
+// Writes program to the file at path. Dies if the file can't be written.
+void write_bfo(const std::string& path, const OpProgram& program,
+               uint64_t source_hash);
+
+// Maps the .bfo file at path and decodes it into *program, storing the hash of
+// the source it was produced from in *source_hash. Dies if the file can't be
+// read, has another version or is malformed.
+void read_bfo(const std::string& path, OpProgram* program,
+              uint64_t* source_hash);
+
+} // namespace optutils
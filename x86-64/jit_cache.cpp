@@ -0,0 +1,216 @@
+// Persistent on-disk cache of JITed code.
+//
+// An entry is a single file named after the engine and the cache key:
+//
+//   magic           4 bytes   "BFJC"
+//   version         uint32    kCacheVersion
+//   key             uint64
+//   code_size       uint64
+//   num_relocations uint64
+//   relocations     num_relocations x (uint32 offset, uint32 helper)
+//   code            code_size bytes
+//
+// Entries are written to a temporary file and renamed into place, so
+// concurrent runs never see a partial entry.
+#include "jit_cache.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+const char kCacheMagic[4] = {'B', 'F', 'J', 'C'};
+constexpr uint32_t kCacheVersion = 1;
+constexpr size_t kHeaderSize = 4 + 4 + 8 + 8 + 8;
+
+std::string default_cache_dir() {
+  if (const char* dir = getenv("BFJIT_CACHE_DIR")) {
+    return dir;
+  }
+  if (const char* home = getenv("HOME")) {
+    return std::string(home) + "/.cache/bfjit";
+  }
+  return "/tmp/bfjit-cache";
+}
+
+// Creates dir and its missing parents. Returns false on failure.
+bool make_dirs(const std::string& dir) {
+  for (size_t pos = 1; pos <= dir.size(); ++pos) {
+    if (pos == dir.size() || dir[pos] == '/') {
+      std::string prefix = dir.substr(0, pos);
+      if (mkdir(prefix.c_str(), 0755) != 0 && errno != EEXIST) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+uint64_t read_u64(const char* p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+uint32_t read_u32(const char* p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+// Returns a hash of the running executable. Code emitted for a program
+// depends on the parser, the optimizer and the emitter, all of which are
+// linked in, so hashing the executable tells builds apart without relying on
+// object files being rebuilt or version numbers being bumped. Returns 0 if
+// the executable can't be read.
+uint64_t executable_hash() {
+  const char* path = "/proc/self/exe";
+  if (access(path, R_OK) != 0) {
+    return 0;
+  }
+  MappedFile executable(path);
+  return hash_bytes(executable.data(), executable.size());
+}
+
+template <typename T>
+void append_raw(std::string* out, T v) {
+  out->append(reinterpret_cast<const char*>(&v), sizeof(v));
+}
+
+} // namespace
+
+JitCache::JitCache(const std::string& engine, const std::string& bf_file_path,
+                   const Flags& flags)
+  : enabled_(!flags.no_cache && !bf_file_path.empty() &&
+             flags.emit_bfo.empty()),
+    verbose_(flags.verbose), key_(0)
+{
+  if (!enabled_) {
+    return;
+  }
+
+  uint64_t build = executable_hash();
+  if (build == 0) {
+    std::cerr << "Warning: unable to read the executable; JIT cache disabled\n";
+    enabled_ = false;
+    return;
+  }
+
+  MappedFile source(bf_file_path);
+  std::string options = engine + "\nbuild " + std::to_string(build) + "\n-O" +
+                        std::to_string(flags.opt_level);
+  if (flags.opt_level >= 3) {
+    // The partial evaluator's budget decides how much of the program ends up
+    // in the snapshot.
+    options += "\n--peval-steps=" + std::to_string(flags.peval_steps);
+  }
+  key_ = hash_bytes(source.data(), source.size()) ^
+         (hash_bytes(options.data(), options.size()) * 0x9E3779B97F4A7C15ull);
+
+  std::string dir = flags.cache_dir.empty() ? default_cache_dir()
+                                            : flags.cache_dir;
+  if (!make_dirs(dir)) {
+    std::cerr << "Warning: unable to create JIT cache directory " << dir
+              << "\n";
+    enabled_ = false;
+    return;
+  }
+  std::ostringstream name;
+  name << dir << "/" << engine << "-" << std::hex << std::setw(16)
+       << std::setfill('0') << key_ << ".bin";
+  entry_path_ = name.str();
+}
+
+bool JitCache::lookup(const void* const* helpers, std::vector<uint8_t>* code) {
+  if (!enabled_) {
+    return false;
+  }
+
+  Timer t;
+  if (access(entry_path_.c_str(), R_OK) != 0) {
+    if (verbose_) {
+      std::cout << "* jit cache: miss (" << entry_path_ << ")\n";
+    }
+    return false;
+  }
+
+  MappedFile entry(entry_path_);
+  const char* p = entry.data();
+  size_t size = entry.size();
+  bool valid = size >= kHeaderSize &&
+               memcmp(p, kCacheMagic, sizeof(kCacheMagic)) == 0 &&
+               read_u32(p + 4) == kCacheVersion && read_u64(p + 8) == key_;
+  uint64_t code_size = valid ? read_u64(p + 16) : 0;
+  uint64_t num_relocations = valid ? read_u64(p + 24) : 0;
+  valid = valid && num_relocations <= (size - kHeaderSize) / 8 &&
+          code_size == size - kHeaderSize - num_relocations * 8;
+  if (!valid) {
+    std::cerr << "Warning: ignoring corrupt JIT cache entry " << entry_path_
+              << "\n";
+    return false;
+  }
+
+  const char* relocations = p + kHeaderSize;
+  const char* code_start = relocations + num_relocations * 8;
+  code->assign(code_start, code_start + code_size);
+  for (uint64_t i = 0; i < num_relocations; ++i) {
+    uint32_t offset = read_u32(relocations + i * 8);
+    uint32_t helper = read_u32(relocations + i * 8 + 4);
+    if (helper >= static_cast<uint32_t>(HostHelper::NUM_HELPERS) ||
+        offset + 8ull > code_size) {
+      std::cerr << "Warning: ignoring corrupt JIT cache entry " << entry_path_
+                << "\n";
+      return false;
+    }
+    uint64_t address = reinterpret_cast<uint64_t>(helpers[helper]);
+    memcpy(code->data() + offset, &address, sizeof(address));
+  }
+
+  if (verbose_) {
+    std::cout << "* jit cache: hit (" << entry_path_ << ", " << code_size
+              << " bytes, loaded in " << t.elapsed() << "s)\n";
+  }
+  return true;
+}
+
+void JitCache::store(const std::vector<uint8_t>& code,
+                     const std::vector<Relocation>& relocations) {
+  if (!enabled_) {
+    return;
+  }
+
+  std::string out(kCacheMagic, sizeof(kCacheMagic));
+  append_raw(&out, kCacheVersion);
+  append_raw(&out, key_);
+  append_raw(&out, static_cast<uint64_t>(code.size()));
+  append_raw(&out, static_cast<uint64_t>(relocations.size()));
+  for (const Relocation& r : relocations) {
+    append_raw(&out, r.offset);
+    append_raw(&out, static_cast<uint32_t>(r.helper));
+  }
+  out.append(reinterpret_cast<const char*>(code.data()), code.size());
+
+  std::string tmp_path = entry_path_ + ".tmp" + std::to_string(getpid());
+  FILE* outfile = fopen(tmp_path.c_str(), "wb");
+  bool ok = outfile != nullptr;
+  if (ok) {
+    ok = fwrite(out.data(), 1, out.size(), outfile) == out.size();
+    ok = fclose(outfile) == 0 && ok;
+  }
+  ok = ok && rename(tmp_path.c_str(), entry_path_.c_str()) == 0;
+  if (!ok) {
+    unlink(tmp_path.c_str());
+    std::cerr << "Warning: unable to write JIT cache entry " << entry_path_
+              << "\n";
+  } else if (verbose_) {
+    std::cout << "* jit cache: stored " << code.size() << " bytes to "
+              << entry_path_ << "\n";
+  }
+}
@@ -0,0 +1,61 @@
+// Persistent on-disk cache of JITed code.
+//
+// The optimizing JITs emit position-independent code: jumps are relative and
+// the only absolute addresses are those of the host helpers (myputchar etc.),
+// each loaded with a movabs whose immediate is listed in a relocation table.
+// A cache entry stores the code with that table, so a later run of the same
+// program only has to patch in the current helper addresses and map the code
+// executable.
+#ifndef JIT_CACHE_H
+#define JIT_CACHE_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "utils.h"
+
+// Host functions called from JITed code. The values index the helper address
+// table passed to JitCache::lookup.
+enum class HostHelper : uint32_t {
+  PUTCHAR = 0,
+  GETCHAR,
+  MEMCPY,
+  WRITE,
+  NUM_HELPERS
+};
+
+// Marks an 8-byte little-endian helper address embedded in JITed code.
+struct Relocation {
+  uint32_t offset;
+  HostHelper helper;
+};
+
+class JitCache {
+public:
+  // Opens the cache entry for the BF program at bf_file_path compiled by
+  // engine. Besides the source, the key covers the flags that affect the
+  // emitted code and the running executable, so a rebuild with a changed
+  // translator or emitter never gets code cached by an older build. The
+  // cache is disabled (lookups miss, stores are dropped) with --no-cache,
+  // with --emit-bfo, whose ops only come out of a translation, or when
+  // there's no source file to key it on.
+  JitCache(const std::string& engine, const std::string& bf_file_path,
+           const Flags& flags);
+
+  // On a hit, puts the cached code into *code with the addresses from helpers
+  // patched in, and returns true.
+  bool lookup(const void* const* helpers, std::vector<uint8_t>* code);
+
+  // Saves code and its relocations as this program's entry.
+  void store(const std::vector<uint8_t>& code,
+             const std::vector<Relocation>& relocations);
+
+private:
+  bool enabled_;
+  bool verbose_;
+  uint64_t key_;
+  std::string entry_path_;
+};
+
+#endif /* JIT_CACHE_H */
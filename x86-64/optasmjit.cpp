@@ -2,19 +2,28 @@
 //
 // Eli Bendersky [http://eli.thegreenplace.net]
 // This code is in the public domain.
-#include <fstream>
+#include <algorithm>
+#include <cstring>
 #include <iomanip>
 #include <stack>
 #include <asmjit/asmjit.h>
 
+#include "jit_cache.h"
+#include "jit_utils.h"
 #include "optutils.h"
 #include "parser.h"
+#include "streaming.h"
 #include "utils.h"
 
 using namespace optutils;
 
 constexpr int MEMORY_SIZE = 30000;
 
+// Vector scans load 16-cell windows that may overhang the cells they scan by
+// up to 15 cells, and BLOCK_ADD windows may run up to kMaxBlockAddWidth - 1
+// cells past the last cell they change, so the tape is padded on both ends.
+constexpr int MEMORY_PADDING = kMaxBlockAddWidth;
+
 namespace {
 
 // This function will be invoked from JITed code; not using putchar directly
@@ -29,53 +38,278 @@ uint8_t mygetchar() {
   return getchar();
 }
 
-struct BracketLabels {
-  BracketLabels(const asmjit::Label& ol, const asmjit::Label& cl)
-      : open_label(ol), close_label(cl) {}
+// Copies a TAPE_SNAPSHOT constant to the tape.
+void mymemcpy(uint8_t* dst, const uint8_t* src, uint32_t size) {
+  memcpy(dst, src, size);
+}
 
-  asmjit::Label open_label;
-  asmjit::Label close_label;
+// Writes a WRITE_STRING constant; it shares stdout's buffer with myputchar.
+void mywrite(const uint8_t* data, uint32_t size) {
+  fwrite(data, 1, size, stdout);
+}
+
+// Addresses of the host helpers, indexed by HostHelper.
+const void* const kHostHelpers[] = {
+    reinterpret_cast<const void*>(myputchar),
+    reinterpret_cast<const void*>(mygetchar),
+    reinterpret_cast<const void*>(mymemcpy),
+    reinterpret_cast<const void*>(mywrite),
 };
 
-} // namespace
+// Emits a call to helper. The helper's address is loaded with a movabs that's
+// listed in relocations, so the code stays valid when it's loaded from the
+// cache in another process:
+//
+//   movabs rax, <helper>
+//   call rax
+void emit_helper_call(asmjit::X86Assembler& assm, HostHelper helper,
+                      std::vector<Relocation>* relocations) {
+  const uint8_t movabs_rax[] = {0x48, 0xB8};
+  assm.embed(movabs_rax, sizeof(movabs_rax));
+  relocations->push_back(
+      Relocation{static_cast<uint32_t>(assm.getOffset()), helper});
+  uint64_t address =
+      reinterpret_cast<uint64_t>(kHostHelpers[static_cast<size_t>(helper)]);
+  assm.embed(&address, sizeof(address));
+  assm.call(asmjit::x86::rax);
+}
 
-void optasmjit(const Program& p, bool verbose) {
-  // Initialize state.
-  std::vector<uint8_t> memory(MEMORY_SIZE, 0);
-  std::stack<BracketLabels> open_bracket_stack;
+// For LOOP_MOVE_PTR with a stride of +-1, 2, 4 or 8, returns the mask of the
+// lanes the stride lands on in a 16-cell window that starts at the data
+// pointer (going forward) or ends at it (going backward). Returns 0 for other
+// strides, which can't be scanned with vectors.
+uint32_t scan_lanes(int64_t stride) {
+  switch (stride) {
+  case 1:
+  case -1:
+    return 0xFFFF;
+  case 2:
+    return 0x5555;
+  case -2:
+    return 0xAAAA;
+  case 4:
+    return 0x1111;
+  case -4:
+    return 0x8888;
+  case 8:
+    return 0x0101;
+  case -8:
+    return 0x8080;
+  default:
+    return 0;
+  }
+}
 
-  const std::vector<BfOp> ops = translate_program(p);
+// Emits LOOP_MOVE_PTR for a stride scan_lanes accepts, scanning 16 cells at a
+// time with SSE2:
+//
+//   cmpb 0(%r13), 0
+//   jz done
+//   pxor xmm1, xmm1
+// loop:
+//   movdqu xmm0, [r13]          ; [r13-15] going backward
+//   pcmpeqb xmm0, xmm1
+//   pmovmskb eax, xmm0
+//   and eax, lanes
+//   jnz found
+//   add r13, 16                 ; sub going backward
+//   jmp loop
+// found:
+//   bsf eax, eax                ; bsr going backward
+//   lea r13, [r13+rax]          ; [r13+rax-15] going backward
+// done:
+void emit_vector_scan(asmjit::X86Assembler& assm, int64_t stride) {
+  asmjit::X86Gp dataptr = asmjit::x86::r13;
+  asmjit::Label loop = assm.newLabel();
+  asmjit::Label found = assm.newLabel();
+  asmjit::Label done = assm.newLabel();
+  bool forward = stride > 0;
+
+  assm.cmp(asmjit::x86::byte_ptr(dataptr), 0);
+  assm.jz(done);
+  assm.pxor(asmjit::x86::xmm1, asmjit::x86::xmm1);
+  assm.bind(loop);
+  assm.movdqu(asmjit::x86::xmm0,
+              asmjit::x86::ptr(dataptr, forward ? 0 : -15));
+  assm.pcmpeqb(asmjit::x86::xmm0, asmjit::x86::xmm1);
+  assm.pmovmskb(asmjit::x86::eax, asmjit::x86::xmm0);
+  assm.and_(asmjit::x86::eax, scan_lanes(stride));
+  assm.jnz(found);
+  if (forward) {
+    assm.add(dataptr, 16);
+  } else {
+    assm.sub(dataptr, 16);
+  }
+  assm.jmp(loop);
+  assm.bind(found);
+  if (forward) {
+    assm.bsf(asmjit::x86::eax, asmjit::x86::eax);
+    assm.lea(dataptr, asmjit::x86::ptr(dataptr, asmjit::x86::rax));
+  } else {
+    assm.bsr(asmjit::x86::eax, asmjit::x86::eax);
+    assm.lea(dataptr, asmjit::x86::ptr(dataptr, asmjit::x86::rax, 0, -15));
+  }
+  assm.bind(done);
+}
 
-  if (verbose) {
-    std::cout << "==== OPS ====\n";
-    for (size_t i = 0; i < ops.size(); ++i) {
-      std::cout << std::setw(4) << std::left << i << " ";
-      std::cout << BfOpKind_name(ops[i].kind) << " " << ops[i].argument << "\n";
+// Longest range cleared or copied with unrolled stores; longer ones use
+// rep stosb/movsb.
+constexpr int32_t kMaxUnrolledRange = 256;
+
+// Emits rep stosb, which clears rcx bytes at rdi with al = 0, or rep movsb,
+// which copies rcx bytes from rsi to rdi.
+void emit_rep_string(asmjit::X86Assembler& assm, bool is_copy) {
+  const uint8_t rep_stosb[] = {0xF3, 0xAA};
+  const uint8_t rep_movsb[] = {0xF3, 0xA4};
+  assm.embed(is_copy ? rep_movsb : rep_stosb, 2);
+}
+
+// Emits MEMSET_RANGE for length cells at offset:
+//
+//   pxor xmm0, xmm0                  ; 16 cells or more
+//   movdqu [r13+offset], xmm0        ; every 16 cells, the last store ending
+//   ...                              ; at the last cell
+//
+//   mov qword [r13+offset], 0        ; 8 to 15 cells (dword for 4 to 7,
+//   mov qword [r13+offset+length-8], 0  ; bytes below that)
+//
+//   lea rdi, [r13+offset]            ; over kMaxUnrolledRange cells
+//   xor eax, eax
+//   mov ecx, length
+//   rep stosb
+void emit_memset(asmjit::X86Assembler& assm, int32_t offset, int32_t length) {
+  asmjit::X86Gp dataptr = asmjit::x86::r13;
+  if (length > kMaxUnrolledRange) {
+    assm.lea(asmjit::x86::rdi, asmjit::x86::ptr(dataptr, offset));
+    assm.xor_(asmjit::x86::eax, asmjit::x86::eax);
+    assm.mov(asmjit::x86::ecx, length);
+    emit_rep_string(assm, false);
+  } else if (length >= 16) {
+    assm.pxor(asmjit::x86::xmm0, asmjit::x86::xmm0);
+    for (int32_t i = 0; i < length; i += 16) {
+      int32_t at = std::min(i, length - 16);
+      assm.movdqu(asmjit::x86::ptr(dataptr, offset + at), asmjit::x86::xmm0);
+    }
+  } else if (length >= 8) {
+    assm.mov(asmjit::x86::qword_ptr(dataptr, offset), 0);
+    assm.mov(asmjit::x86::qword_ptr(dataptr, offset + length - 8), 0);
+  } else if (length >= 4) {
+    assm.mov(asmjit::x86::dword_ptr(dataptr, offset), 0);
+    assm.mov(asmjit::x86::dword_ptr(dataptr, offset + length - 4), 0);
+  } else {
+    for (int32_t i = 0; i < length; ++i) {
+      assm.mov(asmjit::x86::byte_ptr(dataptr, offset + i), 0);
     }
-    std::cout << "=============\n";
   }
+}
 
-  // Initialize asmjit's JIT runtime, code holder and assembler.
-  asmjit::JitRuntime jit_runtime;
-  asmjit::CodeHolder code;
-  code.init(jit_runtime.getCodeInfo());
-  asmjit::X86Assembler assm(&code);
+// Emits a copy of length cells from source to destination, which don't
+// overlap, the way emit_memset clears them: movdqu loads and stores through
+// xmm0, 8- or 4-byte ones through rax and rcx, or rep movsb from rsi to rdi.
+void emit_memcpy(asmjit::X86Assembler& assm, int32_t destination,
+                 int32_t source, int32_t length) {
+  asmjit::X86Gp dataptr = asmjit::x86::r13;
+  if (length > kMaxUnrolledRange) {
+    assm.lea(asmjit::x86::rsi, asmjit::x86::ptr(dataptr, source));
+    assm.lea(asmjit::x86::rdi, asmjit::x86::ptr(dataptr, destination));
+    assm.mov(asmjit::x86::ecx, length);
+    emit_rep_string(assm, true);
+  } else if (length >= 16) {
+    for (int32_t i = 0; i < length; i += 16) {
+      int32_t at = std::min(i, length - 16);
+      assm.movdqu(asmjit::x86::xmm0, asmjit::x86::ptr(dataptr, source + at));
+      assm.movdqu(asmjit::x86::ptr(dataptr, destination + at),
+                  asmjit::x86::xmm0);
+    }
+  } else if (length >= 4) {
+    int32_t size = length >= 8 ? 8 : 4;
+    asmjit::X86Gp first = size == 8 ? asmjit::x86::rax : asmjit::x86::eax;
+    asmjit::X86Gp last = size == 8 ? asmjit::x86::rcx : asmjit::x86::ecx;
+    assm.mov(first, asmjit::x86::ptr(dataptr, source, size));
+    assm.mov(last, asmjit::x86::ptr(dataptr, source + length - size, size));
+    assm.mov(asmjit::x86::ptr(dataptr, destination, size), first);
+    assm.mov(asmjit::x86::ptr(dataptr, destination + length - size, size),
+             last);
+  } else {
+    for (int32_t i = 0; i < length; ++i) {
+      assm.mov(asmjit::x86::al, asmjit::x86::byte_ptr(dataptr, source + i));
+      assm.mov(asmjit::x86::byte_ptr(dataptr, destination + i),
+               asmjit::x86::al);
+    }
+  }
+}
 
-  // Registers used in the program:
-  //
-  // r13: the data pointer
-  // r14 and rax: used temporarily for some instructions
-  // rdi: parameter from the host -- the host passes the address of memory
-  // here.
+// Most cell updates an IF body may have to be emitted without branches.
+constexpr size_t kMaxBranchlessIfOps = 4;
+
+// If the IF_BEGIN at ops[pc] guards nothing but a few cell updates, returns
+// the index of its IF_END; otherwise returns 0.
+size_t branchless_if_end(const std::vector<BfOp>& ops, size_t pc) {
+  for (size_t i = pc + 1; i < ops.size() && i <= pc + 1 + kMaxBranchlessIfOps;
+       ++i) {
+    switch (ops[i].kind) {
+    case BfOpKind::IF_END:
+      return i;
+    case BfOpKind::INC_DATA:
+    case BfOpKind::DEC_DATA:
+    case BfOpKind::SET_DATA:
+    case BfOpKind::LOOP_SET_TO_ZERO:
+      break;
+    default:
+      return 0;
+    }
+  }
+  return 0;
+}
 
-  asmjit::X86Gp dataptr = asmjit::x86::r13;
+// Callee-saved registers that hold the trip counts of counted loops, by
+// nesting depth. Loops nested deeper test their cell instead.
+const asmjit::X86Gp kCounterRegs[] = {asmjit::x86::rbx, asmjit::x86::r12,
+                                      asmjit::x86::r14, asmjit::x86::r15};
+constexpr int kNumCounterRegs = 4;
 
-  // We pass the data pointer as an argument to the JITed function, so it's
-  // expected to be in rdi. Move it to r13.
-  assm.mov(dataptr, asmjit::x86::rdi);
+struct BracketLabels {
+  BracketLabels(const asmjit::Label& ol, const asmjit::Label& cl,
+                int counter_param = -1, int num_counters_param = 0)
+      : open_label(ol), close_label(cl), counter(counter_param),
+        num_counters(num_counters_param) {}
+
+  asmjit::Label open_label;
+  asmjit::Label close_label;
+
+  // Index in kCounterRegs of the loop's trip count, or -1 if it's not kept in
+  // a register; and the number of counter registers in use inside the loop.
+  int counter;
+  int num_counters;
+};
+
+// Returns the number of counter registers in use by the loops on stack.
+int counters_in_use(const std::stack<BracketLabels>& stack) {
+  return stack.empty() ? 0 : stack.top().num_counters;
+}
+
+// Constant data the code refers to RIP-relatively; it's emitted at label after
+// the code.
+struct EmbeddedConstant {
+  asmjit::Label label;
+  std::string data;
+};
+
+// Emits code for the ops of program into assm. Brackets left open at the end
+// of the ops stay on open_bracket_stack, so a program can be emitted in several
+// pieces. Helper calls are recorded in relocations, and the constants used in
+// constants.
+void emit_ops(asmjit::X86Assembler& assm, const OpProgram& program,
+              std::stack<BracketLabels>* open_bracket_stack,
+              std::vector<Relocation>* relocations,
+              std::vector<EmbeddedConstant>* constants) {
+  asmjit::X86Gp dataptr = asmjit::x86::r13;
+  const std::vector<BfOp>& ops = program.ops;
 
   for (size_t pc = 0; pc < ops.size(); ++pc) {
     BfOp op = ops[pc];
+    // The cell data and I/O ops work on, at op.offset from the data pointer.
+    asmjit::X86Mem cell = asmjit::x86::byte_ptr(dataptr, op.offset);
     switch (op.kind) {
     case BfOpKind::INC_PTR:
       assm.add(dataptr, op.argument);
@@ -84,31 +318,93 @@ void optasmjit(const Program& p, bool verbose) {
       assm.sub(dataptr, op.argument);
       break;
     case BfOpKind::INC_DATA:
-      assm.add(asmjit::x86::byte_ptr(dataptr), op.argument);
+      assm.add(cell, op.argument);
       break;
     case BfOpKind::DEC_DATA:
-      assm.sub(asmjit::x86::byte_ptr(dataptr), op.argument);
+      assm.sub(cell, op.argument);
       break;
     case BfOpKind::WRITE_STDOUT:
       for (int i = 0; i < op.argument; ++i) {
-        // call myputchar [dataptr]
-        assm.movzx(asmjit::x86::rdi, asmjit::x86::byte_ptr(dataptr));
-        assm.call(asmjit::imm_ptr(myputchar));
+        // call myputchar [dataptr+offset]
+        assm.movzx(asmjit::x86::rdi, cell);
+        emit_helper_call(assm, HostHelper::PUTCHAR, relocations);
       }
       break;
     case BfOpKind::READ_STDIN:
       for (int i = 0; i < op.argument; ++i) {
-        // [dataptr] = call mygetchar
+        // [dataptr+offset] = call mygetchar
         // Store only the low byte to memory to avoid overwriting unrelated
         // data.
-        assm.call(asmjit::imm_ptr(mygetchar));
-        assm.mov(asmjit::x86::byte_ptr(dataptr), asmjit::x86::al);
+        emit_helper_call(assm, HostHelper::GETCHAR, relocations);
+        assm.mov(cell, asmjit::x86::al);
       }
       break;
     case BfOpKind::LOOP_SET_TO_ZERO:
-      assm.mov(asmjit::x86::byte_ptr(dataptr), 0);
+      assm.mov(cell, 0);
       break;
+    case BfOpKind::SET_DATA:
+      assm.mov(cell, static_cast<uint8_t>(op.argument));
+      break;
+    case BfOpKind::TAPE_SNAPSHOT:
+    case BfOpKind::WRITE_STRING: {
+      // The constant is embedded after the code and passed to the helper by
+      // address:
+      //
+      //   lea rdi, [r13+offset]          ; TAPE_SNAPSHOT
+      //   lea rsi, [constant]
+      //   mov edx, size
+      //   call mymemcpy
+      //
+      //   lea rdi, [constant]            ; WRITE_STRING
+      //   mov esi, size
+      //   call mywrite
+      size_t size;
+      const uint8_t* data =
+          get_constant(program.constants, op.argument, &size);
+      asmjit::Label label = assm.newLabel();
+      constants->push_back(EmbeddedConstant{
+          label, std::string(reinterpret_cast<const char*>(data), size)});
+      if (op.kind == BfOpKind::TAPE_SNAPSHOT) {
+        assm.lea(asmjit::x86::rdi, asmjit::x86::ptr(dataptr, op.offset));
+        assm.lea(asmjit::x86::rsi, asmjit::x86::ptr(label));
+        assm.mov(asmjit::x86::edx, size);
+        emit_helper_call(assm, HostHelper::MEMCPY, relocations);
+      } else {
+        assm.lea(asmjit::x86::rdi, asmjit::x86::ptr(label));
+        assm.mov(asmjit::x86::esi, size);
+        emit_helper_call(assm, HostHelper::WRITE, relocations);
+      }
+      break;
+    }
+    case BfOpKind::BLOCK_ADD: {
+      // The deltas are embedded after the code and added 16 cells at a time:
+      //
+      //   movdqu xmm0, [r13+offset]
+      //   movdqu xmm1, [constant]
+      //   paddb xmm0, xmm1
+      //   movdqu [r13+offset], xmm0
+      //   ...                              ; at +16 for a 32-cell window
+      size_t size;
+      const uint8_t* data =
+          get_constant(program.constants, op.argument, &size);
+      asmjit::Label label = assm.newLabel();
+      constants->push_back(EmbeddedConstant{
+          label, std::string(reinterpret_cast<const char*>(data), size)});
+      for (int32_t i = 0; i < static_cast<int32_t>(size); i += 16) {
+        asmjit::X86Mem cells = asmjit::x86::ptr(dataptr, op.offset + i);
+        assm.movdqu(asmjit::x86::xmm0, cells);
+        assm.movdqu(asmjit::x86::xmm1, asmjit::x86::ptr(label, i));
+        assm.paddb(asmjit::x86::xmm0, asmjit::x86::xmm1);
+        assm.movdqu(cells, asmjit::x86::xmm0);
+      }
+      break;
+    }
     case BfOpKind::LOOP_MOVE_PTR: {
+      if (scan_lanes(op.argument)) {
+        emit_vector_scan(assm, op.argument);
+        break;
+      }
+
       asmjit::Label loop = assm.newLabel();
       asmjit::Label endloop = assm.newLabel();
       // Emit a loop that moves the pointer in jumps of op.argument; it's
@@ -135,31 +431,214 @@ void optasmjit(const Program& p, bool verbose) {
       break;
     }
     case BfOpKind::LOOP_MOVE_DATA: {
-      // Only move if the current data isn't 0:
+      // Only move if the data at offset isn't 0:
       //
-      //   cmpb 0(%r13), 0
+      //   cmpb offset(%r13), 0
       //   jz skip_move
       //   <...> move data
       // skip_move:
       asmjit::Label skip_move = assm.newLabel();
-      assm.cmp(asmjit::x86::byte_ptr(dataptr), 0);
+      assm.cmp(cell, 0);
       assm.jz(skip_move);
 
-      assm.mov(asmjit::x86::r14, dataptr);
-      if (op.argument < 0) {
-        assm.sub(asmjit::x86::r14, -op.argument);
-      } else {
-        assm.add(asmjit::x86::r14, op.argument);
-      }
       // Use rax as a temporary holding the value of at the original pointer;
       // then use al to add it to the new location, so that only the target
-      // location is affected: addb %al, 0(%r13)
-      assm.movzx(asmjit::x86::rax, asmjit::x86::byte_ptr(dataptr));
-      assm.add(asmjit::x86::byte_ptr(asmjit::x86::r14), asmjit::x86::al);
-      assm.mov(asmjit::x86::byte_ptr(dataptr), 0);
+      // location is affected: addb %al, (offset+argument)(%r13)
+      assm.movzx(asmjit::x86::rax, cell);
+      assm.add(asmjit::x86::byte_ptr(dataptr, op.offset + op.argument),
+               asmjit::x86::al);
+      assm.mov(cell, 0);
       assm.bind(skip_move);
       break;
     }
+    case BfOpKind::LOOP_MUL_ADD: {
+      // Only run if the data at offset isn't 0; the count stays in eax and
+      // each operand adds a multiple of it to its target:
+      //
+      //   movzx eax, byte [r13+offset]
+      //   test al, al
+      //   jz skip
+      //   add byte [r13+target], al        ; multiplier 1
+      //   sub byte [r13+target], al        ; multiplier -1
+      //   imul ecx, eax, multiplier        ; other multipliers
+      //   add byte [r13+target], cl
+      //   ...
+      //   mov byte [r13+offset], 0
+      // skip:
+      asmjit::Label skip = assm.newLabel();
+      assm.movzx(asmjit::x86::eax, cell);
+      assm.test(asmjit::x86::al, asmjit::x86::al);
+      assm.jz(skip);
+      for (int64_t i = 1; i <= op.argument; ++i) {
+        const BfOp& operand = ops[pc + i];
+        asmjit::X86Mem target =
+            asmjit::x86::byte_ptr(dataptr, op.offset + operand.offset);
+        if (operand.argument == 1) {
+          assm.add(target, asmjit::x86::al);
+        } else if (operand.argument == -1) {
+          assm.sub(target, asmjit::x86::al);
+        } else {
+          assm.imul(asmjit::x86::ecx, asmjit::x86::eax, operand.argument);
+          assm.add(target, asmjit::x86::cl);
+        }
+      }
+      assm.mov(cell, 0);
+      assm.bind(skip);
+      pc += op.argument;
+      break;
+    }
+    case BfOpKind::MUL_ADD_OPERAND:
+      DIE << "MUL_ADD_OPERAND outside of LOOP_MUL_ADD on pc=" << pc;
+      break;
+    case BfOpKind::LOOP_CLOSED_FORM: {
+      // Only run if the data at offset isn't 0. ecx holds n - 1, and the new
+      // value of each target is summed up in edx and pushed, since later
+      // targets may still need the old values; the values are then popped
+      // into their cells in reverse:
+      //
+      //   movzx ecx, byte [r13+offset]
+      //   test ecx, ecx
+      //   jz skip
+      //   dec ecx
+      //   xor edx, edx                     ; for each target
+      //   imul eax, ecx, step              ; for each term
+      //   add eax, base
+      //   movzx esi, byte [r13+source]     ; the term's cell, unless constant
+      //   imul eax, esi
+      //   add edx, eax
+      //   ...
+      //   push rdx
+      //   ...
+      //   pop rax                          ; for each target, last first
+      //   mov byte [r13+target], al
+      //   ...
+      //   mov byte [r13+offset], 0
+      // skip:
+      asmjit::Label skip = assm.newLabel();
+      assm.movzx(asmjit::x86::ecx, cell);
+      assm.test(asmjit::x86::ecx, asmjit::x86::ecx);
+      assm.jz(skip);
+      assm.dec(asmjit::x86::ecx);
+      std::vector<int32_t> targets;
+      for (int64_t i = 1; i <= op.argument; ++i) {
+        const BfOp& term_op = ops[pc + i];
+        ClosedFormTerm term = decode_closed_form_term(term_op.argument);
+        if (targets.empty() || targets.back() != term_op.offset) {
+          targets.push_back(term_op.offset);
+          assm.xor_(asmjit::x86::edx, asmjit::x86::edx);
+        }
+        if (term.step) {
+          assm.imul(asmjit::x86::eax, asmjit::x86::ecx, term.step);
+          assm.add(asmjit::x86::eax, term.base);
+        } else {
+          assm.mov(asmjit::x86::eax, term.base);
+        }
+        if (!term.is_constant) {
+          assm.movzx(asmjit::x86::esi,
+                     asmjit::x86::byte_ptr(dataptr, op.offset + term.source));
+          assm.imul(asmjit::x86::eax, asmjit::x86::esi);
+        }
+        assm.add(asmjit::x86::edx, asmjit::x86::eax);
+        if (i == op.argument || ops[pc + i + 1].offset != term_op.offset) {
+          assm.push(asmjit::x86::rdx);
+        }
+      }
+      for (auto it = targets.rbegin(); it != targets.rend(); ++it) {
+        assm.pop(asmjit::x86::rax);
+        assm.mov(asmjit::x86::byte_ptr(dataptr, op.offset + *it),
+                 asmjit::x86::al);
+      }
+      assm.mov(cell, 0);
+      assm.bind(skip);
+      pc += op.argument;
+      break;
+    }
+    case BfOpKind::CLOSED_FORM_TERM:
+      DIE << "CLOSED_FORM_TERM outside of LOOP_CLOSED_FORM on pc=" << pc;
+      break;
+    case BfOpKind::DIVMOD: {
+      // Checks the preconditions, jumping to skip (where the original loop
+      // follows) if one fails, then divides with eax = n, ecx = d and adds
+      // the results up in r8d for each target:
+      //
+      //   movzx eax, byte [r13+offset]
+      //   movzx ecx, byte [r13+divisor]    ; mov ecx, divisor if constant
+      //   cmp eax, below                   ; for each DIVIDEND_BELOW
+      //   jae skip
+      //   cmp byte [r13+cell], 0           ; for each ZERO_CELL
+      //   jne skip
+      //   cmp ecx, 2
+      //   jb skip
+      //   mov esi, eax
+      //   xor edx, edx
+      //   div ecx                          ; eax = n / d, edx = n % d
+      //   xor r8d, r8d                     ; for each ADD_RESULT
+      //   imul r9d, esi, dividend          ; for each nonzero coefficient
+      //   add r8d, r9d
+      //   ...
+      //   add byte [r13+target], r8b
+      //   ...
+      //   mov byte [r13+offset], 0
+      // skip:
+      asmjit::Label skip = assm.newLabel();
+      assm.movzx(asmjit::x86::eax, cell);
+      for (int64_t i = 1; i <= op.argument; ++i) {
+        const BfOp& operand_op = ops[pc + i];
+        DivmodOperand operand = decode_divmod_operand(operand_op.argument);
+        asmjit::X86Mem operand_cell =
+            asmjit::x86::byte_ptr(dataptr, op.offset + operand_op.offset);
+        switch (operand.role) {
+        case DivmodOperand::Role::DIVISOR_CELL:
+          assm.movzx(asmjit::x86::ecx, operand_cell);
+          break;
+        case DivmodOperand::Role::DIVISOR_CONSTANT:
+          assm.mov(asmjit::x86::ecx, operand.value);
+          break;
+        case DivmodOperand::Role::DIVIDEND_BELOW:
+          assm.cmp(asmjit::x86::eax, operand.value);
+          assm.jae(skip);
+          break;
+        case DivmodOperand::Role::ZERO_CELL:
+          assm.cmp(operand_cell, 0);
+          assm.jne(skip);
+          break;
+        case DivmodOperand::Role::ADD_RESULT:
+          break;
+        }
+      }
+      assm.cmp(asmjit::x86::ecx, 2);
+      assm.jb(skip);
+      assm.mov(asmjit::x86::esi, asmjit::x86::eax);
+      assm.xor_(asmjit::x86::edx, asmjit::x86::edx);
+      assm.div(asmjit::x86::ecx);
+      for (int64_t i = 1; i <= op.argument; ++i) {
+        const BfOp& operand_op = ops[pc + i];
+        DivmodOperand operand = decode_divmod_operand(operand_op.argument);
+        if (operand.role != DivmodOperand::Role::ADD_RESULT) {
+          continue;
+        }
+        assm.xor_(asmjit::x86::r8d, asmjit::x86::r8d);
+        const std::pair<asmjit::X86Gp, int8_t> terms[] = {
+            {asmjit::x86::esi, operand.dividend},
+            {asmjit::x86::edx, operand.remainder},
+            {asmjit::x86::eax, operand.quotient}};
+        for (const auto& term : terms) {
+          if (term.second) {
+            assm.imul(asmjit::x86::r9d, term.first, term.second);
+            assm.add(asmjit::x86::r8d, asmjit::x86::r9d);
+          }
+        }
+        assm.add(asmjit::x86::byte_ptr(dataptr, op.offset + operand_op.offset),
+                 asmjit::x86::r8b);
+      }
+      assm.mov(cell, 0);
+      assm.bind(skip);
+      pc += op.argument;
+      break;
+    }
+    case BfOpKind::DIVMOD_OPERAND:
+      DIE << "DIVMOD_OPERAND outside of DIVMOD on pc=" << pc;
+      break;
     case BfOpKind::JUMP_IF_DATA_ZERO: {
       assm.cmp(asmjit::x86::byte_ptr(dataptr), 0);
       asmjit::Label open_label = assm.newLabel();
@@ -179,16 +658,17 @@ void optasmjit(const Program& p, bool verbose) {
       assm.bind(open_label);
 
       // Save both labels on the stack.
-      open_bracket_stack.push(BracketLabels(open_label, close_label));
+      open_bracket_stack->push(BracketLabels(
+          open_label, close_label, -1, counters_in_use(*open_bracket_stack)));
       break;
     }
     case BfOpKind::JUMP_IF_DATA_NOT_ZERO: {
       // These ops have to be properly nested!
-      if (open_bracket_stack.empty()) {
+      if (open_bracket_stack->empty()) {
         DIE << "unmatched closing ']' at pc=" << pc;
       }
-      BracketLabels labels = open_bracket_stack.top();
-      open_bracket_stack.pop();
+      BracketLabels labels = open_bracket_stack->top();
+      open_bracket_stack->pop();
 
       //    cmpb 0(%r13), 0
       //    jnz open_label
@@ -199,42 +679,294 @@ void optasmjit(const Program& p, bool verbose) {
       assm.bind(labels.close_label);
       break;
     }
+    case BfOpKind::COUNTED_LOOP_BEGIN: {
+      // The trip count is loaded into the next free counter register:
+      //
+      //    movzx rbx, byte [r13]
+      //    test rbx, rbx
+      //    jz close_label
+      // open_label:
+      //    ...
+      //
+      // With no register free, it's emitted like JUMP_IF_DATA_ZERO.
+      int num_counters = counters_in_use(*open_bracket_stack);
+      asmjit::Label open_label = assm.newLabel();
+      asmjit::Label close_label = assm.newLabel();
+      if (num_counters < kNumCounterRegs) {
+        asmjit::X86Gp counter = kCounterRegs[num_counters];
+        assm.movzx(counter, asmjit::x86::byte_ptr(dataptr));
+        assm.test(counter, counter);
+        assm.jz(close_label);
+        assm.bind(open_label);
+        open_bracket_stack->push(BracketLabels(open_label, close_label,
+                                               num_counters, num_counters + 1));
+      } else {
+        assm.cmp(asmjit::x86::byte_ptr(dataptr), 0);
+        assm.jz(close_label);
+        assm.bind(open_label);
+        open_bracket_stack->push(
+            BracketLabels(open_label, close_label, -1, num_counters));
+      }
+      break;
+    }
+    case BfOpKind::COUNTED_LOOP_END: {
+      if (open_bracket_stack->empty()) {
+        DIE << "unmatched closing ']' at pc=" << pc;
+      }
+      BracketLabels labels = open_bracket_stack->top();
+      open_bracket_stack->pop();
+
+      // The back-edge counts down the register instead of reading the cell:
+      //
+      //    dec rbx
+      //    jnz open_label
+      // close_label:
+      if (labels.counter >= 0) {
+        assm.dec(kCounterRegs[labels.counter]);
+      } else {
+        assm.cmp(asmjit::x86::byte_ptr(dataptr), 0);
+      }
+      assm.jnz(labels.open_label);
+      assm.bind(labels.close_label);
+      break;
+    }
+    case BfOpKind::IF_BEGIN: {
+      // The body of a small IF is run unconditionally on a mask of the
+      // cell's test, so there's no branch to mispredict:
+      //
+      //    cmp byte [r13], 0
+      //    setne al
+      //    movzx eax, al
+      //    neg eax                          ; -1 if the body runs, else 0
+      //    mov ecx, delta                   ; INC_DATA/DEC_DATA
+      //    and ecx, eax
+      //    add byte [r13+offset], cl
+      //    movzx ecx, byte [r13+offset]     ; SET_DATA/LOOP_SET_TO_ZERO
+      //    xor ecx, value
+      //    and ecx, eax
+      //    xor byte [r13+offset], cl
+      //
+      // Other IFs are emitted like JUMP_IF_DATA_ZERO, and their IF_END only
+      // binds close_label.
+      size_t end = branchless_if_end(ops, pc);
+      if (end) {
+        assm.cmp(asmjit::x86::byte_ptr(dataptr), 0);
+        assm.setne(asmjit::x86::al);
+        assm.movzx(asmjit::x86::eax, asmjit::x86::al);
+        assm.neg(asmjit::x86::eax);
+        for (size_t i = pc + 1; i < end; ++i) {
+          const BfOp& update = ops[i];
+          asmjit::X86Mem target = asmjit::x86::byte_ptr(dataptr, update.offset);
+          if (update.kind == BfOpKind::INC_DATA ||
+              update.kind == BfOpKind::DEC_DATA) {
+            uint8_t delta = update.kind == BfOpKind::INC_DATA
+                                ? update.argument
+                                : -update.argument;
+            assm.mov(asmjit::x86::ecx, delta);
+            assm.and_(asmjit::x86::ecx, asmjit::x86::eax);
+            assm.add(target, asmjit::x86::cl);
+          } else {
+            uint8_t value =
+                update.kind == BfOpKind::SET_DATA ? update.argument : 0;
+            assm.movzx(asmjit::x86::ecx, target);
+            assm.xor_(asmjit::x86::ecx, value);
+            assm.and_(asmjit::x86::ecx, asmjit::x86::eax);
+            assm.xor_(target, asmjit::x86::cl);
+          }
+        }
+        pc = end;
+        break;
+      }
+      asmjit::Label open_label = assm.newLabel();
+      asmjit::Label close_label = assm.newLabel();
+      assm.cmp(asmjit::x86::byte_ptr(dataptr), 0);
+      assm.jz(close_label);
+      assm.bind(open_label);
+      open_bracket_stack->push(BracketLabels(
+          open_label, close_label, -1, counters_in_use(*open_bracket_stack)));
+      break;
+    }
+    case BfOpKind::IF_END: {
+      if (open_bracket_stack->empty()) {
+        DIE << "unmatched closing ']' at pc=" << pc;
+      }
+      assm.bind(open_bracket_stack->top().close_label);
+      open_bracket_stack->pop();
+      break;
+    }
+    case BfOpKind::MEMSET_RANGE:
+      emit_memset(assm, op.offset, static_cast<int32_t>(op.argument));
+      break;
+    case BfOpKind::MEMMOVE_RANGE: {
+      MemmoveRange range = decode_memmove_range(op.argument);
+      int32_t length = static_cast<int32_t>(range.length);
+      emit_memcpy(assm, op.offset + range.distance, op.offset, length);
+      emit_memset(assm, op.offset, length);
+      break;
+    }
+    case BfOpKind::LOOP_SCAN_CLEAR: {
+      // Scans for the zero cell with vectors from rdx = the start, then
+      // clears the cells passed:
+      //
+      //   mov rdx, r13
+      //   <vector scan>
+      //   mov rdi, rdx                     ; lea rdi, [r13+1] going backward
+      //   mov rcx, r13                     ; mov rcx, rdx
+      //   sub rcx, rdx                     ; sub rcx, r13
+      //   xor eax, eax
+      //   rep stosb
+      bool forward = op.argument > 0;
+      assm.mov(asmjit::x86::rdx, dataptr);
+      emit_vector_scan(assm, op.argument);
+      if (forward) {
+        assm.mov(asmjit::x86::rdi, asmjit::x86::rdx);
+        assm.mov(asmjit::x86::rcx, dataptr);
+        assm.sub(asmjit::x86::rcx, asmjit::x86::rdx);
+      } else {
+        assm.lea(asmjit::x86::rdi, asmjit::x86::ptr(dataptr, 1));
+        assm.mov(asmjit::x86::rcx, asmjit::x86::rdx);
+        assm.sub(asmjit::x86::rcx, dataptr);
+      }
+      assm.xor_(asmjit::x86::eax, asmjit::x86::eax);
+      emit_rep_string(assm, false);
+      break;
+    }
     case BfOpKind::INVALID_OP:
       DIE << "INVALID_OP encountered on pc=" << pc;
       break;
     }
   }
+}
+
+// Translates the BF program and compiles it to position-independent machine
+// code, returning the code. Helper calls are recorded in relocations.
+std::vector<uint8_t> compile(const std::string& bf_file_path,
+                             const Flags& flags,
+                             std::vector<Relocation>* relocations) {
+  std::stack<BracketLabels> open_bracket_stack;
+  std::vector<EmbeddedConstant> constants;
+  bool verbose = flags.verbose;
+
+  // Initialize asmjit's code holder and assembler. The JIT runtime only
+  // describes the host here; the code is run from a JitProgram.
+  asmjit::JitRuntime jit_runtime;
+  asmjit::CodeHolder code;
+  code.init(jit_runtime.getCodeInfo());
+  asmjit::X86Assembler assm(&code);
+
+  // Registers used in the program:
+  //
+  // r13: the data pointer
+  // rbx, r12, r14 and r15: trip counts of counted loops
+  // rax and rcx: used temporarily for some instructions
+  // rdi: parameter from the host -- the host passes the address of memory
+  // here.
+
+  asmjit::X86Gp dataptr = asmjit::x86::r13;
+
+  // These are callee-saved in the x64 System V ABI, so save them. Pushing five
+  // registers also leaves the stack 16-byte aligned for helper calls.
+  assm.push(asmjit::x86::r13);
+  for (const asmjit::X86Gp& counter : kCounterRegs) {
+    assm.push(counter);
+  }
+
+  // We pass the data pointer as an argument to the JITed function, so it's
+  // expected to be in rdi. Move it to r13.
+  assm.mov(dataptr, asmjit::x86::rdi);
+
+  // The .bfo flags work on the whole op stream, so they take precedence over
+  // --stream.
+  if (flags.stream && flags.load_bfo.empty() && flags.emit_bfo.empty()) {
+    // Emit each segment as soon as the front end hands it over; reading and
+    // translating the rest of the program continues in the background.
+    Timer tstream;
+    double codegen_time = 0;
+    StreamingFrontEnd front_end(bf_file_path, flags);
+    OpProgram segment;
+    while (front_end.next_segment(&segment)) {
+      Timer tcodegen;
+      emit_ops(assm, segment, &open_bracket_stack, relocations, &constants);
+      codegen_time += tcodegen.elapsed();
+    }
 
+    if (verbose) {
+      front_end.print_timings(std::cout);
+      std::cout << "* stream: codegen " << codegen_time
+                << "s, compiled code ready after " << tstream.elapsed()
+                << "s\n";
+    }
+  } else {
+    const OpProgram program = translate_file(bf_file_path, flags);
+
+    if (verbose) {
+      std::cout << "==== OPS ====\n";
+      for (size_t i = 0; i < program.ops.size(); ++i) {
+        std::cout << std::setw(4) << std::left << i << " ";
+        std::cout << BfOp_to_string(program.ops[i]) << "\n";
+      }
+      std::cout << "=============\n";
+    }
+
+    emit_ops(assm, program, &open_bracket_stack, relocations, &constants);
+  }
+
+  for (int i = kNumCounterRegs - 1; i >= 0; --i) {
+    assm.pop(kCounterRegs[i]);
+  }
+  assm.pop(asmjit::x86::r13);
   assm.ret();
 
+  for (const EmbeddedConstant& constant : constants) {
+    assm.bind(constant.label);
+    assm.embed(constant.data.data(), constant.data.size());
+  }
+
   if (assm.isInErrorState()) {
     DIE << "asmjit error: "
         << asmjit::DebugUtils::errorAsString(assm.getLastError());
   }
 
-  // Save the emitted code in a vector so we can dump it in verbose mode.
+  // All jumps are to labels within the code, so asmjit has already resolved
+  // them and the buffer can be copied out as is.
   // NOTE: The first section is always '.text', so it's safe to just use 0
   // index.
   code.sync();
   asmjit::CodeBuffer& buf = code.getSectionEntry(0)->getBuffer();
   std::vector<uint8_t> emitted_code(buf.getLength());
   memcpy(emitted_code.data(), buf.getData(), buf.getLength());
+  return emitted_code;
+}
+
+} // namespace
+
+void optasmjit(const std::string& bf_file_path, const Flags& flags) {
+  // Initialize state.
+  std::vector<uint8_t> padded_memory(MEMORY_SIZE + 2 * MEMORY_PADDING, 0);
+  uint8_t* memory = padded_memory.data() + MEMORY_PADDING;
+  bool verbose = flags.verbose;
+
+  // A cache hit skips translation and codegen altogether. --emit-bfo needs the
+  // translation, so it turns the cache off.
+  JitCache cache("optasmjit", bf_file_path, flags);
+  std::vector<uint8_t> emitted_code;
+  if (!cache.lookup(kHostHelpers, &emitted_code)) {
+    std::vector<Relocation> relocations;
+    emitted_code = compile(bf_file_path, flags, &relocations);
+    cache.store(emitted_code, relocations);
+  }
 
   // JIT the emitted function.
   // JittedFunc is the C++ type for the JIT function emitted by our JIT. The
   // emitted function is callable from C++ and follows the x64 System V ABI.
+  JitProgram jit_program(emitted_code);
   using JittedFunc = void (*)(uint64_t);
-  JittedFunc func;
-  asmjit::Error err = jit_runtime.add(&func, &code);
-
-  if (err) {
-    DIE << "error calling jit_runtime.add";
-  }
+  JittedFunc func = (JittedFunc)jit_program.program_memory();
 
   Timer texec;
 
   // Call it, passing the address of memory as a parameter.
-  func((uint64_t)memory.data());
+  func((uint64_t)memory);
 
   if (verbose) {
     std::cout << "[-] Execution took: " << texec.elapsed() << "s)\n";
@@ -253,7 +985,7 @@ void optasmjit(const Program& p, bool verbose) {
 
     std::cout << "* Memory nonzero locations:\n";
 
-    for (size_t i = 0, pcount = 0; i < memory.size(); ++i) {
+    for (size_t i = 0, pcount = 0; i < MEMORY_SIZE; ++i) {
       if (memory[i]) {
         std::cout << std::right << "[" << std::setw(3) << i
                   << "] = " << std::setw(3) << std::left
@@ -267,36 +999,21 @@ void optasmjit(const Program& p, bool verbose) {
     }
     std::cout << "\n";
   }
-
-  jit_runtime.release(func);
 }
 
 int main(int argc, const char** argv) {
-  bool verbose = false;
+  Flags flags;
   std::string bf_file_path;
-  parse_command_line(argc, argv, &bf_file_path, &verbose);
-
-  Timer t1;
-  std::ifstream file(bf_file_path);
-  if (!file) {
-    DIE << "unable to open file " << bf_file_path;
-  }
-  Program program = parse_from_stream(file);
-
-  if (verbose) {
-    std::cout << "Parsing took: " << t1.elapsed() << "s\n";
-    std::cout << "Length of program: " << program.instructions.size() << "\n";
-    std::cout << "Program:\n" << program.instructions << "\n";
-  }
+  parse_command_line(argc, argv, &bf_file_path, &flags);
 
-  if (verbose) {
+  if (flags.verbose) {
     std::cout << "[>] Running optasmjit:\n";
   }
 
   Timer t2;
-  optasmjit(program, verbose);
+  optasmjit(bf_file_path, flags);
 
-  if (verbose) {
+  if (flags.verbose) {
     std::cout << "[<] Done (elapsed: " << t2.elapsed() << "s)\n";
   }
 
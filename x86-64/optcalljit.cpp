@@ -0,0 +1,405 @@
+// A call-threaded JIT for BF: a cheap tier between optdt and the optimizing
+// JITs that needs no assembler library.
+//
+// The emitted code is a linear sequence of calls to precompiled handlers, one
+// per op, with the jumps turned into native branches. Pointer moves and the
+// ops that only change cells by a constant, or move one cell to another, take
+// an instruction or three and are emitted inline instead. Every call site has
+// a single target and every jump is a plain conditional branch, so the CPU
+// predicts them much better than the shared indirect jumps of an interpreter,
+// and emitting the code takes a single pass.
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+#include "bfio.h"
+#include "jit_utils.h"
+#include "optutils.h"
+#include "parser.h"
+#include "utils.h"
+
+using namespace optutils;
+
+constexpr int MEMORY_SIZE = 30000;
+
+namespace {
+
+// What handlers need besides the current cell and their op.
+struct Context {
+  const OpProgram* program;
+  uint8_t* memory;
+};
+
+// Runs op with the data pointer at cell and returns the new data pointer.
+using Handler = uint8_t* (*)(uint8_t* cell, const BfOp* op, Context* context);
+
+uint8_t* inc_ptr(uint8_t* cell, const BfOp* op, Context*) {
+  return cell + op->argument;
+}
+
+uint8_t* dec_ptr(uint8_t* cell, const BfOp* op, Context*) {
+  return cell - op->argument;
+}
+
+uint8_t* read_stdin(uint8_t* cell, const BfOp* op, Context*) {
+  for (int i = 0; i < op->argument; ++i) {
+    cell[op->offset] = BfIO::get();
+  }
+  return cell;
+}
+
+uint8_t* write_stdout(uint8_t* cell, const BfOp* op, Context*) {
+  for (int i = 0; i < op->argument; ++i) {
+    BfIO::put(cell[op->offset]);
+  }
+  return cell;
+}
+
+uint8_t* loop_move_ptr(uint8_t* cell, const BfOp* op, Context* context) {
+  if (!*cell) {
+    return cell;
+  }
+  return context->memory + scan_for_zero(context->memory, MEMORY_SIZE,
+                                         cell - context->memory, op->argument);
+}
+
+uint8_t* loop_move_data(uint8_t* cell, const BfOp* op, Context*) {
+  uint8_t* from = cell + op->offset;
+  if (*from) {
+    from[op->argument] += *from;
+    *from = 0;
+  }
+  return cell;
+}
+
+uint8_t* loop_mul_add(uint8_t* cell, const BfOp* op, Context*) {
+  uint8_t* count_cell = cell + op->offset;
+  uint8_t count = *count_cell;
+  if (count) {
+    for (const BfOp* operand = op + 1; operand <= op + op->argument;
+         ++operand) {
+      count_cell[operand->offset] += count * operand->argument;
+    }
+    *count_cell = 0;
+  }
+  return cell;
+}
+
+uint8_t* tape_snapshot(uint8_t* cell, const BfOp* op, Context* context) {
+  size_t size;
+  const uint8_t* data =
+      get_constant(context->program->constants, op->argument, &size);
+  memcpy(cell + op->offset, data, size);
+  return cell;
+}
+
+uint8_t* write_string(uint8_t* cell, const BfOp* op, Context* context) {
+  size_t size;
+  const uint8_t* data =
+      get_constant(context->program->constants, op->argument, &size);
+  BfIO::write(data, size);
+  return cell;
+}
+
+uint8_t* loop_closed_form(uint8_t* cell, const BfOp* op, Context*) {
+  run_closed_form_loop(op, cell + op->offset);
+  return cell;
+}
+
+uint8_t* divmod(uint8_t* cell, const BfOp* op, Context*) {
+  run_divmod(op, cell + op->offset);
+  return cell;
+}
+
+uint8_t* block_add(uint8_t* cell, const BfOp* op, Context* context) {
+  size_t size;
+  const uint8_t* deltas =
+      get_constant(context->program->constants, op->argument, &size);
+  run_block_add(deltas, size, cell + op->offset);
+  return cell;
+}
+
+uint8_t* memset_range(uint8_t* cell, const BfOp* op, Context*) {
+  memset(cell + op->offset, 0, op->argument);
+  return cell;
+}
+
+uint8_t* memmove_range(uint8_t* cell, const BfOp* op, Context*) {
+  MemmoveRange range = decode_memmove_range(op->argument);
+  uint8_t* source = cell + op->offset;
+  memmove(source + range.distance, source, range.length);
+  memset(source, 0, range.length);
+  return cell;
+}
+
+uint8_t* loop_scan_clear(uint8_t* cell, const BfOp* op, Context* context) {
+  return context->memory + scan_and_clear(context->memory, MEMORY_SIZE,
+                                          cell - context->memory,
+                                          op->argument);
+}
+
+// Returns the handler of ops of the given kind, or nullptr for the kinds the
+// emitted code runs by itself.
+Handler handler_of(BfOpKind kind) {
+  switch (kind) {
+  case BfOpKind::INC_PTR:
+    return inc_ptr;
+  case BfOpKind::DEC_PTR:
+    return dec_ptr;
+  case BfOpKind::READ_STDIN:
+    return read_stdin;
+  case BfOpKind::WRITE_STDOUT:
+    return write_stdout;
+  case BfOpKind::LOOP_MOVE_PTR:
+    return loop_move_ptr;
+  case BfOpKind::LOOP_MOVE_DATA:
+    return loop_move_data;
+  case BfOpKind::LOOP_MUL_ADD:
+    return loop_mul_add;
+  case BfOpKind::TAPE_SNAPSHOT:
+    return tape_snapshot;
+  case BfOpKind::WRITE_STRING:
+    return write_string;
+  case BfOpKind::LOOP_CLOSED_FORM:
+    return loop_closed_form;
+  case BfOpKind::DIVMOD:
+    return divmod;
+  case BfOpKind::BLOCK_ADD:
+    return block_add;
+  case BfOpKind::MEMSET_RANGE:
+    return memset_range;
+  case BfOpKind::MEMMOVE_RANGE:
+    return memmove_range;
+  case BfOpKind::LOOP_SCAN_CLEAR:
+    return loop_scan_clear;
+  default:
+    return nullptr;
+  }
+}
+
+bool fits_in_int32(int64_t v) {
+  return v >= INT32_MIN && v <= INT32_MAX;
+}
+
+// cmpb $0, 0(%r13)
+void emit_compare_cell_to_zero(CodeEmitter* emitter) {
+  emitter->EmitBytes({0x41, 0x80, 0x7D, 0x00, 0x00});
+}
+
+// Emits an instruction with the given opcode and ModRM byte that addresses
+// offset(%r13), followed by the immediate value if it has one.
+void emit_cell_instruction(CodeEmitter* emitter, uint8_t opcode, uint8_t modrm,
+                           int64_t offset) {
+  emitter->EmitBytes({0x41, opcode, modrm});
+  emitter->EmitUint32(static_cast<uint32_t>(offset));
+}
+
+// Emits a call of op's handler with (r13, &op, r12) that sets r13 to its
+// result.
+void emit_handler_call(CodeEmitter* emitter, const BfOp& op) {
+  Handler handler = handler_of(op.kind);
+  if (!handler) {
+    DIE << "unexpected " << BfOpKind_name(op.kind) << " in emit_handler_call";
+  }
+  // mov %r13, %rdi
+  emitter->EmitBytes({0x4C, 0x89, 0xEF});
+  // movabs $op, %rsi
+  emitter->EmitBytes({0x48, 0xBE});
+  emitter->EmitUint64(reinterpret_cast<uint64_t>(&op));
+  // mov %r12, %rdx
+  emitter->EmitBytes({0x4C, 0x89, 0xE2});
+  // movabs $handler, %rax
+  emitter->EmitBytes({0x48, 0xB8});
+  emitter->EmitUint64(reinterpret_cast<uint64_t>(handler));
+  // call *%rax
+  emitter->EmitBytes({0xFF, 0xD0});
+  // mov %rax, %r13
+  emitter->EmitBytes({0x49, 0x89, 0xC5});
+}
+
+// Emits the code for ops. It's called as void(uint8_t* memory, Context*) and
+// keeps the data pointer in r13 and the Context in r12; handlers are called
+// with (r13, op, r12) and return the new r13.
+std::vector<uint8_t> emit_calls(const std::vector<BfOp>& ops) {
+  CodeEmitter emitter;
+
+  // push %rbx; push %r12; push %r13. The third push keeps rsp 16-byte aligned
+  // for the handler calls.
+  emitter.EmitBytes({0x53, 0x41, 0x54, 0x41, 0x55});
+  // mov %rdi, %r13
+  emitter.EmitBytes({0x49, 0x89, 0xFD});
+  // mov %rsi, %r12
+  emitter.EmitBytes({0x49, 0x89, 0xF4});
+
+  // Code offset right after each op; jumps go past their matching op.
+  std::vector<size_t> op_end(ops.size());
+
+  // Offsets of the 32-bit fields of the jumps, with the op they jump past;
+  // fixed up once every op_end is known.
+  std::vector<std::pair<size_t, size_t>> fixups;
+
+  for (size_t pc = 0; pc < ops.size(); ++pc) {
+    const BfOp& op = ops[pc];
+    size_t op_pc = pc;
+    switch (op.kind) {
+    case BfOpKind::JUMP_IF_DATA_ZERO:
+    case BfOpKind::IF_BEGIN:
+      emit_compare_cell_to_zero(&emitter);
+      // jz <past the matching op>
+      emitter.EmitBytes({0x0F, 0x84});
+      fixups.push_back(std::make_pair(emitter.size(), op.argument));
+      emitter.EmitUint32(0);
+      break;
+    case BfOpKind::JUMP_IF_DATA_NOT_ZERO:
+      emit_compare_cell_to_zero(&emitter);
+      // jnz <past the matching op>
+      emitter.EmitBytes({0x0F, 0x85});
+      fixups.push_back(std::make_pair(emitter.size(), op.argument));
+      emitter.EmitUint32(0);
+      break;
+    case BfOpKind::IF_END:
+      break;
+    case BfOpKind::COUNTED_LOOP_BEGIN:
+      // The iterations left are kept on the machine stack, in 16 bytes so the
+      // stack stays aligned for calls.
+      emit_compare_cell_to_zero(&emitter);
+      emitter.EmitBytes({0x0F, 0x84});
+      fixups.push_back(std::make_pair(emitter.size(), op.argument));
+      emitter.EmitUint32(0);
+      // movzbl 0(%r13), %eax
+      emitter.EmitBytes({0x41, 0x0F, 0xB6, 0x45, 0x00});
+      // sub $16, %rsp
+      emitter.EmitBytes({0x48, 0x83, 0xEC, 0x10});
+      // mov %rax, (%rsp)
+      emitter.EmitBytes({0x48, 0x89, 0x04, 0x24});
+      break;
+    case BfOpKind::COUNTED_LOOP_END:
+      // subq $1, (%rsp)
+      emitter.EmitBytes({0x48, 0x83, 0x2C, 0x24, 0x01});
+      emitter.EmitBytes({0x0F, 0x85});
+      fixups.push_back(std::make_pair(emitter.size(), op.argument));
+      emitter.EmitUint32(0);
+      // add $16, %rsp
+      emitter.EmitBytes({0x48, 0x83, 0xC4, 0x10});
+      break;
+    case BfOpKind::INC_DATA:
+      // addb $argument, offset(%r13)
+      emit_cell_instruction(&emitter, 0x80, 0x85, op.offset);
+      emitter.EmitByte(static_cast<uint8_t>(op.argument));
+      break;
+    case BfOpKind::DEC_DATA:
+      // subb $argument, offset(%r13)
+      emit_cell_instruction(&emitter, 0x80, 0xAD, op.offset);
+      emitter.EmitByte(static_cast<uint8_t>(op.argument));
+      break;
+    case BfOpKind::SET_DATA:
+      // movb $argument, offset(%r13)
+      emit_cell_instruction(&emitter, 0xC6, 0x85, op.offset);
+      emitter.EmitByte(static_cast<uint8_t>(op.argument));
+      break;
+    case BfOpKind::LOOP_SET_TO_ZERO:
+      // movb $0, offset(%r13)
+      emit_cell_instruction(&emitter, 0xC6, 0x85, op.offset);
+      emitter.EmitByte(0);
+      break;
+    case BfOpKind::LOOP_MOVE_DATA:
+      if (fits_in_int32(op.offset + op.argument)) {
+        // Adding a zero cell changes nothing, so there's no need to test it.
+        // movzbl offset(%r13), %eax
+        emitter.EmitBytes({0x41, 0x0F, 0xB6, 0x85});
+        emitter.EmitUint32(static_cast<uint32_t>(op.offset));
+        // addb %al, offset+argument(%r13)
+        emit_cell_instruction(&emitter, 0x00, 0x85, op.offset + op.argument);
+        // movb $0, offset(%r13)
+        emit_cell_instruction(&emitter, 0xC6, 0x85, op.offset);
+        emitter.EmitByte(0);
+        break;
+      }
+      emit_handler_call(&emitter, op);
+      break;
+    case BfOpKind::INC_PTR:
+    case BfOpKind::DEC_PTR:
+      if (fits_in_int32(op.argument)) {
+        // add/sub $argument, %r13
+        emitter.EmitBytes(
+            {0x49, 0x81, op.kind == BfOpKind::INC_PTR ? uint8_t{0xC5}
+                                                      : uint8_t{0xED}});
+        emitter.EmitUint32(static_cast<uint32_t>(op.argument));
+        break;
+      }
+      // Moves too far for an immediate are left to the handlers.
+      emit_handler_call(&emitter, op);
+      break;
+    default:
+      emit_handler_call(&emitter, op);
+      // Operands are read by the handler.
+      if (op.kind == BfOpKind::LOOP_MUL_ADD ||
+          op.kind == BfOpKind::LOOP_CLOSED_FORM ||
+          op.kind == BfOpKind::DIVMOD) {
+        pc += op.argument;
+      }
+      break;
+    }
+    op_end[op_pc] = emitter.size();
+  }
+
+  for (const auto& fixup : fixups) {
+    emitter.ReplaceUint32AtOffset(
+        fixup.first,
+        compute_relative_32bit_offset(fixup.first + 4, op_end[fixup.second]));
+  }
+
+  // pop %r13; pop %r12; pop %rbx; ret
+  emitter.EmitBytes({0x41, 0x5D, 0x41, 0x5C, 0x5B, 0xC3});
+  return emitter.code();
+}
+
+} // namespace
+
+void optcalljit(const OpProgram& program, bool verbose) {
+  const std::vector<BfOp>& ops = program.ops;
+  if (verbose) {
+    std::cout << "* translation:\n";
+
+    for (size_t i = 0; i < ops.size(); ++i) {
+      std::cout << " [" << i << "] " << BfOp_to_string(ops[i]) << "\n";
+    }
+  }
+
+  // BLOCK_ADD windows may run past the last cell; see kMaxBlockAddWidth.
+  std::vector<uint8_t> memory(MEMORY_SIZE + kMaxBlockAddWidth, 0);
+  Context context = {&program, memory.data()};
+
+  Timer t1;
+  JitProgram jit_program(emit_calls(ops));
+  if (verbose) {
+    std::cout << "* emitted " << jit_program.program_size() << " bytes ["
+              << t1.elapsed() << "s]\n";
+  }
+
+  using JittedFunc = void (*)(uint8_t* memory, Context* context);
+  JittedFunc func = (JittedFunc)jit_program.program_memory();
+  func(memory.data(), &context);
+  BfIO::flush();
+}
+
+int main(int argc, const char** argv) {
+  Flags flags;
+  std::string bf_file_path;
+  parse_command_line(argc, argv, &bf_file_path, &flags);
+
+  const OpProgram program = translate_file(bf_file_path, flags);
+
+  if (flags.verbose) {
+    std::cout << "[>] Running optcalljit:\n";
+  }
+
+  Timer t2;
+  optcalljit(program, flags.verbose);
+
+  if (flags.verbose) {
+    std::cout << "[<] Done (elapsed: " << t2.elapsed() << "s)\n";
+  }
+
+  return 0;
+}
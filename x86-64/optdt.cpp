@@ -1,11 +1,18 @@
 // A more optimized direct threaded interpreter for BF.
 //
+// Compile with -DBFTRACE to count, in verbose mode, how often pairs of adjacent
+// ops run back to back. kSuperinstructions, whose handlers follow the
+// BfOpKinds' in kLabelOffsets, is picked from those counts.
+//
 // Based on simpleasmjit by Eli Bendersky [http://eli.thegreenplace.net]
 #include <algorithm>
-#include <fstream>
+#include <cstring>
 #include <iostream>
+#include <map>
 #include <stack>
+#include <utility>
 
+#include "bfio.h"
 #include "optutils.h"
 #include "parser.h"
 #include "utils.h"
@@ -14,60 +21,116 @@ using namespace optutils;
 
 constexpr int MEMORY_SIZE = 30000;
 
-struct BfInst {
-  BfInst(const void* adr_ = nullptr, int64_t argument_ = 0)
-    : adr(adr_), argument(argument_) {}
+// Threads packed ops: their kinds are replaced by the distances of their
+// handlers from a base label, so dispatch takes a single load and the ops stay
+// at 8 bytes where (label, argument) pairs would take 16.
+void thread_ops(const int* label_offsets, std::vector<PackedOp>* code) {
+#ifndef BFTRACE
+  fuse_superinstructions(code);
+#endif
+  for (PackedOp& op : *code) {
+    int label_offset = label_offsets[op.kind];
+    if (label_offset < INT16_MIN || label_offset > INT16_MAX) {
+      DIE << "handler too far from the base label: " << label_offset;
+    }
+    op.kind = static_cast<int16_t>(label_offset);
+  }
+}
+
+// BfOps keep their kinds and look the distances up at each dispatch; they
+// don't use superinstructions.
+void thread_ops(const int*, std::vector<BfOp>*) {}
+
+inline int label_offset(const int*, const PackedOp& op) {
+  return op.kind;
+}
 
-  const void* adr;
-  int64_t argument;
-};
+inline int label_offset(const int* label_offsets, const BfOp& op) {
+  return label_offsets[static_cast<int>(op.kind)];
+}
 
-void optdt(const Program& p, bool verbose) {
+// Runs code, the ops of program as PackedOps or, when they don't fit, as BfOps
+// with relative jumps.
+template <typename Op>
+void run_ops(const OpProgram& program, std::vector<Op> code, bool verbose) {
+  const std::vector<BfOp>& ops = program.ops;
   // Initialize state.
-  std::vector<uint8_t> memory(MEMORY_SIZE, 0);
+  // BLOCK_ADD windows may run past the last cell; see kMaxBlockAddWidth.
+  std::vector<uint8_t> memory(MEMORY_SIZE + kMaxBlockAddWidth, 0);
   size_t dataptr = 0;
 
-  Timer t1;
-  const std::vector<BfOp> ops = translate_program(p);
+  // Iterations left in each counted loop being run, innermost last.
+  std::vector<uint32_t> counters;
 
-  if (verbose) {
-    std::cout << "* translation [elapsed " << t1.elapsed() << "s]:\n";
+#define LABEL_OFFSET(label)                                                    \
+  static_cast<int>(static_cast<char*>(&&label) -                               \
+                   static_cast<char*>(&&INVALID_OP))
 
-    for (size_t i = 0; i < ops.size(); ++i) {
-      std::cout << " [" << i << "] " << BfOpKind_name(ops[i].kind) << " "
-                << ops[i].argument << "\n";
-    }
-  }
-
-  // Convert instructions to direct thread.
-  size_t originalSize = ops.size();
-  std::vector<BfInst> instructions(originalSize + 1);
-  static const void* kLabelAdrs[] = {
-    &&INVALID_OP,
-    &&INC_PTR,
-    &&DEC_PTR,
-    &&INC_DATA,
-    &&DEC_DATA,
-    &&READ_STDIN,
-    &&WRITE_STDOUT,
-    &&LOOP_SET_TO_ZERO,
-    &&LOOP_MOVE_PTR,
-    &&LOOP_MOVE_DATA,
-    &&JUMP_IF_DATA_ZERO,
-    &&JUMP_IF_DATA_NOT_ZERO,
+  // Distances of the handlers from INVALID_OP's, indexed by BfOpKind.
+  static const int kLabelOffsets[] = {
+    LABEL_OFFSET(INVALID_OP),
+    LABEL_OFFSET(INC_PTR),
+    LABEL_OFFSET(DEC_PTR),
+    LABEL_OFFSET(INC_DATA),
+    LABEL_OFFSET(DEC_DATA),
+    LABEL_OFFSET(READ_STDIN),
+    LABEL_OFFSET(WRITE_STDOUT),
+    LABEL_OFFSET(LOOP_SET_TO_ZERO),
+    LABEL_OFFSET(LOOP_MOVE_PTR),
+    LABEL_OFFSET(LOOP_MOVE_DATA),
+    LABEL_OFFSET(JUMP_IF_DATA_ZERO),
+    LABEL_OFFSET(JUMP_IF_DATA_NOT_ZERO),
+    LABEL_OFFSET(LOOP_MUL_ADD),
+    LABEL_OFFSET(MUL_ADD_OPERAND),
+    LABEL_OFFSET(SET_DATA),
+    LABEL_OFFSET(TAPE_SNAPSHOT),
+    LABEL_OFFSET(WRITE_STRING),
+    LABEL_OFFSET(COUNTED_LOOP_BEGIN),
+    LABEL_OFFSET(COUNTED_LOOP_END),
+    LABEL_OFFSET(LOOP_CLOSED_FORM),
+    LABEL_OFFSET(CLOSED_FORM_TERM),
+    LABEL_OFFSET(DIVMOD),
+    LABEL_OFFSET(DIVMOD_OPERAND),
+    LABEL_OFFSET(IF_BEGIN),
+    LABEL_OFFSET(IF_END),
+    LABEL_OFFSET(BLOCK_ADD),
+    LABEL_OFFSET(MEMSET_RANGE),
+    LABEL_OFFSET(MEMMOVE_RANGE),
+    LABEL_OFFSET(LOOP_SCAN_CLEAR),
+#define SUPERINSTRUCTION_LABEL_OFFSET(label, ...) LABEL_OFFSET(label),
+    BF_SUPERINSTRUCTIONS(SUPERINSTRUCTION_LABEL_OFFSET)
+#undef SUPERINSTRUCTION_LABEL_OFFSET
   };
-  for (size_t pc = 0; pc < originalSize; ++pc) {
-    BfOpKind kind = ops[pc].kind;
-    instructions[pc] = BfInst(kLabelAdrs[static_cast<int>(kind)], ops[pc].argument);
-  }
-  instructions[originalSize] = BfInst(&&HALT, 0);
+  static_assert(sizeof(kLabelOffsets) / sizeof(kLabelOffsets[0]) ==
+                    kNumOpKinds + kNumSuperinstructions,
+                "kLabelOffsets should have a label for every op kind and "
+                "superinstruction");
 
   // Execute the translated ops in a for loop; pc always gets incremented by the
   // end of each iteration, though some ops may also move it in a less orderly
   // way.
-  BfInst* pc = &instructions[0];
+  thread_ops(kLabelOffsets, &code);
+  const Op* pc = code.data();
+
+  char* const base_label = static_cast<char*>(&&INVALID_OP);
 
-#define JUMP_TO_NEXT  goto *((void*)((++pc)->adr))
+#ifdef BFTRACE
+  // Times each pair of kinds ran back to back from adjacent ops.
+  std::map<std::pair<BfOpKind, BfOpKind>, size_t> pair_count;
+  size_t last_pc = ops.size();
+
+#define JUMP_TO_NEXT                                                           \
+  do {                                                                         \
+    size_t next_pc = ++pc - code.data();                                       \
+    if (next_pc == last_pc + 1 && next_pc < ops.size()) {                      \
+      pair_count[std::make_pair(ops[last_pc].kind, ops[next_pc].kind)] += 1;   \
+    }                                                                          \
+    last_pc = next_pc;                                                         \
+    goto *(base_label + label_offset(kLabelOffsets, *pc));                     \
+  } while (0)
+#else
+#define JUMP_TO_NEXT  goto *(base_label + label_offset(kLabelOffsets, *++pc))
+#endif
 
   --pc;
   JUMP_TO_NEXT;
@@ -81,76 +144,282 @@ void optdt(const Program& p, bool verbose) {
       dataptr -= pc->argument;
       JUMP_TO_NEXT;
     INC_DATA:
-      memory[dataptr] += pc->argument;
+      memory[dataptr + pc->offset] += pc->argument;
       JUMP_TO_NEXT;
     DEC_DATA:
-      memory[dataptr] -= pc->argument;
+      memory[dataptr + pc->offset] -= pc->argument;
       JUMP_TO_NEXT;
     READ_STDIN:
       for (int i = 0; i < pc->argument; ++i) {
-        memory[dataptr] = std::cin.get();
+        memory[dataptr + pc->offset] = BfIO::get();
       }
       JUMP_TO_NEXT;
     WRITE_STDOUT:
       for (int i = 0; i < pc->argument; ++i) {
-        std::cout.put(memory[dataptr]);
+        BfIO::put(memory[dataptr + pc->offset]);
       }
       JUMP_TO_NEXT;
     LOOP_SET_TO_ZERO:
-      memory[dataptr] = 0;
+      memory[dataptr + pc->offset] = 0;
+      JUMP_TO_NEXT;
+    SET_DATA:
+      memory[dataptr + pc->offset] = pc->argument;
+      JUMP_TO_NEXT;
+    TAPE_SNAPSHOT: {
+      size_t size;
+      const uint8_t* data =
+          get_constant(program.constants, pc->argument, &size);
+      memcpy(&memory[dataptr + pc->offset], data, size);
       JUMP_TO_NEXT;
+    }
+    WRITE_STRING: {
+      size_t size;
+      const uint8_t* data =
+          get_constant(program.constants, pc->argument, &size);
+      BfIO::write(data, size);
+      JUMP_TO_NEXT;
+    }
     LOOP_MOVE_PTR:
-      while (memory[dataptr]) {
-        dataptr += pc->argument;
+      if (memory[dataptr]) {
+        dataptr = scan_for_zero(memory.data(), MEMORY_SIZE, dataptr,
+                                pc->argument);
       }
       JUMP_TO_NEXT;
     LOOP_MOVE_DATA: {
-      if (memory[dataptr]) {
-        int64_t move_to_ptr = static_cast<int64_t>(dataptr) + pc->argument;
-        memory[move_to_ptr] += memory[dataptr];
-        memory[dataptr] = 0;
+      size_t from_ptr = dataptr + pc->offset;
+      if (memory[from_ptr]) {
+        int64_t move_to_ptr = static_cast<int64_t>(from_ptr) + pc->argument;
+        memory[move_to_ptr] += memory[from_ptr];
+        memory[from_ptr] = 0;
       }
       JUMP_TO_NEXT;
     }
+    LOOP_MUL_ADD: {
+      size_t count_ptr = dataptr + pc->offset;
+      uint8_t count = memory[count_ptr];
+      if (count) {
+        for (const Op* operand = pc + 1; operand <= pc + pc->argument;
+             ++operand) {
+          memory[count_ptr + operand->offset] += count * operand->argument;
+        }
+        memory[count_ptr] = 0;
+      }
+      pc += pc->argument;
+      JUMP_TO_NEXT;
+    }
+    MUL_ADD_OPERAND:
+      DIE << "MUL_ADD_OPERAND outside of LOOP_MUL_ADD on pc=" << pc;
+      JUMP_TO_NEXT;
+    LOOP_CLOSED_FORM:
+      run_closed_form_loop(&ops[pc - code.data()],
+                           &memory[dataptr + pc->offset]);
+      pc += pc->argument;
+      JUMP_TO_NEXT;
+    CLOSED_FORM_TERM:
+      DIE << "CLOSED_FORM_TERM outside of LOOP_CLOSED_FORM on pc=" << pc;
+      JUMP_TO_NEXT;
+    DIVMOD:
+      run_divmod(&ops[pc - code.data()], &memory[dataptr + pc->offset]);
+      pc += pc->argument;
+      JUMP_TO_NEXT;
+    DIVMOD_OPERAND:
+      DIE << "DIVMOD_OPERAND outside of DIVMOD on pc=" << pc;
+      JUMP_TO_NEXT;
     JUMP_IF_DATA_ZERO:
       if (memory[dataptr] == 0) {
-        pc = &instructions[pc->argument];
+        pc += pc->argument;
       }
       JUMP_TO_NEXT;
     JUMP_IF_DATA_NOT_ZERO:
       if (memory[dataptr] != 0) {
-        pc = &instructions[pc->argument];
+        pc += pc->argument;
+      }
+      JUMP_TO_NEXT;
+    COUNTED_LOOP_BEGIN:
+      if (memory[dataptr] == 0) {
+        pc += pc->argument;
+      } else {
+        counters.push_back(memory[dataptr]);
       }
       JUMP_TO_NEXT;
+    COUNTED_LOOP_END:
+      if (--counters.back() != 0) {
+        pc += pc->argument;
+      } else {
+        counters.pop_back();
+      }
+      JUMP_TO_NEXT;
+    IF_BEGIN:
+      if (memory[dataptr] == 0) {
+        pc += pc->argument;
+      }
+      JUMP_TO_NEXT;
+    IF_END:
+      JUMP_TO_NEXT;
+    BLOCK_ADD: {
+      size_t size;
+      const uint8_t* deltas =
+          get_constant(program.constants, pc->argument, &size);
+      run_block_add(deltas, size, &memory[dataptr + pc->offset]);
+      JUMP_TO_NEXT;
+    }
+    MEMSET_RANGE:
+      memset(&memory[dataptr + pc->offset], 0, pc->argument);
+      JUMP_TO_NEXT;
+    MEMMOVE_RANGE: {
+      MemmoveRange range =
+          decode_memmove_range(ops[pc - code.data()].argument);
+      uint8_t* source = &memory[dataptr + pc->offset];
+      memmove(source + range.distance, source, range.length);
+      memset(source, 0, range.length);
+      JUMP_TO_NEXT;
+    }
+    LOOP_SCAN_CLEAR:
+      dataptr = scan_and_clear(memory.data(), MEMORY_SIZE, dataptr,
+                               pc->argument);
+      JUMP_TO_NEXT;
     INVALID_OP:
+      // The ops end with one.
+      if (pc == &code.back()) {
+        goto HALT;
+      }
       DIE << "INVALID_OP encountered on pc=" << pc;
       JUMP_TO_NEXT;
+    MOVE_DATA_DEC_PTR_JUMP_IF_NOT_ZERO: {
+      size_t from_ptr = dataptr + pc->offset;
+      if (memory[from_ptr]) {
+        int64_t move_to_ptr = static_cast<int64_t>(from_ptr) + pc->argument;
+        memory[move_to_ptr] += memory[from_ptr];
+        memory[from_ptr] = 0;
+      }
+      dataptr -= pc[1].argument;
+      pc += 2;
+      if (memory[dataptr] != 0) {
+        pc += pc->argument;
+      }
+      JUMP_TO_NEXT;
+    }
+    MOVE_DATA_INC_PTR_JUMP_IF_NOT_ZERO: {
+      size_t from_ptr = dataptr + pc->offset;
+      if (memory[from_ptr]) {
+        int64_t move_to_ptr = static_cast<int64_t>(from_ptr) + pc->argument;
+        memory[move_to_ptr] += memory[from_ptr];
+        memory[from_ptr] = 0;
+      }
+      dataptr += pc[1].argument;
+      pc += 2;
+      if (memory[dataptr] != 0) {
+        pc += pc->argument;
+      }
+      JUMP_TO_NEXT;
+    }
+    INC_DATA_INC_PTR_JUMP_IF_NOT_ZERO:
+      memory[dataptr + pc->offset] += pc->argument;
+      dataptr += pc[1].argument;
+      pc += 2;
+      if (memory[dataptr] != 0) {
+        pc += pc->argument;
+      }
+      JUMP_TO_NEXT;
+    INC_PTR_JUMP_IF_NOT_ZERO:
+      dataptr += pc->argument;
+      ++pc;
+      if (memory[dataptr] != 0) {
+        pc += pc->argument;
+      }
+      JUMP_TO_NEXT;
+    DEC_PTR_JUMP_IF_NOT_ZERO:
+      dataptr -= pc->argument;
+      ++pc;
+      if (memory[dataptr] != 0) {
+        pc += pc->argument;
+      }
+      JUMP_TO_NEXT;
+    DEC_DATA_MOVE_DATA: {
+      memory[dataptr + pc->offset] -= pc->argument;
+      ++pc;
+      size_t from_ptr = dataptr + pc->offset;
+      if (memory[from_ptr]) {
+        int64_t move_to_ptr = static_cast<int64_t>(from_ptr) + pc->argument;
+        memory[move_to_ptr] += memory[from_ptr];
+        memory[from_ptr] = 0;
+      }
+      JUMP_TO_NEXT;
+    }
+    IF_BEGIN_DEC_DATA:
+      if (memory[dataptr] == 0) {
+        pc += pc->argument;
+      } else {
+        ++pc;
+        memory[dataptr + pc->offset] -= pc->argument;
+      }
+      JUMP_TO_NEXT;
+    DEC_DATA_INC_DATA:
+      memory[dataptr + pc->offset] -= pc->argument;
+      memory[dataptr + pc[1].offset] += pc[1].argument;
+      ++pc;
+      JUMP_TO_NEXT;
+    IF_END_IF_END:
+      ++pc;
+      JUMP_TO_NEXT;
     }
   }
 
  HALT:;
+#ifdef BFTRACE
+  if (verbose) {
+    typedef std::pair<std::pair<BfOpKind, BfOpKind>, size_t> PairCount;
+    std::vector<PairCount> counts(pair_count.begin(), pair_count.end());
+    std::sort(counts.begin(), counts.end(),
+              [](const PairCount& a, const PairCount& b) {
+                return a.second > b.second;
+              });
+    std::cout << "* Tracing: most frequent adjacent pairs\n";
+    for (size_t i = 0; i < counts.size() && i < 20; ++i) {
+      std::cout << BfOpKind_name(counts[i].first.first) << " "
+                << BfOpKind_name(counts[i].first.second) << "  -->  "
+                << counts[i].second << "\n";
+    }
+  }
+#else
+  (void)verbose;
+#endif
+}
+
+void optdt(const OpProgram& program, bool verbose) {
+  const std::vector<BfOp>& ops = program.ops;
+  if (verbose) {
+    std::cout << "* translation:\n";
+
+    for (size_t i = 0; i < ops.size(); ++i) {
+      std::cout << " [" << i << "] " << BfOp_to_string(ops[i]) << "\n";
+    }
+  }
+
+  std::vector<PackedOp> packed;
+  if (pack_ops(ops, &packed)) {
+    run_ops(program, std::move(packed), verbose);
+  } else {
+    run_ops(program, relative_jump_ops(ops), verbose);
+  }
+  BfIO::flush();
 }
 
 int main(int argc, const char** argv) {
-  bool verbose = false;
+  Flags flags;
   std::string bf_file_path;
-  parse_command_line(argc, argv, &bf_file_path, &verbose);
+  parse_command_line(argc, argv, &bf_file_path, &flags);
 
-  Timer t1;
-  std::ifstream file(bf_file_path);
-  if (!file) {
-    DIE << "unable to open file " << bf_file_path;
-  }
-  Program program = parse_from_stream(file);
+  const OpProgram program = translate_file(bf_file_path, flags);
 
-  if (verbose) {
+  if (flags.verbose) {
     std::cout << "[>] Running optdt:\n";
   }
 
   Timer t2;
-  optdt(program, verbose);
+  optdt(program, flags.verbose);
 
-  if (verbose) {
+  if (flags.verbose) {
     std::cout << "[<] Done (elapsed: " << t2.elapsed() << "s)\n";
   }
 
@@ -0,0 +1,2042 @@
+#include "optimizer.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <algorithm>
+#include <map>
+#include <set>
+#include <stack>
+
+#include "utils.h"
+
+namespace optutils {
+
+IrNode* IrProgram::new_block(std::vector<BfOp> ops) {
+  arena_.emplace_back(IrNode::Kind::BLOCK);
+  arena_.back().ops = std::move(ops);
+  return &arena_.back();
+}
+
+IrNode* IrProgram::new_loop() {
+  arena_.emplace_back(IrNode::Kind::LOOP);
+  return &arena_.back();
+}
+
+void lift(const std::vector<BfOp>& ops, IrProgram* program) {
+  // The node list ops are currently added to; a stack of them for the loops
+  // being built.
+  std::stack<std::vector<IrNode*>*> open_loops;
+  std::vector<IrNode*>* nodes = &program->body;
+  IrNode* block = nullptr;
+
+  for (size_t pc = 0; pc < ops.size(); ++pc) {
+    switch (ops[pc].kind) {
+    case BfOpKind::JUMP_IF_DATA_ZERO:
+    case BfOpKind::COUNTED_LOOP_BEGIN:
+    case BfOpKind::IF_BEGIN: {
+      IrNode* loop = program->new_loop();
+      if (ops[pc].kind == BfOpKind::COUNTED_LOOP_BEGIN) {
+        loop->loop_kind = IrNode::LoopKind::COUNTED;
+      } else if (ops[pc].kind == BfOpKind::IF_BEGIN) {
+        loop->loop_kind = IrNode::LoopKind::IF;
+      }
+      nodes->push_back(loop);
+      open_loops.push(nodes);
+      nodes = &loop->body;
+      block = nullptr;
+      break;
+    }
+    case BfOpKind::JUMP_IF_DATA_NOT_ZERO:
+    case BfOpKind::COUNTED_LOOP_END:
+    case BfOpKind::IF_END:
+      if (open_loops.empty()) {
+        DIE << "unmatched closing ']' at pc=" << pc;
+      }
+      nodes = open_loops.top();
+      open_loops.pop();
+      block = nullptr;
+      break;
+    default:
+      if (!block) {
+        block = program->new_block();
+        nodes->push_back(block);
+      }
+      block->ops.push_back(ops[pc]);
+      break;
+    }
+  }
+
+  if (!open_loops.empty()) {
+    DIE << "unmatched '[' at end of program";
+  }
+}
+
+namespace {
+
+void lower_nodes(const std::vector<IrNode*>& nodes, size_t base,
+                 std::vector<BfOp>* ops) {
+  for (const IrNode* node : nodes) {
+    if (node->kind == IrNode::Kind::BLOCK) {
+      ops->insert(ops->end(), node->ops.begin(), node->ops.end());
+    } else {
+      BfOpKind open_kind = BfOpKind::JUMP_IF_DATA_ZERO;
+      BfOpKind close_kind = BfOpKind::JUMP_IF_DATA_NOT_ZERO;
+      if (node->loop_kind == IrNode::LoopKind::COUNTED) {
+        open_kind = BfOpKind::COUNTED_LOOP_BEGIN;
+        close_kind = BfOpKind::COUNTED_LOOP_END;
+      } else if (node->loop_kind == IrNode::LoopKind::IF) {
+        open_kind = BfOpKind::IF_BEGIN;
+        close_kind = BfOpKind::IF_END;
+      }
+      size_t open_bracket_offset = base + ops->size();
+      ops->push_back(BfOp(open_kind, 0));
+      lower_nodes(node->body, base, ops);
+      (*ops)[open_bracket_offset - base].argument = base + ops->size();
+      ops->push_back(BfOp(close_kind, open_bracket_offset));
+    }
+  }
+}
+
+size_t count_node_ops(const std::vector<IrNode*>& nodes) {
+  size_t count = 0;
+  for (const IrNode* node : nodes) {
+    count += node->kind == IrNode::Kind::BLOCK ? node->ops.size()
+                                               : 2 + count_node_ops(node->body);
+  }
+  return count;
+}
+
+} // namespace
+
+std::vector<BfOp> lower(const IrProgram& program, size_t base) {
+  std::vector<BfOp> ops;
+  ops.reserve(count_ops(program));
+  lower_nodes(program.body, base, &ops);
+  return ops;
+}
+
+size_t count_ops(const IrProgram& program) {
+  return count_node_ops(program.body);
+}
+
+void normalize(std::vector<IrNode*>* nodes) {
+  std::vector<IrNode*> new_nodes;
+  for (IrNode* node : *nodes) {
+    if (node->kind == IrNode::Kind::LOOP) {
+      normalize(&node->body);
+      new_nodes.push_back(node);
+    } else if (!node->ops.empty()) {
+      if (!new_nodes.empty() && new_nodes.back()->kind == IrNode::Kind::BLOCK) {
+        std::vector<BfOp>& prev_ops = new_nodes.back()->ops;
+        prev_ops.insert(prev_ops.end(), node->ops.begin(), node->ops.end());
+      } else {
+        new_nodes.push_back(node);
+      }
+    }
+  }
+  nodes->swap(new_nodes);
+}
+
+namespace {
+
+// Replaces loops by straight-line ops, innermost first. rewrite is called with
+// the ops of each loop whose body is a single block; if it returns true, the
+// loop is replaced by a block holding *new_ops.
+void rewrite_loops(IrProgram* program, std::vector<IrNode*>* nodes,
+                   bool (*rewrite)(const std::vector<BfOp>& body,
+                                   std::vector<BfOp>* new_ops)) {
+  for (IrNode*& node : *nodes) {
+    if (node->kind != IrNode::Kind::LOOP) {
+      continue;
+    }
+    rewrite_loops(program, &node->body, rewrite);
+
+    std::vector<BfOp> new_ops;
+    if (node->body.size() == 1 &&
+        node->body[0]->kind == IrNode::Kind::BLOCK &&
+        rewrite(node->body[0]->ops, &new_ops)) {
+      node = program->new_block(std::move(new_ops));
+    }
+  }
+}
+
+// Recognizes the loop idioms optinterp3 started out with: [-] and
+// [+] clear the cell, [>] and [<] scan for a zero, and [-<+>] and [->+<] move
+// the cell to a neighbor.
+bool optimize_simple_loop(const std::vector<BfOp>& body,
+                          std::vector<BfOp>* new_ops) {
+  if (body.size() == 1) {
+    BfOp repeated_op = body[0];
+    if (repeated_op.kind == BfOpKind::INC_DATA ||
+        repeated_op.kind == BfOpKind::DEC_DATA) {
+      new_ops->push_back(BfOp(BfOpKind::LOOP_SET_TO_ZERO, 0));
+    } else if (repeated_op.kind == BfOpKind::INC_PTR ||
+               repeated_op.kind == BfOpKind::DEC_PTR) {
+      new_ops->push_back(
+          BfOp(BfOpKind::LOOP_MOVE_PTR, repeated_op.kind == BfOpKind::INC_PTR
+                                            ? repeated_op.argument
+                                            : -repeated_op.argument));
+    }
+  } else if (body.size() == 4) {
+    // Detect patterns: -<+> and ->+<
+    if (body[0].kind == BfOpKind::DEC_DATA &&
+        body[2].kind == BfOpKind::INC_DATA && body[0].argument == 1 &&
+        body[2].argument == 1) {
+
+      if (body[1].kind == BfOpKind::INC_PTR &&
+          body[3].kind == BfOpKind::DEC_PTR &&
+          body[1].argument == body[3].argument) {
+        new_ops->push_back(BfOp(BfOpKind::LOOP_MOVE_DATA, body[1].argument));
+      } else if (body[1].kind == BfOpKind::DEC_PTR &&
+                 body[3].kind == BfOpKind::INC_PTR &&
+                 body[1].argument == body[3].argument) {
+        new_ops->push_back(BfOp(BfOpKind::LOOP_MOVE_DATA, -body[1].argument));
+      }
+    }
+  }
+  return !new_ops->empty();
+}
+
+// Recognizes linear loops: a loop whose body only moves the pointer and adds
+// constants to cells, ends up back at the cell it started from, and changes
+// that cell by exactly 1 (mod 256) per iteration. Such a loop runs n times,
+// where n is the initial value of the current cell (or 256 - n when it counts
+// up), so its effect is to add a multiple of n to each other cell it touches.
+// It becomes LOOP_MOVE_DATA for a single x1 target, and LOOP_MUL_ADD
+// otherwise.
+bool optimize_linear_loop(const std::vector<BfOp>& body,
+                          std::vector<BfOp>* new_ops) {
+  // Net change of each cell touched in one iteration, keyed by its offset
+  // from the loop's cell.
+  std::map<int64_t, int64_t> deltas;
+  int64_t offset = 0;
+  for (const BfOp& op : body) {
+    switch (op.kind) {
+    case BfOpKind::INC_PTR:
+      offset += op.argument;
+      break;
+    case BfOpKind::DEC_PTR:
+      offset -= op.argument;
+      break;
+    case BfOpKind::INC_DATA:
+      deltas[offset + op.offset] += op.argument;
+      break;
+    case BfOpKind::DEC_DATA:
+      deltas[offset + op.offset] -= op.argument;
+      break;
+    default:
+      return false;
+    }
+    if (offset < INT32_MIN || offset > INT32_MAX) {
+      return false;
+    }
+  }
+
+  uint8_t step = static_cast<uint8_t>(deltas[0]);
+  if (offset != 0 || (step != 1 && step != 255)) {
+    return false;
+  }
+
+  // When the cell counts up, the loop runs 256 - n times, which is -n modulo
+  // 256; the multipliers absorb the sign.
+  std::vector<BfOp> operands;
+  for (const auto& delta : deltas) {
+    int8_t multiplier = static_cast<int8_t>(step == 255 ? delta.second
+                                                        : -delta.second);
+    if (delta.first != 0 && multiplier != 0) {
+      operands.push_back(BfOp(BfOpKind::MUL_ADD_OPERAND, multiplier,
+                              static_cast<int32_t>(delta.first)));
+    }
+  }
+
+  if (operands.empty()) {
+    new_ops->push_back(BfOp(BfOpKind::LOOP_SET_TO_ZERO, 0));
+  } else if (operands.size() == 1 && operands[0].argument == 1) {
+    new_ops->push_back(BfOp(BfOpKind::LOOP_MOVE_DATA, operands[0].offset));
+  } else {
+    new_ops->push_back(BfOp(BfOpKind::LOOP_MUL_ADD, operands.size()));
+    new_ops->insert(new_ops->end(), operands.begin(), operands.end());
+  }
+  return true;
+}
+
+// How far canonicalize_block looks back for an earlier update of a cell.
+constexpr size_t kMaxCanonicalizeLookback = 16;
+
+// Ops that add a constant to their cell or set it to one, without reading or
+// touching anything else.
+bool is_cell_update(BfOpKind kind) {
+  return kind == BfOpKind::INC_DATA || kind == BfOpKind::DEC_DATA ||
+         kind == BfOpKind::LOOP_SET_TO_ZERO || kind == BfOpKind::SET_DATA;
+}
+
+// The effect of a cell update op: the cell is set to value if is_set, and
+// value is added to it otherwise.
+struct CellUpdate {
+  bool is_set;
+  int64_t value;
+};
+
+CellUpdate cell_update_of(const BfOp& op) {
+  switch (op.kind) {
+  case BfOpKind::INC_DATA:
+    return CellUpdate{false, op.argument};
+  case BfOpKind::DEC_DATA:
+    return CellUpdate{false, -op.argument};
+  case BfOpKind::LOOP_SET_TO_ZERO:
+    return CellUpdate{true, 0};
+  default:
+    return CellUpdate{true, op.argument};
+  }
+}
+
+// Builds the canonical op for update of the cell at offset into *op; returns
+// false if the update does nothing. Additions are reduced modulo 256 to the
+// shorter of INC_DATA and DEC_DATA.
+bool make_cell_update(CellUpdate update, int32_t offset, BfOp* op) {
+  uint8_t value = static_cast<uint8_t>(update.value);
+  if (update.is_set) {
+    *op = value == 0 ? BfOp(BfOpKind::LOOP_SET_TO_ZERO, 0, offset)
+                     : BfOp(BfOpKind::SET_DATA, value, offset);
+  } else if (value == 0) {
+    return false;
+  } else if (value <= 128) {
+    *op = BfOp(BfOpKind::INC_DATA, value, offset);
+  } else {
+    *op = BfOp(BfOpKind::DEC_DATA, 256 - value, offset);
+  }
+  return true;
+}
+
+// An affine function of the cells' values (mod 256): the sum of constant and
+// each cell times its coefficient. Cells are keyed by their offset from the
+// loop's cell; zero coefficients are never stored.
+struct AffineExpr {
+  std::map<int64_t, uint8_t> coefficients;
+  uint8_t constant = 0;
+
+  // The value of the cell at offset.
+  static AffineExpr cell(int64_t offset) {
+    AffineExpr expr;
+    expr.coefficients[offset] = 1;
+    return expr;
+  }
+
+  // Adds scale times other.
+  void add(const AffineExpr& other, uint8_t scale) {
+    constant += other.constant * scale;
+    for (const auto& coefficient : other.coefficients) {
+      uint8_t sum = coefficients[coefficient.first] + coefficient.second * scale;
+      if (sum) {
+        coefficients[coefficient.first] = sum;
+      } else {
+        coefficients.erase(coefficient.first);
+      }
+    }
+  }
+
+  bool operator==(const AffineExpr& other) const {
+    return constant == other.constant && coefficients == other.coefficients;
+  }
+};
+
+// The effect of straight-line code on the tape: the new value of each cell it
+// changes, as an affine function of the values before it. Cells without an
+// entry keep their value.
+class AffineMap {
+public:
+  AffineExpr get(int64_t offset) const {
+    auto it = cells_.find(offset);
+    return it == cells_.end() ? AffineExpr::cell(offset) : it->second;
+  }
+
+  void set(int64_t offset, const AffineExpr& expr) {
+    cells_[offset] = expr;
+  }
+
+  const std::map<int64_t, AffineExpr>& cells() const {
+    return cells_;
+  }
+
+  // Adds the effect of the ops of a loop body, run with the data pointer on the
+  // loop's cell. Returns false if an op isn't affine or the body doesn't end
+  // where it started.
+  bool apply(const std::vector<BfOp>& ops) {
+    int64_t offset = 0;
+    for (size_t i = 0; i < ops.size(); ++i) {
+      const BfOp& op = ops[i];
+      int64_t cell = offset + op.offset;
+      switch (op.kind) {
+      case BfOpKind::INC_PTR:
+        offset += op.argument;
+        break;
+      case BfOpKind::DEC_PTR:
+        offset -= op.argument;
+        break;
+      case BfOpKind::INC_DATA:
+      case BfOpKind::DEC_DATA:
+      case BfOpKind::LOOP_SET_TO_ZERO:
+      case BfOpKind::SET_DATA: {
+        CellUpdate update = cell_update_of(op);
+        AffineExpr expr = update.is_set ? AffineExpr() : get(cell);
+        expr.constant += update.value;
+        set(cell, expr);
+        break;
+      }
+      case BfOpKind::LOOP_MOVE_DATA:
+      case BfOpKind::LOOP_MUL_ADD: {
+        // Both add multiples of the cell to their targets, which does nothing
+        // when the cell is 0, so they're affine.
+        AffineExpr count = get(cell);
+        if (op.kind == BfOpKind::LOOP_MOVE_DATA) {
+          AffineExpr target = get(cell + op.argument);
+          target.add(count, 1);
+          set(cell + op.argument, target);
+        }
+        for (size_t j = 1; j <= num_operands(op); ++j) {
+          const BfOp& operand = ops[i + j];
+          AffineExpr target = get(cell + operand.offset);
+          target.add(count, static_cast<uint8_t>(operand.argument));
+          set(cell + operand.offset, target);
+        }
+        set(cell, AffineExpr());
+        i += num_operands(op);
+        break;
+      }
+      default:
+        return false;
+      }
+      if (offset < INT32_MIN || offset > INT32_MAX) {
+        return false;
+      }
+    }
+    return offset == 0;
+  }
+
+  // Returns this map applied after other.
+  AffineMap after(const AffineMap& other) const {
+    AffineMap result = other;
+    for (const auto& cell : cells_) {
+      AffineExpr expr;
+      expr.constant = cell.second.constant;
+      for (const auto& coefficient : cell.second.coefficients) {
+        expr.add(other.get(coefficient.first), coefficient.second);
+      }
+      result.set(cell.first, expr);
+    }
+    return result;
+  }
+
+private:
+  std::map<int64_t, AffineExpr> cells_;
+};
+
+// Returns a - b.
+AffineExpr subtract(AffineExpr a, const AffineExpr& b) {
+  a.add(b, 255);
+  return a;
+}
+
+// Finds the closed form of a loop whose body is straight-line affine code, as
+// left by the linear-loops pass for nested loops such as multiplication's
+// [->[->+>+<<]>>[-<<+>>]<<<]. The loop's cell has to count down by 1 per
+// iteration, so that it runs n times for its entry value n.
+//
+// With F the effect of one iteration, S_k = F^k the state after k of them, and
+// D = S_2 - S_1, S_3 - S_2 = F(S_2) - F(S_1) is F's linear part applied to D. If
+// that is D again, every later difference is D as well, and
+// S_n = S_1 + (n - 1) * D for n >= 1, which becomes a LOOP_CLOSED_FORM.
+// Otherwise (e.g. the cells grow like n^2) the loop is left alone.
+bool optimize_closed_form_loop(const std::vector<BfOp>& body,
+                               std::vector<BfOp>* new_ops) {
+  AffineMap step;
+  if (!step.apply(body)) {
+    return false;
+  }
+  AffineExpr counter = AffineExpr::cell(0);
+  counter.constant = 255;
+  if (!(step.get(0) == counter)) {
+    return false;
+  }
+
+  AffineMap s2 = step.after(step);
+  AffineMap s3 = step.after(s2);
+
+  std::vector<BfOp> terms;
+  for (const auto& cell : s3.cells()) {
+    int64_t offset = cell.first;
+    AffineExpr s1_cell = step.get(offset);
+    AffineExpr difference = subtract(s2.get(offset), s1_cell);
+    if (!(subtract(cell.second, s2.get(offset)) == difference)) {
+      return false;
+    }
+    if (offset == 0 ||
+        (s1_cell == AffineExpr::cell(offset) && difference == AffineExpr())) {
+      continue;
+    }
+    if (offset < INT32_MIN || offset > INT32_MAX) {
+      return false;
+    }
+
+    std::set<int64_t> sources;
+    for (const auto& coefficient : s1_cell.coefficients) {
+      sources.insert(coefficient.first);
+    }
+    for (const auto& coefficient : difference.coefficients) {
+      sources.insert(coefficient.first);
+    }
+    for (int64_t source : sources) {
+      ClosedFormTerm term{static_cast<int32_t>(source), false,
+                          s1_cell.coefficients[source],
+                          difference.coefficients[source]};
+      terms.push_back(BfOp(BfOpKind::CLOSED_FORM_TERM,
+                           encode_closed_form_term(term),
+                           static_cast<int32_t>(offset)));
+    }
+    // A cell cleared by the loop gets a lone zero term.
+    if (s1_cell.constant || difference.constant || sources.empty()) {
+      ClosedFormTerm term{0, true, s1_cell.constant, difference.constant};
+      terms.push_back(BfOp(BfOpKind::CLOSED_FORM_TERM,
+                           encode_closed_form_term(term),
+                           static_cast<int32_t>(offset)));
+    }
+  }
+  if (terms.empty() || terms.size() > kMaxClosedFormTerms) {
+    return false;
+  }
+
+  new_ops->push_back(BfOp(BfOpKind::LOOP_CLOSED_FORM, terms.size()));
+  new_ops->insert(new_ops->end(), terms.begin(), terms.end());
+  return true;
+}
+
+// Peephole canonicalization of a block. Adjacent pointer moves are merged
+// into one signed move, and each cell update is merged into an earlier update
+// of the same cell when only updates of other cells come in between (so
+// +-+ is +, [-]+++ is SET_DATA 3, and +++[-] is LOOP_SET_TO_ZERO). Moves and
+// updates that do nothing are dropped.
+void canonicalize_block(std::vector<BfOp>* ops) {
+  std::vector<BfOp> new_ops;
+  new_ops.reserve(ops->size());
+
+  for (size_t i = 0; i < ops->size(); ++i) {
+    BfOp op = (*ops)[i];
+    switch (op.kind) {
+    case BfOpKind::INC_PTR:
+    case BfOpKind::DEC_PTR: {
+      int64_t delta = op.kind == BfOpKind::INC_PTR ? op.argument : -op.argument;
+      if (!new_ops.empty() && (new_ops.back().kind == BfOpKind::INC_PTR ||
+                               new_ops.back().kind == BfOpKind::DEC_PTR)) {
+        delta += new_ops.back().kind == BfOpKind::INC_PTR
+                     ? new_ops.back().argument
+                     : -new_ops.back().argument;
+        new_ops.pop_back();
+      }
+      if (delta > 0) {
+        new_ops.push_back(BfOp(BfOpKind::INC_PTR, delta));
+      } else if (delta < 0) {
+        new_ops.push_back(BfOp(BfOpKind::DEC_PTR, -delta));
+      }
+      break;
+    }
+    case BfOpKind::INC_DATA:
+    case BfOpKind::DEC_DATA:
+    case BfOpKind::LOOP_SET_TO_ZERO:
+    case BfOpKind::SET_DATA: {
+      CellUpdate update = cell_update_of(op);
+
+      // Look for an earlier update of the same cell to merge into; only
+      // updates of other cells may be skipped over.
+      size_t j = new_ops.size();
+      size_t limit = j > kMaxCanonicalizeLookback
+                         ? j - kMaxCanonicalizeLookback
+                         : 0;
+      bool found = false;
+      while (j > limit && is_cell_update(new_ops[j - 1].kind)) {
+        --j;
+        if (new_ops[j].offset == op.offset) {
+          found = true;
+          break;
+        }
+      }
+
+      if (found) {
+        CellUpdate prev = cell_update_of(new_ops[j]);
+        if (!update.is_set) {
+          update = CellUpdate{prev.is_set, prev.value + update.value};
+        }
+        if (!make_cell_update(update, op.offset, &new_ops[j])) {
+          new_ops.erase(new_ops.begin() + j);
+        }
+      } else if (make_cell_update(update, op.offset, &op)) {
+        new_ops.push_back(op);
+      }
+      break;
+    }
+    default:
+      new_ops.insert(new_ops.end(), ops->begin() + i,
+                     ops->begin() + i + 1 + num_operands(op));
+      i += num_operands(op);
+      break;
+    }
+  }
+  ops->swap(new_ops);
+}
+
+void canonicalize_in(std::vector<IrNode*>* nodes) {
+  for (IrNode* node : *nodes) {
+    if (node->kind == IrNode::Kind::BLOCK) {
+      canonicalize_block(&node->ops);
+    } else {
+      canonicalize_in(&node->body);
+    }
+  }
+}
+
+void canonicalize_pass(IrProgram* program, const Flags&) {
+  canonicalize_in(&program->body);
+}
+
+void simple_loops_pass(IrProgram* program, const Flags&) {
+  rewrite_loops(program, &program->body, optimize_simple_loop);
+}
+
+void linear_loops_pass(IrProgram* program, const Flags&) {
+  rewrite_loops(program, &program->body, optimize_linear_loop);
+}
+
+void closed_form_pass(IrProgram* program, const Flags&) {
+  rewrite_loops(program, &program->body, optimize_closed_form_loop);
+}
+
+// Longest loop, in BF commands, the divmod pass tries to match.
+constexpr size_t kMaxDivmodLoopSize = 512;
+
+// Appends the BF source of nodes to *source. Returns false if they hold ops
+// other than pointer moves and cell increments, or *source would grow past
+// kMaxDivmodLoopSize.
+bool unparse(const std::vector<IrNode*>& nodes, std::string* source) {
+  for (const IrNode* node : nodes) {
+    if (node->kind == IrNode::Kind::LOOP) {
+      source->push_back('[');
+      if (!unparse(node->body, source)) {
+        return false;
+      }
+      source->push_back(']');
+      continue;
+    }
+    for (const BfOp& op : node->ops) {
+      char command;
+      switch (op.kind) {
+      case BfOpKind::INC_PTR:
+        command = '>';
+        break;
+      case BfOpKind::DEC_PTR:
+        command = '<';
+        break;
+      case BfOpKind::INC_DATA:
+        command = '+';
+        break;
+      case BfOpKind::DEC_DATA:
+        command = '-';
+        break;
+      default:
+        return false;
+      }
+      if (op.offset != 0 || op.argument < 0 ||
+          static_cast<uint64_t>(op.argument) >
+              kMaxDivmodLoopSize - source->size()) {
+        return false;
+      }
+      source->append(op.argument, command);
+    }
+  }
+  return source->size() <= kMaxDivmodLoopSize;
+}
+
+// Reads the BF source of a pattern; see parse_carry_cascade.
+class SourceCursor {
+public:
+  explicit SourceCursor(const std::string& source) : source_(source) {}
+
+  bool at_end() const {
+    return pos_ == source_.size();
+  }
+
+  // Skips text if the source continues with it.
+  bool eat(const char* text) {
+    size_t size = strlen(text);
+    if (source_.compare(pos_, size, text) != 0) {
+      return false;
+    }
+    pos_ += size;
+    return true;
+  }
+
+  // Skips a run of command and returns its length.
+  int64_t run(char command) {
+    size_t start = pos_;
+    while (pos_ < source_.size() && source_[pos_] == command) {
+      ++pos_;
+    }
+    return pos_ - start;
+  }
+
+  // Skips a pointer move and returns its signed length.
+  int64_t move() {
+    int64_t forward = run('>');
+    return forward ? forward : -run('<');
+  }
+
+private:
+  const std::string& source_;
+  size_t pos_ = 0;
+};
+
+BfOp make_divmod_operand(int32_t offset, DivmodOperand::Role role,
+                         uint8_t value = 0, int8_t dividend = 0,
+                         int8_t remainder = 0, int8_t quotient = 0) {
+  DivmodOperand operand{role, value, dividend, remainder, quotient};
+  return BfOp(BfOpKind::DIVMOD_OPERAND, encode_divmod_operand(operand), offset);
+}
+
+// Matches the digit carry of decimal (or any base k) arithmetic, as in
+// factor.bf's
+//
+//   [->+<[->+< ... [->--------->>>>>>>>>+<<<<<<<<<<[->+<]] ... ]]
+//
+// with k - 1 levels that each move 1 from the cell to the digit at s, and a
+// last one that takes k back off the digit, carries 1 to the cell at c and
+// moves the rest. For n < 2k that's the digit plus n % k and the carry plus
+// n / k.
+bool parse_carry_cascade(const std::string& source,
+                         std::vector<BfOp>* operands) {
+  SourceCursor cursor(source);
+  int64_t levels = 0;
+  int64_t digit = 0;
+  for (;;) {
+    if (!cursor.eat("[-")) {
+      return false;
+    }
+    int64_t move = cursor.move();
+    if (move == 0 || (digit != 0 && move != digit)) {
+      return false;
+    }
+    digit = move;
+    if (!cursor.eat("+")) {
+      break;
+    }
+    if (cursor.move() != -digit) {
+      return false;
+    }
+    ++levels;
+  }
+
+  int64_t base = levels + 1;
+  if (levels == 0 || 2 * base > 255 || cursor.run('-') != levels) {
+    return false;
+  }
+  int64_t carry = digit + cursor.move();
+  if (carry == 0 || carry == digit || !cursor.eat("+") ||
+      cursor.move() != -carry || !cursor.eat("[-") ||
+      cursor.move() != digit || !cursor.eat("+") ||
+      cursor.move() != -digit || !cursor.eat("]")) {
+    return false;
+  }
+  for (int64_t i = 0; i < base; ++i) {
+    if (!cursor.eat("]")) {
+      return false;
+    }
+  }
+  if (!cursor.at_end()) {
+    return false;
+  }
+
+  operands->push_back(make_divmod_operand(
+      0, DivmodOperand::Role::DIVISOR_CONSTANT, base));
+  operands->push_back(make_divmod_operand(
+      0, DivmodOperand::Role::DIVIDEND_BELOW, 2 * base));
+  operands->push_back(make_divmod_operand(
+      digit, DivmodOperand::Role::ADD_RESULT, 0, 0, 1, 0));
+  operands->push_back(make_divmod_operand(
+      carry, DivmodOperand::Role::ADD_RESULT, 0, 0, 0, 1));
+  return true;
+}
+
+// Division loops from the usual collections of BF algorithms, keyed by their
+// source as it reads after canonicalization, with the DIVMOD_OPERANDs that
+// describe them. Each one is also matched mirrored, with < and > swapped and
+// the offsets negated, and spread out over every second or third cell (up to
+// kMaxDivmodStride), as in programs that interleave their variables with flag
+// cells.
+constexpr int kMaxDivmodStride = 3;
+
+std::vector<std::pair<std::string, std::vector<BfOp>>> divmod_templates() {
+  using Role = DivmodOperand::Role;
+  struct Template {
+    const char* source;
+    std::vector<BfOp> operands;
+  };
+  // Where n is kept, the copy of it is an ADD_RESULT, so its cell needn't be
+  // clear. So is the quotient, which the loops only ever increment.
+  const std::vector<BfOp> kKeepDividend = {
+      make_divmod_operand(2, Role::DIVISOR_CELL),
+      make_divmod_operand(3, Role::ZERO_CELL),
+      make_divmod_operand(5, Role::ZERO_CELL),
+      make_divmod_operand(6, Role::ZERO_CELL),
+      make_divmod_operand(1, Role::ADD_RESULT, 0, 1, 0, 0),
+      make_divmod_operand(2, Role::ADD_RESULT, 0, 0, -1, 0),
+      make_divmod_operand(3, Role::ADD_RESULT, 0, 0, 1, 0),
+      make_divmod_operand(4, Role::ADD_RESULT, 0, 0, 0, 1)};
+  const std::vector<BfOp> kDropDividend = {
+      make_divmod_operand(1, Role::DIVISOR_CELL),
+      make_divmod_operand(2, Role::ZERO_CELL),
+      make_divmod_operand(4, Role::ZERO_CELL),
+      make_divmod_operand(5, Role::ZERO_CELL),
+      make_divmod_operand(1, Role::ADD_RESULT, 0, 0, -1, 0),
+      make_divmod_operand(2, Role::ADD_RESULT, 0, 0, 1, 0),
+      make_divmod_operand(3, Role::ADD_RESULT, 0, 0, 0, 1)};
+  const Template kTemplates[] = {
+      // n 0 d 0 0 0 0 -> 0 n d-n%d n%d n/d 0 0
+      {"[->+>-[>+>>]>[+[-<+>]>+>>]<<<<<<]", kKeepDividend},
+      {"[>+>-[>+>>]>[+[-<+>]>+>>]<<<<<<-]", kKeepDividend},
+      // n d 0 0 0 0 -> 0 d-n%d n%d n/d 0 0
+      {"[->-[>+>>]>[+[-<+>]>+>>]<<<<<]", kDropDividend},
+      {"[>-[>+>>]>[+[-<+>]>+>>]<<<<<-]", kDropDividend},
+  };
+
+  std::vector<std::pair<std::string, std::vector<BfOp>>> templates;
+  for (const Template& t : kTemplates) {
+    for (int stride = 1; stride <= kMaxDivmodStride; ++stride) {
+      for (bool mirrored : {false, true}) {
+        std::string source;
+        for (char c : std::string(t.source)) {
+          if (mirrored) {
+            c = c == '<' ? '>' : c == '>' ? '<' : c;
+          }
+          source.append(c == '<' || c == '>' ? stride : 1, c);
+        }
+        std::vector<BfOp> operands = t.operands;
+        for (BfOp& operand : operands) {
+          operand.offset *= mirrored ? -stride : stride;
+        }
+        IrProgram program;
+        lift(translate_source(source.data(), source.size()), &program);
+        canonicalize_in(&program.body);
+        std::string canonical;
+        if (!unparse(program.body, &canonical)) {
+          DIE << "bad divmod template " << source;
+        }
+        templates.emplace_back(canonical, operands);
+      }
+    }
+  }
+  return templates;
+}
+
+// If the loop is a division the divmod pass knows, sets *ops to its DIVMOD.
+bool match_divmod_loop(IrNode* loop, std::vector<BfOp>* ops) {
+  static const std::vector<std::pair<std::string, std::vector<BfOp>>>
+      templates = divmod_templates();
+
+  std::string source;
+  if (!unparse({loop}, &source)) {
+    return false;
+  }
+  std::vector<BfOp> operands;
+  for (const auto& t : templates) {
+    if (t.first == source) {
+      operands = t.second;
+      break;
+    }
+  }
+  if (operands.empty() && !parse_carry_cascade(source, &operands)) {
+    return false;
+  }
+  ops->push_back(BfOp(BfOpKind::DIVMOD, operands.size()));
+  ops->insert(ops->end(), operands.begin(), operands.end());
+  return true;
+}
+
+void divmod_in(IrProgram* program, std::vector<IrNode*>* nodes) {
+  std::vector<IrNode*> new_nodes;
+  for (IrNode* node : *nodes) {
+    if (node->kind == IrNode::Kind::LOOP) {
+      std::vector<BfOp> ops;
+      if (match_divmod_loop(node, &ops)) {
+        new_nodes.push_back(program->new_block(std::move(ops)));
+      } else {
+        divmod_in(program, &node->body);
+      }
+    }
+    new_nodes.push_back(node);
+  }
+  nodes->swap(new_nodes);
+}
+
+// Puts a DIVMOD before each loop that matches a known division pattern. The
+// loop stays: DIVMOD clears its cell so it's skipped, unless one of DIVMOD's
+// preconditions (e.g. a zero scratch cell) fails at run time and the loop
+// does the work after all.
+void divmod_pass(IrProgram* program, const Flags&) {
+  divmod_in(program, &program->body);
+}
+
+// Removes the INC_PTR/DEC_PTR ops of a block: their pending sum is folded into
+// the offsets of the data and I/O ops that follow, and the pointer is only
+// updated before LOOP_MOVE_PTR and at the end of the block.
+void fold_block_pointer_moves(std::vector<BfOp>* ops) {
+  std::vector<BfOp> new_ops;
+  new_ops.reserve(ops->size());
+
+  // How far the pointer should have moved by now, but hasn't.
+  int64_t pending = 0;
+  auto materialize = [&]() {
+    if (pending > 0) {
+      new_ops.push_back(BfOp(BfOpKind::INC_PTR, pending));
+    } else if (pending < 0) {
+      new_ops.push_back(BfOp(BfOpKind::DEC_PTR, -pending));
+    }
+    pending = 0;
+  };
+
+  for (size_t i = 0; i < ops->size(); ++i) {
+    BfOp op = (*ops)[i];
+    switch (op.kind) {
+    case BfOpKind::INC_PTR:
+      pending += op.argument;
+      break;
+    case BfOpKind::DEC_PTR:
+      pending -= op.argument;
+      break;
+    case BfOpKind::LOOP_MOVE_PTR:
+      materialize();
+      new_ops.push_back(op);
+      break;
+    default:
+      if (op.offset + pending < INT32_MIN || op.offset + pending > INT32_MAX) {
+        materialize();
+      }
+      op.offset += pending;
+      new_ops.push_back(op);
+      // Operand offsets are relative to the header's cell, so they don't
+      // change.
+      new_ops.insert(new_ops.end(), ops->begin() + i + 1,
+                     ops->begin() + i + 1 + num_operands(op));
+      i += num_operands(op);
+      break;
+    }
+  }
+  materialize();
+  ops->swap(new_ops);
+}
+
+void fold_pointers_in(std::vector<IrNode*>* nodes) {
+  for (IrNode* node : *nodes) {
+    if (node->kind == IrNode::Kind::BLOCK) {
+      fold_block_pointer_moves(&node->ops);
+    } else {
+      fold_pointers_in(&node->body);
+    }
+  }
+}
+
+void fold_pointers_pass(IrProgram* program, const Flags&) {
+  fold_pointers_in(&program->body);
+}
+
+// Cells the partial evaluator may use. Every executor's tape is at least this
+// large, and programs start on its first cell.
+constexpr int64_t kPartialEvalTapeSize = 30000;
+
+// Executes IR on a model of the tape, for partial_eval_pass.
+class PartialEvaluator {
+public:
+  explicit PartialEvaluator(uint64_t max_steps)
+    : tape(kPartialEvalTapeSize), max_steps_(max_steps) {}
+
+  // Runs nodes from the current state and returns true. Returns false if they
+  // read input, use an op the evaluator doesn't model, touch a cell off the
+  // tape or go over the step budget; the state is then left half-updated.
+  bool run(const std::vector<IrNode*>& nodes) {
+    for (const IrNode* node : nodes) {
+      if (node->kind == IrNode::Kind::BLOCK) {
+        if (!run_block(node->ops)) {
+          return false;
+        }
+        continue;
+      }
+      for (;;) {
+        uint8_t* c = cell(0);
+        if (!c || !step()) {
+          return false;
+        }
+        if (!*c) {
+          break;
+        }
+        if (!run(node->body)) {
+          return false;
+        }
+      }
+    }
+    return true;
+  }
+
+  // Marks all cells clean; dirty_low > dirty_high until a cell is written.
+  void clear_dirty() {
+    dirty_low = kPartialEvalTapeSize;
+    dirty_high = -1;
+  }
+
+  std::vector<uint8_t> tape;
+  int64_t dataptr = 0;
+  std::string output;
+
+  // Range of cells written since the last clear_dirty().
+  int64_t dirty_low = kPartialEvalTapeSize;
+  int64_t dirty_high = -1;
+
+private:
+  bool step() {
+    return ++steps_ <= max_steps_;
+  }
+
+  // Returns the cell at offset from the data pointer, or nullptr if it's off
+  // the tape.
+  uint8_t* cell(int64_t offset) {
+    int64_t index = dataptr + offset;
+    if (index < 0 || index >= kPartialEvalTapeSize) {
+      return nullptr;
+    }
+    return &tape[index];
+  }
+
+  // Same as cell(), for a cell about to be written.
+  uint8_t* dirty_cell(int64_t offset) {
+    uint8_t* c = cell(offset);
+    if (c) {
+      dirty_low = std::min(dirty_low, dataptr + offset);
+      dirty_high = std::max(dirty_high, dataptr + offset);
+    }
+    return c;
+  }
+
+  bool run_block(const std::vector<BfOp>& ops) {
+    for (size_t i = 0; i < ops.size(); ++i) {
+      const BfOp& op = ops[i];
+      if (!step()) {
+        return false;
+      }
+      switch (op.kind) {
+      case BfOpKind::INC_PTR:
+        dataptr += op.argument;
+        break;
+      case BfOpKind::DEC_PTR:
+        dataptr -= op.argument;
+        break;
+      case BfOpKind::INC_DATA:
+      case BfOpKind::DEC_DATA:
+      case BfOpKind::LOOP_SET_TO_ZERO:
+      case BfOpKind::SET_DATA: {
+        uint8_t* c = dirty_cell(op.offset);
+        if (!c) {
+          return false;
+        }
+        CellUpdate update = cell_update_of(op);
+        *c = update.is_set ? update.value : *c + update.value;
+        break;
+      }
+      case BfOpKind::WRITE_STDOUT: {
+        uint8_t* c = cell(op.offset);
+        if (!c) {
+          return false;
+        }
+        output.append(op.argument, static_cast<char>(*c));
+        break;
+      }
+      case BfOpKind::LOOP_MOVE_PTR:
+        for (;;) {
+          uint8_t* c = cell(0);
+          if (!c || !step()) {
+            return false;
+          }
+          if (!*c) {
+            break;
+          }
+          dataptr += op.argument;
+        }
+        break;
+      case BfOpKind::LOOP_MOVE_DATA: {
+        // Like the executors, only touch the target when there's something
+        // to move.
+        uint8_t* c = cell(op.offset);
+        if (!c) {
+          return false;
+        }
+        if (*c) {
+          uint8_t* target = dirty_cell(op.offset + op.argument);
+          if (!target) {
+            return false;
+          }
+          *target += *c;
+          *dirty_cell(op.offset) = 0;
+        }
+        break;
+      }
+      case BfOpKind::LOOP_MUL_ADD: {
+        uint8_t* c = cell(op.offset);
+        if (!c) {
+          return false;
+        }
+        if (*c) {
+          for (int64_t j = 1; j <= op.argument; ++j) {
+            const BfOp& operand = ops[i + j];
+            uint8_t* target = dirty_cell(op.offset + operand.offset);
+            if (!target) {
+              return false;
+            }
+            *target += *c * operand.argument;
+          }
+          *dirty_cell(op.offset) = 0;
+        }
+        i += op.argument;
+        break;
+      }
+      case BfOpKind::LOOP_CLOSED_FORM: {
+        // Check all the cells the loop reads and writes are on the tape
+        // before running it.
+        if (!cell(op.offset)) {
+          return false;
+        }
+        for (int64_t j = 1; j <= op.argument; ++j) {
+          const BfOp& term = ops[i + j];
+          ClosedFormTerm decoded = decode_closed_form_term(term.argument);
+          if (!dirty_cell(op.offset + term.offset) ||
+              (!decoded.is_constant &&
+               !cell(op.offset + decoded.source))) {
+            return false;
+          }
+        }
+        run_closed_form_loop(&ops[i], dirty_cell(op.offset));
+        i += op.argument;
+        break;
+      }
+      case BfOpKind::DIVMOD: {
+        if (!cell(op.offset)) {
+          return false;
+        }
+        for (int64_t j = 1; j <= op.argument; ++j) {
+          if (!dirty_cell(op.offset + ops[i + j].offset)) {
+            return false;
+          }
+        }
+        run_divmod(&ops[i], dirty_cell(op.offset));
+        i += op.argument;
+        break;
+      }
+      default:
+        // Input, and ops of later passes that aren't modeled.
+        return false;
+      }
+    }
+    return true;
+  }
+
+  uint64_t steps_ = 0;
+  uint64_t max_steps_;
+};
+
+// Runs the program's top-level nodes at translation time, one at a time, until
+// one needs input or the step budget runs out. The nodes that completed are
+// replaced by their effect: a TAPE_SNAPSHOT of the cells they left nonzero, a
+// WRITE_STRING of their output and a move to where they left the pointer.
+void partial_eval_pass(IrProgram* program, const Flags& flags) {
+  if (!program->at_start) {
+    return;
+  }
+
+  PartialEvaluator evaluator(flags.peval_steps);
+  // State after the last node that completed; the evaluator's own state may
+  // run ahead of it into a node that fails.
+  std::vector<uint8_t> tape(kPartialEvalTapeSize);
+  int64_t dataptr = 0;
+  size_t output_size = 0;
+  int64_t low = kPartialEvalTapeSize;
+  int64_t high = -1;
+
+  size_t num_evaluated = 0;
+  for (IrNode* node : program->body) {
+    evaluator.clear_dirty();
+    if (!evaluator.run({node})) {
+      break;
+    }
+    if (evaluator.dirty_low <= evaluator.dirty_high) {
+      std::copy(evaluator.tape.begin() + evaluator.dirty_low,
+                evaluator.tape.begin() + evaluator.dirty_high + 1,
+                tape.begin() + evaluator.dirty_low);
+      low = std::min(low, evaluator.dirty_low);
+      high = std::max(high, evaluator.dirty_high);
+    }
+    dataptr = evaluator.dataptr;
+    output_size = evaluator.output.size();
+    ++num_evaluated;
+  }
+  if (num_evaluated == 0) {
+    return;
+  }
+
+  std::vector<BfOp> ops;
+  while (low <= high && tape[low] == 0) {
+    ++low;
+  }
+  while (high >= low && tape[high] == 0) {
+    --high;
+  }
+  if (low <= high) {
+    size_t offset =
+        add_constant(&program->constants, &tape[low], high - low + 1);
+    ops.push_back(BfOp(BfOpKind::TAPE_SNAPSHOT, offset, low));
+  }
+  if (output_size > 0) {
+    size_t offset = add_constant(&program->constants, evaluator.output.data(),
+                                 output_size);
+    ops.push_back(BfOp(BfOpKind::WRITE_STRING, offset));
+  }
+  if (dataptr > 0) {
+    ops.push_back(BfOp(BfOpKind::INC_PTR, dataptr));
+  } else if (dataptr < 0) {
+    ops.push_back(BfOp(BfOpKind::DEC_PTR, -dataptr));
+  }
+
+  program->body.erase(program->body.begin(),
+                      program->body.begin() + num_evaluated);
+  program->body.insert(program->body.begin(),
+                       program->new_block(std::move(ops)));
+}
+
+// What is known about the tape at some point of the program: the values of
+// some cells, addressed relative to the data pointer. When all_zero is set, cells
+// without an entry are known to be 0; otherwise they're unknown.
+class KnownCells {
+public:
+  // Starts with nothing known.
+  KnownCells() = default;
+
+  // The tape at the start of the program.
+  static KnownCells zero_tape() {
+    KnownCells known;
+    known.all_zero_ = true;
+    return known;
+  }
+
+  // Sets *value to the cell at offset and returns true if it's known.
+  bool get(int64_t offset, uint8_t* value) const {
+    auto it = cells_.find(dataptr_ + offset);
+    if (it == cells_.end()) {
+      *value = 0;
+      return all_zero_;
+    }
+    *value = static_cast<uint8_t>(it->second);
+    return it->second >= 0;
+  }
+
+  void set(int64_t offset, uint8_t value) {
+    cells_[dataptr_ + offset] = value;
+  }
+
+  void forget(int64_t offset) {
+    cells_[dataptr_ + offset] = kUnknown;
+  }
+
+  void forget_all() {
+    cells_.clear();
+    all_zero_ = false;
+  }
+
+  void move(int64_t delta) {
+    dataptr_ += delta;
+  }
+
+  // Updates the state for the op at ops[*pc], advancing *pc past its operands.
+  // Ops that aren't modeled make everything unknown.
+  void apply(const std::vector<BfOp>& ops, size_t* pc,
+             const std::string& constants) {
+    const BfOp& op = ops[*pc];
+    uint8_t value;
+    switch (op.kind) {
+    case BfOpKind::INC_PTR:
+      move(op.argument);
+      break;
+    case BfOpKind::DEC_PTR:
+      move(-op.argument);
+      break;
+    case BfOpKind::INC_DATA:
+    case BfOpKind::DEC_DATA:
+    case BfOpKind::LOOP_SET_TO_ZERO:
+    case BfOpKind::SET_DATA: {
+      CellUpdate update = cell_update_of(op);
+      if (update.is_set) {
+        set(op.offset, update.value);
+      } else if (get(op.offset, &value)) {
+        set(op.offset, value + update.value);
+      }
+      break;
+    }
+    case BfOpKind::READ_STDIN:
+      forget(op.offset);
+      break;
+    case BfOpKind::WRITE_STDOUT:
+    case BfOpKind::WRITE_STRING:
+      break;
+    case BfOpKind::TAPE_SNAPSHOT: {
+      size_t size;
+      const uint8_t* data = get_constant(constants, op.argument, &size);
+      for (size_t i = 0; i < size; ++i) {
+        set(op.offset + i, data[i]);
+      }
+      break;
+    }
+    case BfOpKind::LOOP_MOVE_PTR:
+    case BfOpKind::LOOP_SCAN_CLEAR:
+      // Ends up on a zero cell somewhere.
+      forget_all();
+      set(0, 0);
+      break;
+    case BfOpKind::LOOP_MOVE_DATA:
+    case BfOpKind::LOOP_MUL_ADD: {
+      std::vector<BfOp> operands;
+      if (op.kind == BfOpKind::LOOP_MOVE_DATA) {
+        operands.push_back(
+            BfOp(BfOpKind::MUL_ADD_OPERAND, 1, static_cast<int32_t>(op.argument)));
+      } else {
+        operands.assign(ops.begin() + *pc + 1,
+                        ops.begin() + *pc + 1 + op.argument);
+        *pc += op.argument;
+      }
+      uint8_t count;
+      bool count_known = get(op.offset, &count);
+      for (const BfOp& operand : operands) {
+        int64_t target = op.offset + operand.offset;
+        if (!count_known) {
+          forget(target);
+        } else if (get(target, &value)) {
+          set(target, value + count * operand.argument);
+        }
+      }
+      set(op.offset, 0);
+      break;
+    }
+    case BfOpKind::LOOP_CLOSED_FORM: {
+      uint8_t count;
+      if (!get(op.offset, &count) || count != 0) {
+        for (int64_t j = 1; j <= op.argument; ++j) {
+          forget(op.offset + ops[*pc + j].offset);
+        }
+      }
+      *pc += op.argument;
+      set(op.offset, 0);
+      break;
+    }
+    case BfOpKind::DIVMOD:
+      // Whether it runs depends on its preconditions.
+      if (!get(op.offset, &value) || value != 0) {
+        forget(op.offset);
+        for (int64_t j = 1; j <= op.argument; ++j) {
+          forget(op.offset + ops[*pc + j].offset);
+        }
+      }
+      *pc += op.argument;
+      break;
+    case BfOpKind::MEMSET_RANGE:
+      for (int64_t i = 0; i < op.argument; ++i) {
+        set(op.offset + i, 0);
+      }
+      break;
+    case BfOpKind::MEMMOVE_RANGE: {
+      MemmoveRange range = decode_memmove_range(op.argument);
+      for (int64_t i = op.offset; i < op.offset + range.length; ++i) {
+        if (get(i, &value)) {
+          set(i + range.distance, value);
+        } else {
+          forget(i + range.distance);
+        }
+        set(i, 0);
+      }
+      break;
+    }
+    default:
+      forget_all();
+      break;
+    }
+  }
+
+private:
+  // Value of cells_ entries for cells known to be unknown, which matters when
+  // all_zero_ is set.
+  static constexpr int kUnknown = -1;
+
+  int64_t dataptr_ = 0;
+  bool all_zero_ = false;
+
+  // Known (0..255) or kUnknown values of cells, keyed by their distance from
+  // where the data pointer was at the start.
+  std::map<int64_t, int> cells_;
+};
+
+// Adds the offsets of the cells the op at ops[*pc] writes to *writes, given
+// the data pointer is at *offset from the loop's cell, and applies its pointer
+// move to *offset. Advances *pc past the op's operands. Returns false if the
+// op isn't modeled.
+bool collect_op_writes(const std::vector<BfOp>& ops, size_t* pc,
+                       int64_t* offset, std::set<int64_t>* writes) {
+  const BfOp& op = ops[*pc];
+  int64_t cell = *offset + op.offset;
+  switch (op.kind) {
+  case BfOpKind::INC_PTR:
+    *offset += op.argument;
+    break;
+  case BfOpKind::DEC_PTR:
+    *offset -= op.argument;
+    break;
+  case BfOpKind::INC_DATA:
+  case BfOpKind::DEC_DATA:
+  case BfOpKind::LOOP_SET_TO_ZERO:
+  case BfOpKind::SET_DATA:
+  case BfOpKind::READ_STDIN:
+    writes->insert(cell);
+    break;
+  case BfOpKind::WRITE_STDOUT:
+  case BfOpKind::WRITE_STRING:
+    break;
+  case BfOpKind::LOOP_MOVE_DATA:
+    writes->insert(cell);
+    writes->insert(cell + op.argument);
+    break;
+  case BfOpKind::LOOP_MUL_ADD:
+  case BfOpKind::LOOP_CLOSED_FORM:
+  case BfOpKind::DIVMOD:
+    writes->insert(cell);
+    for (int64_t j = 1; j <= op.argument; ++j) {
+      writes->insert(cell + ops[*pc + j].offset);
+    }
+    *pc += op.argument;
+    break;
+  case BfOpKind::MEMSET_RANGE:
+    for (int64_t i = 0; i < op.argument; ++i) {
+      writes->insert(cell + i);
+    }
+    break;
+  case BfOpKind::MEMMOVE_RANGE: {
+    MemmoveRange range = decode_memmove_range(op.argument);
+    for (int64_t i = cell; i < cell + range.length; ++i) {
+      writes->insert(i);
+      writes->insert(i + range.distance);
+    }
+    break;
+  }
+  default:
+    return false;
+  }
+  return true;
+}
+
+// Adds the offsets of the cells nodes write to *writes, starting with the data
+// pointer moved by *offset from the loop's cell and leaving its final
+// displacement in *offset. Returns false if the pointer moves by an amount not
+// known at compile time, or an op isn't modeled.
+bool collect_writes(const std::vector<IrNode*>& nodes, int64_t* offset,
+                    std::set<int64_t>* writes) {
+  for (const IrNode* node : nodes) {
+    if (node->kind == IrNode::Kind::LOOP) {
+      int64_t body_offset = *offset;
+      if (!collect_writes(node->body, &body_offset, writes) ||
+          body_offset != *offset) {
+        return false;
+      }
+      continue;
+    }
+    for (size_t i = 0; i < node->ops.size(); ++i) {
+      if (!collect_op_writes(node->ops, &i, offset, writes)) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+// Rewrites a block given the known cells at its start, and updates *known to
+// the state after it.
+using KnownCellsRewrite = void (*)(std::vector<BfOp>* ops, KnownCells* known,
+                                   std::string* constants);
+
+// Runs the known-cell analysis forward over nodes, starting from *known and
+// leaving the state after them there. Each block is handed to rewrite. A loop
+// whose cell is known to be 0 never runs; it's dropped when drop_dead_loops is
+// set, and skipped otherwise. A loop body starts with nothing known, and after
+// a loop its cell is 0; the other cells keep their values if the loop doesn't
+// move the pointer overall and doesn't write them.
+void propagate_known_cells(IrProgram* program, std::vector<IrNode*>* nodes,
+                           KnownCells* known, KnownCellsRewrite rewrite,
+                           bool drop_dead_loops) {
+  for (IrNode*& node : *nodes) {
+    if (node->kind == IrNode::Kind::BLOCK) {
+      rewrite(&node->ops, known, &program->constants);
+      continue;
+    }
+
+    uint8_t value;
+    if (known->get(0, &value) && value == 0) {
+      if (drop_dead_loops) {
+        node = program->new_block();
+      }
+      continue;
+    }
+
+    KnownCells body_known;
+    propagate_known_cells(program, &node->body, &body_known, rewrite,
+                          drop_dead_loops);
+
+    int64_t offset = 0;
+    std::set<int64_t> writes;
+    if (collect_writes(node->body, &offset, &writes) && offset == 0) {
+      for (int64_t cell : writes) {
+        known->forget(cell);
+      }
+    } else {
+      known->forget_all();
+    }
+    known->set(0, 0);
+  }
+}
+
+// Runs propagate_known_cells over the whole program. Its first node starts on
+// a zero tape if the program runs from the start.
+void propagate_known_cells(IrProgram* program, KnownCellsRewrite rewrite,
+                           bool drop_dead_loops) {
+  KnownCells known =
+      program->at_start ? KnownCells::zero_tape() : KnownCells();
+  propagate_known_cells(program, &program->body, &known, rewrite,
+                        drop_dead_loops);
+}
+
+// Drops the ops of a block that provably do nothing: sets of a cell to the
+// value it already has, and loop idioms whose cell is 0. The block is
+// canonicalized first, so a set merged with earlier updates is seen as such.
+void drop_dead_block_ops(std::vector<BfOp>* ops, KnownCells* known,
+                         std::string* constants) {
+  canonicalize_block(ops);
+  std::vector<BfOp> new_ops;
+  new_ops.reserve(ops->size());
+
+  for (size_t i = 0; i < ops->size(); ++i) {
+    const BfOp& op = (*ops)[i];
+    uint8_t value;
+    bool is_known = known->get(op.offset, &value);
+    size_t first = i;
+    known->apply(*ops, &i, *constants);
+
+    bool dead = false;
+    switch (op.kind) {
+    case BfOpKind::LOOP_SET_TO_ZERO:
+    case BfOpKind::SET_DATA:
+      dead = is_known && value == cell_update_of(op).value;
+      break;
+    case BfOpKind::LOOP_MOVE_PTR:
+    case BfOpKind::LOOP_MOVE_DATA:
+    case BfOpKind::LOOP_MUL_ADD:
+    case BfOpKind::LOOP_CLOSED_FORM:
+    case BfOpKind::DIVMOD:
+      dead = is_known && value == 0;
+      break;
+    default:
+      break;
+    }
+    if (!dead) {
+      new_ops.insert(new_ops.end(), ops->begin() + first,
+                     ops->begin() + i + 1);
+    }
+  }
+  ops->swap(new_ops);
+}
+
+// Drops loops and loop idioms that never run, and sets of cells to values they
+// already have, using what's known about the tape: it starts out zeroed, and a
+// loop leaves its cell at 0.
+void known_zero_pass(IrProgram* program, const Flags&) {
+  propagate_known_cells(program, drop_dead_block_ops, true);
+}
+
+// Replaces each WRITE_STDOUT of a block whose cell has a value known at
+// compile time by WRITE_STRING. Output is collected and only written before
+// the next op that may read input, write an unknown value or abort, so
+// consecutive writes become a single WRITE_STRING. The cell updates stay, since
+// the cells may still be read later.
+void fold_block_constant_output(std::vector<BfOp>* ops, KnownCells* known,
+                                std::string* constants) {
+  std::vector<BfOp> new_ops;
+  new_ops.reserve(ops->size());
+  std::string output;
+  auto flush = [&]() {
+    if (!output.empty()) {
+      new_ops.push_back(BfOp(BfOpKind::WRITE_STRING,
+                             add_constant(constants, output.data(),
+                                          output.size())));
+      output.clear();
+    }
+  };
+
+  for (size_t i = 0; i < ops->size(); ++i) {
+    const BfOp& op = (*ops)[i];
+    uint8_t value;
+    if (op.kind == BfOpKind::WRITE_STDOUT && known->get(op.offset, &value)) {
+      output.append(op.argument, static_cast<char>(value));
+      continue;
+    } else if (op.kind == BfOpKind::WRITE_STRING) {
+      size_t size;
+      const uint8_t* data = get_constant(*constants, op.argument, &size);
+      output.append(reinterpret_cast<const char*>(data), size);
+      continue;
+    }
+
+    switch (op.kind) {
+    case BfOpKind::INC_PTR:
+    case BfOpKind::DEC_PTR:
+    case BfOpKind::INC_DATA:
+    case BfOpKind::DEC_DATA:
+    case BfOpKind::LOOP_SET_TO_ZERO:
+    case BfOpKind::SET_DATA:
+    case BfOpKind::LOOP_MOVE_DATA:
+    case BfOpKind::LOOP_MUL_ADD:
+    case BfOpKind::LOOP_CLOSED_FORM:
+    case BfOpKind::DIVMOD:
+    case BfOpKind::TAPE_SNAPSHOT:
+      break;
+    default:
+      flush();
+      break;
+    }
+    size_t first = i;
+    known->apply(*ops, &i, *constants);
+    new_ops.insert(new_ops.end(), ops->begin() + first, ops->begin() + i + 1);
+  }
+  flush();
+  ops->swap(new_ops);
+}
+
+// Folds writes of cells whose values are known at compile time into
+// WRITE_STRING.
+void constant_output_pass(IrProgram* program, const Flags&) {
+  propagate_known_cells(program, fold_block_constant_output, false);
+}
+
+// Updates *known for the ops of a block, leaving them as they are.
+void apply_block(std::vector<BfOp>* ops, KnownCells* known,
+                 std::string* constants) {
+  for (size_t i = 0; i < ops->size(); ++i) {
+    known->apply(*ops, &i, *constants);
+  }
+}
+
+// Whether the loop with the given body runs at most once: the body keeps the
+// pointer balanced, and the loop's cell is known to be 0 at its end, whatever
+// the tape held on entry (e.g. [>+<[-]] or [-<+>[-]]).
+bool is_if_loop(IrProgram* program, std::vector<IrNode*>* body) {
+  int64_t offset = 0;
+  std::set<int64_t> writes;
+  if (!collect_writes(*body, &offset, &writes) || offset != 0) {
+    return false;
+  }
+  KnownCells known;
+  propagate_known_cells(program, body, &known, apply_block, false);
+  uint8_t value;
+  return known.get(0, &value) && value == 0;
+}
+
+void mark_if_loops(IrProgram* program, std::vector<IrNode*>* nodes) {
+  for (IrNode* node : *nodes) {
+    if (node->kind == IrNode::Kind::LOOP) {
+      mark_if_loops(program, &node->body);
+      if (is_if_loop(program, &node->body)) {
+        node->loop_kind = IrNode::LoopKind::IF;
+      }
+    }
+  }
+}
+
+// Marks the loops whose body always clears their cell, which makes them
+// conditionals: executors skip the test of the back-edge.
+void if_loops_pass(IrProgram* program, const Flags&) {
+  mark_if_loops(program, &program->body);
+}
+
+// Whether the loop with the given body is counted: the body keeps the pointer
+// balanced, and its only writes to the loop's cell are INC_DATA/DEC_DATA ops
+// outside of nested loops, which add up to -1.
+bool is_counted_loop(const std::vector<IrNode*>& body) {
+  int64_t offset = 0;
+  int64_t delta = 0;
+  for (const IrNode* node : body) {
+    std::set<int64_t> writes;
+    if (node->kind == IrNode::Kind::LOOP) {
+      int64_t body_offset = offset;
+      if (!collect_writes(node->body, &body_offset, &writes) ||
+          body_offset != offset || writes.count(0)) {
+        return false;
+      }
+      continue;
+    }
+    for (size_t i = 0; i < node->ops.size(); ++i) {
+      const BfOp& op = node->ops[i];
+      if ((op.kind == BfOpKind::INC_DATA || op.kind == BfOpKind::DEC_DATA) &&
+          offset + op.offset == 0) {
+        delta += op.kind == BfOpKind::INC_DATA ? op.argument : -op.argument;
+      } else if (!collect_op_writes(node->ops, &i, &offset, &writes) ||
+                 writes.count(0)) {
+        return false;
+      }
+    }
+  }
+  return offset == 0 && static_cast<uint8_t>(delta) == 255;
+}
+
+void mark_counted_loops(std::vector<IrNode*>* nodes) {
+  for (IrNode* node : *nodes) {
+    if (node->kind == IrNode::Kind::LOOP) {
+      mark_counted_loops(&node->body);
+      if (node->loop_kind == IrNode::LoopKind::WHILE &&
+          is_counted_loop(node->body)) {
+        node->loop_kind = IrNode::LoopKind::COUNTED;
+      }
+    }
+  }
+}
+
+// Fewest cells a BLOCK_ADD is made for.
+constexpr size_t kMinBlockAddCells = 4;
+
+// Replaces the INC_DATA/DEC_DATA ops of each run of them in a block by
+// BLOCK_ADDs where at least kMinBlockAddCells changed cells fit in a window;
+// the other cells keep their ops. Adds commute, so a run's ops may be
+// reordered.
+void group_block_adds(std::vector<BfOp>* ops, std::string* constants) {
+  std::vector<BfOp> new_ops;
+  new_ops.reserve(ops->size());
+
+  for (size_t i = 0; i < ops->size();) {
+    const BfOp& op = (*ops)[i];
+    if (op.kind != BfOpKind::INC_DATA && op.kind != BfOpKind::DEC_DATA) {
+      new_ops.insert(new_ops.end(), ops->begin() + i,
+                     ops->begin() + i + 1 + num_operands(op));
+      i += 1 + num_operands(op);
+      continue;
+    }
+
+    std::map<int64_t, uint8_t> deltas;
+    for (; i < ops->size() && ((*ops)[i].kind == BfOpKind::INC_DATA ||
+                               (*ops)[i].kind == BfOpKind::DEC_DATA);
+         ++i) {
+      CellUpdate update = cell_update_of((*ops)[i]);
+      deltas[(*ops)[i].offset] += update.value;
+    }
+    for (auto it = deltas.begin(); it != deltas.end();) {
+      if (it->second == 0) {
+        it = deltas.erase(it);
+      } else {
+        ++it;
+      }
+    }
+
+    // Windows are taken greedily from the lowest cell up.
+    std::vector<BfOp> single_ops;
+    for (auto it = deltas.begin(); it != deltas.end();) {
+      int64_t first = it->first;
+      auto end = deltas.lower_bound(first + kMaxBlockAddWidth);
+      if (static_cast<size_t>(std::distance(it, end)) < kMinBlockAddCells ||
+          first > INT32_MAX - static_cast<int64_t>(kMaxBlockAddWidth)) {
+        BfOp single(BfOpKind::INC_DATA, 0);
+        make_cell_update(CellUpdate{false, it->second},
+                         static_cast<int32_t>(first), &single);
+        single_ops.push_back(single);
+        ++it;
+        continue;
+      }
+      int64_t last = std::prev(end)->first;
+      size_t width = last - first < static_cast<int64_t>(kBlockAddWidth)
+                         ? kBlockAddWidth
+                         : kMaxBlockAddWidth;
+      std::string vector(width, '\0');
+      for (; it != end; ++it) {
+        vector[it->first - first] = static_cast<char>(it->second);
+      }
+      new_ops.push_back(BfOp(BfOpKind::BLOCK_ADD,
+                             add_constant(constants, vector.data(), width),
+                             static_cast<int32_t>(first)));
+    }
+    new_ops.insert(new_ops.end(), single_ops.begin(), single_ops.end());
+  }
+  ops->swap(new_ops);
+}
+
+void block_adds_in(IrProgram* program, std::vector<IrNode*>* nodes) {
+  for (IrNode* node : *nodes) {
+    if (node->kind == IrNode::Kind::BLOCK) {
+      group_block_adds(&node->ops, &program->constants);
+    } else {
+      block_adds_in(program, &node->body);
+    }
+  }
+}
+
+// Groups the adds of straight-line code to nearby cells (e.g. +>++>+++>-<<<)
+// into BLOCK_ADDs, which executors run as a vector add. It's the last pass:
+// the others don't model BLOCK_ADD.
+void block_add_pass(IrProgram* program, const Flags&) {
+  block_adds_in(program, &program->body);
+}
+
+// Fewest cells a MEMSET_RANGE or MEMMOVE_RANGE is made for.
+constexpr size_t kMinRangeCells = 4;
+
+// Recognizes [[-]>] and [[-]<], which clear cells up to the next zero one.
+bool optimize_scan_clear_loop(const std::vector<BfOp>& body,
+                              std::vector<BfOp>* new_ops) {
+  if (body.size() != 2 || body[0].kind != BfOpKind::LOOP_SET_TO_ZERO ||
+      body[0].offset != 0 || body[1].argument != 1) {
+    return false;
+  }
+  if (body[1].kind == BfOpKind::INC_PTR) {
+    new_ops->push_back(BfOp(BfOpKind::LOOP_SCAN_CLEAR, 1));
+  } else if (body[1].kind == BfOpKind::DEC_PTR) {
+    new_ops->push_back(BfOp(BfOpKind::LOOP_SCAN_CLEAR, -1));
+  }
+  return !new_ops->empty();
+}
+
+// Appends the cell updates ops[first, last) to *new_ops, with each range of at
+// least kMinRangeCells consecutive cells they clear as a MEMSET_RANGE. Updates
+// of different cells commute, so they may be reordered.
+void group_clears(const std::vector<BfOp>& ops, size_t first, size_t last,
+                  std::vector<BfOp>* new_ops) {
+  std::map<int64_t, CellUpdate> updates;
+  for (size_t i = first; i < last; ++i) {
+    CellUpdate update = cell_update_of(ops[i]);
+    auto it = updates.find(ops[i].offset);
+    if (it != updates.end() && !update.is_set) {
+      update = CellUpdate{it->second.is_set, it->second.value + update.value};
+    }
+    updates[ops[i].offset] = update;
+  }
+  auto clears = [](const CellUpdate& update) {
+    return update.is_set && static_cast<uint8_t>(update.value) == 0;
+  };
+
+  std::vector<BfOp> ranges;
+  std::set<int64_t> cleared;
+  for (auto it = updates.begin(); it != updates.end();) {
+    auto end = it;
+    int64_t next = it->first;
+    while (end != updates.end() && end->first == next && clears(end->second)) {
+      ++end;
+      ++next;
+    }
+    if (next - it->first >= static_cast<int64_t>(kMinRangeCells)) {
+      ranges.push_back(BfOp(BfOpKind::MEMSET_RANGE, next - it->first,
+                            static_cast<int32_t>(it->first)));
+      for (int64_t cell = it->first; cell < next; ++cell) {
+        cleared.insert(cell);
+      }
+    }
+    it = end == it ? std::next(it) : end;
+  }
+  if (ranges.empty()) {
+    new_ops->insert(new_ops->end(), ops.begin() + first, ops.begin() + last);
+    return;
+  }
+
+  new_ops->insert(new_ops->end(), ranges.begin(), ranges.end());
+  for (const auto& update : updates) {
+    BfOp op(BfOpKind::INC_DATA, 0);
+    if (!cleared.count(update.first) &&
+        make_cell_update(update.second, static_cast<int32_t>(update.first),
+                         &op)) {
+      new_ops->push_back(op);
+    }
+  }
+}
+
+// Appends the LOOP_MOVE_DATA ops ops[first, last), which all move by the same
+// distance, to *new_ops; as a MEMMOVE_RANGE when they move a range of at
+// least kMinRangeCells consecutive cells to cells known to be 0 that don't
+// overlap it. Moves into zero cells are then copies, and none of them reads a
+// cell another one writes.
+void group_moves(const std::vector<BfOp>& ops, size_t first, size_t last,
+                 const KnownCells& known, std::vector<BfOp>* new_ops) {
+  int64_t distance = ops[first].argument;
+  std::set<int64_t> sources;
+  for (size_t i = first; i < last; ++i) {
+    sources.insert(ops[i].offset);
+  }
+  int64_t low = *sources.begin();
+  int64_t length = static_cast<int64_t>(sources.size());
+  bool is_range = sources.size() == last - first &&
+                  length >= static_cast<int64_t>(kMinRangeCells) &&
+                  *sources.rbegin() - low + 1 == length &&
+                  std::abs(distance) >= length && distance <= INT32_MAX &&
+                  distance >= INT32_MIN;
+  for (int64_t source : sources) {
+    uint8_t value;
+    is_range = is_range && known.get(source + distance, &value) && value == 0;
+  }
+
+  if (is_range) {
+    MemmoveRange range{static_cast<uint32_t>(length),
+                       static_cast<int32_t>(distance)};
+    new_ops->push_back(BfOp(BfOpKind::MEMMOVE_RANGE,
+                            encode_memmove_range(range),
+                            static_cast<int32_t>(low)));
+  } else {
+    new_ops->insert(new_ops->end(), ops.begin() + first, ops.begin() + last);
+  }
+}
+
+// Rewrites the runs of cell updates and of LOOP_MOVE_DATA ops of a block with
+// group_clears and group_moves.
+void group_block_ranges(std::vector<BfOp>* ops, KnownCells* known,
+                        std::string* constants) {
+  std::vector<BfOp> new_ops;
+  new_ops.reserve(ops->size());
+
+  for (size_t i = 0; i < ops->size();) {
+    const BfOp& op = (*ops)[i];
+    size_t end = i + 1;
+    if (is_cell_update(op.kind)) {
+      while (end < ops->size() && is_cell_update((*ops)[end].kind)) {
+        ++end;
+      }
+      group_clears(*ops, i, end, &new_ops);
+    } else if (op.kind == BfOpKind::LOOP_MOVE_DATA) {
+      while (end < ops->size() &&
+             (*ops)[end].kind == BfOpKind::LOOP_MOVE_DATA &&
+             (*ops)[end].argument == op.argument) {
+        ++end;
+      }
+      group_moves(*ops, i, end, *known, &new_ops);
+    } else {
+      end += num_operands(op);
+      new_ops.insert(new_ops.end(), ops->begin() + i, ops->begin() + end);
+    }
+    for (; i < end; ++i) {
+      known->apply(*ops, &i, *constants);
+    }
+  }
+  ops->swap(new_ops);
+}
+
+// Turns clears of consecutive cells (e.g. [-]>[-]>[-]>[-]) into MEMSET_RANGE,
+// moves of consecutive cells to zero ones into MEMMOVE_RANGE, and [[-]>] and
+// [[-]<] loops into LOOP_SCAN_CLEAR, which executors run with memset/memmove
+// or vector stores.
+void ranges_pass(IrProgram* program, const Flags&) {
+  rewrite_loops(program, &program->body, optimize_scan_clear_loop);
+  normalize(&program->body);
+  propagate_known_cells(program, group_block_ranges, false);
+}
+
+// Marks the loops that run as many times as their cell holds on entry, so
+// executors can count their iterations natively. Linear loops have been
+// rewritten by then; what's left are loops with nested loops or I/O in their
+// bodies.
+void counted_loops_pass(IrProgram* program, const Flags&) {
+  mark_counted_loops(&program->body);
+}
+
+} // namespace
+
+PassManager::PassManager(const Flags& flags) : flags_(flags) {
+  int opt_level = flags.opt_level;
+  if (opt_level >= 1) {
+    passes_.push_back(Pass{"canonicalize", canonicalize_pass});
+  }
+  if (opt_level >= 2) {
+    // Patterns are matched on the loops as written, before simple-loops
+    // rewrites their inner loops.
+    passes_.push_back(Pass{"divmod", divmod_pass});
+  }
+  if (opt_level >= 1) {
+    passes_.push_back(Pass{"simple-loops", simple_loops_pass});
+  }
+  if (opt_level >= 2) {
+    passes_.push_back(Pass{"linear-loops", linear_loops_pass});
+    passes_.push_back(Pass{"closed-form", closed_form_pass});
+    passes_.push_back(Pass{"fold-pointers", fold_pointers_pass});
+  }
+  if (opt_level >= 3) {
+    passes_.push_back(Pass{"partial-eval", partial_eval_pass});
+  }
+  if (opt_level >= 1) {
+    passes_.push_back(Pass{"known-zero", known_zero_pass});
+  }
+  if (opt_level >= 2) {
+    passes_.push_back(Pass{"constant-output", constant_output_pass});
+    passes_.push_back(Pass{"if-loops", if_loops_pass});
+    passes_.push_back(Pass{"counted-loops", counted_loops_pass});
+  }
+  if (opt_level >= 1) {
+    // Loop rewrites and pointer folding leave new runs to merge.
+    passes_.push_back(Pass{"canonicalize", canonicalize_pass});
+  }
+  if (opt_level >= 2) {
+    passes_.push_back(Pass{"ranges", ranges_pass});
+    passes_.push_back(Pass{"block-add", block_add_pass});
+  }
+  stats_.resize(passes_.size());
+}
+
+void PassManager::run(IrProgram* program) {
+  normalize(&program->body);
+  size_t num_ops = count_ops(*program);
+  for (size_t i = 0; i < passes_.size(); ++i) {
+    Timer t;
+    passes_[i].run(program, flags_);
+    normalize(&program->body);
+    stats_[i].time += t.elapsed();
+    stats_[i].ops_before += num_ops;
+    num_ops = count_ops(*program);
+    stats_[i].ops_after += num_ops;
+  }
+}
+
+void PassManager::print_stats(std::ostream& os) const {
+  for (size_t i = 0; i < passes_.size(); ++i) {
+    const PassStats& stats = stats_[i];
+    os << "* pass " << std::setw(16) << std::left << passes_[i].name << " "
+       << stats.time << "s, " << stats.ops_before << " -> " << stats.ops_after
+       << " ops (" << std::showpos
+       << static_cast<int64_t>(stats.ops_after - stats.ops_before)
+       << std::noshowpos << ")\n";
+  }
+}
+
+OpProgram optimize(const std::vector<BfOp>& ops, const Flags& flags) {
+  Timer t;
+  IrProgram program;
+  lift(ops, &program);
+  PassManager pass_manager(flags);
+  pass_manager.run(&program);
+  OpProgram optimized;
+  optimized.ops = lower(program);
+  optimized.constants = std::move(program.constants);
+
+  if (flags.verbose) {
+    pass_manager.print_stats(std::cout);
+    std::cout << "Optimization took: " << t.elapsed() << "s (-O"
+              << flags.opt_level << ", " << ops.size() << " -> "
+              << optimized.ops.size() << " ops, " << optimized.constants.size()
+              << " bytes of constants)\n";
+  }
+  return optimized;
+}
+
+} // namespace optutils
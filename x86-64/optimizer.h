@@ -0,0 +1,138 @@
+// Pass-based optimizer for translated BF programs.
+//
+// Translated ops are lifted into a loop tree: straight-line runs of ops form
+// blocks, and every [...] loop is a node holding its body. Passes rewrite the
+// tree in the order set by the optimization level, and the result is lowered
+// back to a flat OpProgram that the executors run.
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <iosfwd>
+#include <string>
+#include <vector>
+
+#include "optutils.h"
+
+namespace optutils {
+
+struct IrNode {
+  enum class Kind { BLOCK, LOOP };
+
+  explicit IrNode(Kind kind_param) : kind(kind_param) {}
+
+  Kind kind;
+
+  // BLOCK: the ops, in order. Never contains jumps.
+  std::vector<BfOp> ops;
+
+  // LOOP: the nodes of the loop body, in order.
+  std::vector<IrNode*> body;
+
+  // LOOP: how the loop is run. COUNTED loops run as many times as their cell
+  // holds on entry (see COUNTED_LOOP_BEGIN), and IF loops at most once (see
+  // IF_BEGIN).
+  enum class LoopKind { WHILE, COUNTED, IF };
+  LoopKind loop_kind = LoopKind::WHILE;
+};
+
+// A program in loop-tree form. Nodes are allocated from an arena owned by the
+// program and all die with it, so passes can simply drop nodes they replace.
+class IrProgram {
+public:
+  IrProgram() = default;
+
+  IrNode* new_block(std::vector<BfOp> ops = std::vector<BfOp>());
+  IrNode* new_loop();
+
+  // The top-level nodes, in order.
+  std::vector<IrNode*> body;
+
+  // Constant pool of the ops, as in OpProgram.
+  std::string constants;
+
+  // Whether the program runs from the very start: on a zeroed tape, with the
+  // pointer at its first cell. False for streaming segments after the first.
+  bool at_start = true;
+
+private:
+  IrProgram(const IrProgram&) = delete;
+  IrProgram& operator=(const IrProgram&) = delete;
+
+  std::deque<IrNode> arena_;
+};
+
+// Builds the loop tree of ops into *program. Brackets in ops must match; their
+// jump arguments are ignored.
+void lift(const std::vector<BfOp>& ops, IrProgram* program);
+
+// Flattens program into ops, emitting a JUMP_IF_DATA_ZERO/NOT_ZERO pair for
+// each loop (COUNTED_LOOP_BEGIN/END for counted ones, IF_BEGIN/END for IF
+// ones). base is the index of the first op in the whole op stream, which jump
+// arguments are relative to.
+std::vector<BfOp> lower(const IrProgram& program, size_t base = 0);
+
+// Returns the number of ops lower() would produce for program.
+size_t count_ops(const IrProgram& program);
+
+// Merges adjacent blocks and drops empty ones, in nodes and all loops nested in
+// them. The pass manager does this after every pass.
+void normalize(std::vector<IrNode*>* nodes);
+
+struct Pass {
+  const char* name;
+  void (*run)(IrProgram* program, const Flags& flags);
+};
+
+// Runs the pass pipeline of an optimization level. -O0 runs no passes; -On
+// runs the passes of levels up to n, in this order:
+//
+//   -O1  canonicalize: merge runs of +- and <>, fold cell sets (SET_DATA)
+//   -O2  divmod: division loops (divmod algorithms, decimal carries) to DIVMOD
+//   -O1  simple-loops: [-], [>] and [-<+>] idioms
+//   -O2  linear-loops: loops adding multiples of their cell to others to
+//        LOOP_MUL_ADD
+//   -O2  closed-form: loops over linear loops (e.g. multiplication) to
+//        LOOP_CLOSED_FORM
+//   -O2  fold-pointers: pointer moves into the offsets of the ops after them
+//   -O3  partial-eval: run the program up to its first input (or
+//        flags.peval_steps ops) and replace that part by a TAPE_SNAPSHOT and
+//        WRITE_STRING of the result
+//   -O1  known-zero: drop loops that never run and redundant cell sets
+//   -O2  constant-output: writes of cells with known values to WRITE_STRING
+//   -O2  if-loops: loops that run at most once to IF_BEGIN/IF_END
+//   -O2  counted-loops: loops that run a fixed number of times to
+//        COUNTED_LOOP_BEGIN/END
+//   -O1  canonicalize
+//   -O2  ranges: clears and moves of consecutive cells, and [[-]>], to
+//        MEMSET_RANGE, MEMMOVE_RANGE and LOOP_SCAN_CLEAR
+//   -O2  block-add: adds to nearby cells to vector adds (BLOCK_ADD)
+//
+// Time spent and the change in op count are kept per pass, summed over all the
+// programs run.
+class PassManager {
+public:
+  explicit PassManager(const Flags& flags);
+
+  void run(IrProgram* program);
+
+  // Prints a line per pass with its time and op counts.
+  void print_stats(std::ostream& os) const;
+
+private:
+  struct PassStats {
+    double time = 0;
+    size_t ops_before = 0;
+    size_t ops_after = 0;
+  };
+
+  Flags flags_;
+  std::vector<Pass> passes_;
+  std::vector<PassStats> stats_;
+};
+
+// Lifts ops, runs the -O<flags.opt_level> pipeline on them and lowers the
+// result. In verbose mode prints the pass statistics.
+OpProgram optimize(const std::vector<BfOp>& ops, const Flags& flags);
+
+} // namespace optutils
@@ -6,7 +6,6 @@
 // Eli Bendersky [http://eli.thegreenplace.net]
 // This code is in the public domain.
 #include <cstdint>
-#include <fstream>
 #include <iomanip>
 #include <iostream>
 #include <memory>
@@ -14,6 +13,7 @@
 #include <unordered_map>
 #include <vector>
 
+#include "bfio.h"
 #include "parser.h"
 #include "utils.h"
 
@@ -101,10 +101,10 @@ void optinterp(const Program& p, bool verbose) {
       memory[dataptr]--;
       break;
     case '.':
-      std::cout.put(memory[dataptr]);
+      BfIO::put(memory[dataptr]);
       break;
     case ',':
-      memory[dataptr] = std::cin.get();
+      memory[dataptr] = BfIO::get();
       break;
     case '[':
       if (memory[dataptr] == 0) {
@@ -123,6 +123,7 @@ void optinterp(const Program& p, bool verbose) {
     // be advanced by one (jump or no jump).
     pc++;
   }
+  BfIO::flush();
 
   // Done running the program. Dump state if verbose.
   if (verbose) {
@@ -163,11 +164,13 @@ int main(int argc, const char** argv) {
   parse_command_line(argc, argv, &bf_file_path, &verbose);
 
   Timer t1;
-  std::ifstream file(bf_file_path);
-  if (!file) {
-    DIE << "unable to open file " << bf_file_path;
+  Program program = parse_from_file(bf_file_path);
+
+  if (verbose) {
+    double parse_time = t1.elapsed();
+    std::cout << "Parsing took: " << parse_time << "s ("
+              << program.source_size / parse_time / 1e6 << " MB/s)\n";
   }
-  Program program = parse_from_stream(file);
 
   if (verbose) {
     std::cout << "[>] Running optinterp:\n";
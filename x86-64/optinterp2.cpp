@@ -9,13 +9,14 @@
 // Eli Bendersky [http://eli.thegreenplace.net]
 // This code is in the public domain.
 #include <algorithm>
-#include <fstream>
 #include <iomanip>
 #include <iostream>
 #include <locale>
 #include <stack>
 #include <unordered_map>
+#include <vector>
 
+#include "bfio.h"
 #include "parser.h"
 #include "utils.h"
 
@@ -203,12 +204,12 @@ void optinterp2(const Program& p, bool verbose) {
       break;
     case BfOpKind::READ_STDIN:
       for (size_t i = 0; i < op.argument; ++i) {
-        memory[dataptr] = std::cin.get();
+        memory[dataptr] = BfIO::get();
       }
       break;
     case BfOpKind::WRITE_STDOUT:
       for (size_t i = 0; i < op.argument; ++i) {
-        std::cout.put(memory[dataptr]);
+        BfIO::put(memory[dataptr]);
       }
       break;
     case BfOpKind::JUMP_IF_DATA_ZERO:
@@ -240,6 +241,7 @@ void optinterp2(const Program& p, bool verbose) {
 
     pc++;
   }
+  BfIO::flush();
 
   if (verbose) {
     std::cout << "* pc=" << pc << "\n";
@@ -294,11 +296,13 @@ int main(int argc, const char** argv) {
   parse_command_line(argc, argv, &bf_file_path, &verbose);
 
   Timer t1;
-  std::ifstream file(bf_file_path);
-  if (!file) {
-    DIE << "unable to open file " << bf_file_path;
+  Program program = parse_from_file(bf_file_path);
+
+  if (verbose) {
+    double parse_time = t1.elapsed();
+    std::cout << "Parsing took: " << parse_time << "s ("
+              << program.source_size / parse_time / 1e6 << " MB/s)\n";
   }
-  Program program = parse_from_stream(file);
 
   if (verbose) {
     std::cout << "[>] Running optinterp2:\n";
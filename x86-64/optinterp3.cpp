@@ -3,10 +3,11 @@
 // Eli Bendersky [http://eli.thegreenplace.net]
 // This code is in the public domain.
 #include <algorithm>
-#include <fstream>
+#include <cstring>
 #include <iostream>
 #include <stack>
 
+#include "bfio.h"
 #include "optutils.h"
 #include "parser.h"
 #include "utils.h"
@@ -15,22 +16,18 @@ using namespace optutils;
 
 constexpr int MEMORY_SIZE = 30000;
 
-void optinterp3(const Program& p, bool verbose) {
+// Runs code, the ops of program as PackedOps or, when they don't fit, as BfOps
+// with relative jumps.
+template <typename Op>
+void run_ops(const OpProgram& program, const std::vector<Op>& code) {
+  const std::vector<BfOp>& ops = program.ops;
   // Initialize state.
-  std::vector<uint8_t> memory(MEMORY_SIZE, 0);
+  // BLOCK_ADD windows may run past the last cell; see kMaxBlockAddWidth.
+  std::vector<uint8_t> memory(MEMORY_SIZE + kMaxBlockAddWidth, 0);
   size_t dataptr = 0;
 
-  Timer t1;
-  const std::vector<BfOp> ops = translate_program(p);
-
-  if (verbose) {
-    std::cout << "* translation [elapsed " << t1.elapsed() << "s]:\n";
-
-    for (size_t i = 0; i < ops.size(); ++i) {
-      std::cout << " [" << i << "] " << BfOpKind_name(ops[i].kind) << " "
-                << ops[i].argument << "\n";
-    }
-  }
+  // Iterations left in each counted loop being run, innermost last.
+  std::vector<uint32_t> counters;
 
   // Execute the translated ops in a for loop; pc always gets incremented by the
   // end of each iteration, though some ops may also move it in a less orderly
@@ -39,8 +36,8 @@ void optinterp3(const Program& p, bool verbose) {
   // const) but it helps gcc 4.8 generate faster code.
   size_t ops_size = ops.size();
   for (size_t pc = 0; pc < ops_size; ++pc) {
-    BfOp op = ops[pc];
-    switch (op.kind) {
+    Op op = code[pc];
+    switch (static_cast<BfOpKind>(op.kind)) {
     case BfOpKind::INC_PTR:
       dataptr += op.argument;
       break;
@@ -48,47 +45,138 @@ void optinterp3(const Program& p, bool verbose) {
       dataptr -= op.argument;
       break;
     case BfOpKind::INC_DATA:
-      memory[dataptr] += op.argument;
+      memory[dataptr + op.offset] += op.argument;
       break;
     case BfOpKind::DEC_DATA:
-      memory[dataptr] -= op.argument;
+      memory[dataptr + op.offset] -= op.argument;
       break;
     case BfOpKind::READ_STDIN:
       for (int i = 0; i < op.argument; ++i) {
-        memory[dataptr] = std::cin.get();
+        memory[dataptr + op.offset] = BfIO::get();
       }
       break;
     case BfOpKind::WRITE_STDOUT:
       for (int i = 0; i < op.argument; ++i) {
-        std::cout.put(memory[dataptr]);
+        BfIO::put(memory[dataptr + op.offset]);
       }
       break;
     case BfOpKind::LOOP_SET_TO_ZERO:
-      memory[dataptr] = 0;
+      memory[dataptr + op.offset] = 0;
       break;
+    case BfOpKind::SET_DATA:
+      memory[dataptr + op.offset] = op.argument;
+      break;
+    case BfOpKind::TAPE_SNAPSHOT: {
+      size_t size;
+      const uint8_t* data =
+          get_constant(program.constants, op.argument, &size);
+      memcpy(&memory[dataptr + op.offset], data, size);
+      break;
+    }
+    case BfOpKind::WRITE_STRING: {
+      size_t size;
+      const uint8_t* data =
+          get_constant(program.constants, op.argument, &size);
+      BfIO::write(data, size);
+      break;
+    }
     case BfOpKind::LOOP_MOVE_PTR:
-      while (memory[dataptr]) {
-        dataptr += op.argument;
+      if (memory[dataptr]) {
+        dataptr = scan_for_zero(memory.data(), MEMORY_SIZE, dataptr,
+                                op.argument);
       }
       break;
     case BfOpKind::LOOP_MOVE_DATA: {
-      if (memory[dataptr]) {
-        int64_t move_to_ptr = static_cast<int64_t>(dataptr) + op.argument;
-        memory[move_to_ptr] += memory[dataptr];
-        memory[dataptr] = 0;
+      size_t from_ptr = dataptr + op.offset;
+      if (memory[from_ptr]) {
+        int64_t move_to_ptr = static_cast<int64_t>(from_ptr) + op.argument;
+        memory[move_to_ptr] += memory[from_ptr];
+        memory[from_ptr] = 0;
+      }
+      break;
+    }
+    case BfOpKind::LOOP_MUL_ADD: {
+      size_t count_ptr = dataptr + op.offset;
+      uint8_t count = memory[count_ptr];
+      if (count) {
+        for (int64_t i = 1; i <= op.argument; ++i) {
+          const Op& operand = code[pc + i];
+          memory[count_ptr + operand.offset] += count * operand.argument;
+        }
+        memory[count_ptr] = 0;
       }
+      pc += op.argument;
       break;
     }
+    case BfOpKind::MUL_ADD_OPERAND:
+      DIE << "MUL_ADD_OPERAND outside of LOOP_MUL_ADD on pc=" << pc;
+      break;
+    case BfOpKind::LOOP_CLOSED_FORM:
+      run_closed_form_loop(&ops[pc], &memory[dataptr + op.offset]);
+      pc += op.argument;
+      break;
+    case BfOpKind::CLOSED_FORM_TERM:
+      DIE << "CLOSED_FORM_TERM outside of LOOP_CLOSED_FORM on pc=" << pc;
+      break;
+    case BfOpKind::DIVMOD:
+      run_divmod(&ops[pc], &memory[dataptr + op.offset]);
+      pc += op.argument;
+      break;
+    case BfOpKind::DIVMOD_OPERAND:
+      DIE << "DIVMOD_OPERAND outside of DIVMOD on pc=" << pc;
+      break;
     case BfOpKind::JUMP_IF_DATA_ZERO:
       if (memory[dataptr] == 0) {
-        pc = op.argument;
+        pc += op.argument;
       }
       break;
     case BfOpKind::JUMP_IF_DATA_NOT_ZERO:
       if (memory[dataptr] != 0) {
-        pc = op.argument;
+        pc += op.argument;
+      }
+      break;
+    case BfOpKind::COUNTED_LOOP_BEGIN:
+      if (memory[dataptr] == 0) {
+        pc += op.argument;
+      } else {
+        counters.push_back(memory[dataptr]);
       }
       break;
+    case BfOpKind::COUNTED_LOOP_END:
+      if (--counters.back() != 0) {
+        pc += op.argument;
+      } else {
+        counters.pop_back();
+      }
+      break;
+    case BfOpKind::IF_BEGIN:
+      if (memory[dataptr] == 0) {
+        pc += op.argument;
+      }
+      break;
+    case BfOpKind::IF_END:
+      break;
+    case BfOpKind::BLOCK_ADD: {
+      size_t size;
+      const uint8_t* deltas =
+          get_constant(program.constants, op.argument, &size);
+      run_block_add(deltas, size, &memory[dataptr + op.offset]);
+      break;
+    }
+    case BfOpKind::MEMSET_RANGE:
+      memset(&memory[dataptr + op.offset], 0, op.argument);
+      break;
+    case BfOpKind::MEMMOVE_RANGE: {
+      MemmoveRange range = decode_memmove_range(ops[pc].argument);
+      uint8_t* source = &memory[dataptr + op.offset];
+      memmove(source + range.distance, source, range.length);
+      memset(source, 0, range.length);
+      break;
+    }
+    case BfOpKind::LOOP_SCAN_CLEAR:
+      dataptr = scan_and_clear(memory.data(), MEMORY_SIZE, dataptr,
+                               op.argument);
+      break;
     case BfOpKind::INVALID_OP:
       DIE << "INVALID_OP encountered on pc=" << pc;
       break;
@@ -96,26 +184,41 @@ void optinterp3(const Program& p, bool verbose) {
   }
 }
 
+void optinterp3(const OpProgram& program, bool verbose) {
+  const std::vector<BfOp>& ops = program.ops;
+  if (verbose) {
+    std::cout << "* translation:\n";
+
+    for (size_t i = 0; i < ops.size(); ++i) {
+      std::cout << " [" << i << "] " << BfOp_to_string(ops[i]) << "\n";
+    }
+  }
+
+  // Packed ops keep more of a large program in cache.
+  std::vector<PackedOp> packed;
+  if (pack_ops(ops, &packed)) {
+    run_ops(program, packed);
+  } else {
+    run_ops(program, relative_jump_ops(ops));
+  }
+  BfIO::flush();
+}
+
 int main(int argc, const char** argv) {
-  bool verbose = false;
+  Flags flags;
   std::string bf_file_path;
-  parse_command_line(argc, argv, &bf_file_path, &verbose);
+  parse_command_line(argc, argv, &bf_file_path, &flags);
 
-  Timer t1;
-  std::ifstream file(bf_file_path);
-  if (!file) {
-    DIE << "unable to open file " << bf_file_path;
-  }
-  Program program = parse_from_stream(file);
+  const OpProgram program = translate_file(bf_file_path, flags);
 
-  if (verbose) {
+  if (flags.verbose) {
     std::cout << "[>] Running optinterp3:\n";
   }
 
   Timer t2;
-  optinterp3(program, verbose);
+  optinterp3(program, flags.verbose);
 
-  if (verbose) {
+  if (flags.verbose) {
     std::cout << "[<] Done (elapsed: " << t2.elapsed() << "s)\n";
   }
 
@@ -0,0 +1,444 @@
+// A tail-call threaded interpreter for BF.
+//
+// Every op kind has a handler function of its own that ends by tail-calling
+// the handler of the next op. The op pointer and the pointer to the current
+// cell are passed along in argument registers, so they stay in registers
+// across dispatch instead of living in the frame of one big function as in
+// optdt.
+#include <cstring>
+#include <iostream>
+#include <stack>
+
+#include "bfio.h"
+#include "optutils.h"
+#include "parser.h"
+#include "utils.h"
+
+using namespace optutils;
+
+constexpr int MEMORY_SIZE = 30000;
+
+// The handlers have to tail-call each other, or the stack grows by a frame per
+// op run. musttail guarantees that where it's available (clang, gcc 15); older
+// compilers only do it as sibling call optimization, which needs optimization
+// to be enabled.
+#if defined(__has_attribute)
+#if __has_attribute(musttail)
+#define MUSTTAIL __attribute__((musttail))
+#endif
+#endif
+
+#ifndef MUSTTAIL
+#ifndef __OPTIMIZE__
+#error "opttail needs musttail or optimization for its tail calls"
+#endif
+#define MUSTTAIL
+#endif
+
+template <typename Op>
+struct State {
+  const OpProgram* program;
+
+  // The ops of program; code_end points to the INVALID_OP that ends them.
+  const Op* code;
+  const Op* code_end;
+
+  uint8_t* memory;
+
+  // Iterations left in each counted loop being run, innermost last.
+  std::vector<uint32_t> counters;
+};
+
+// Handlers of ops that need locals whose address is taken, which would keep
+// their callers from tail-calling.
+__attribute__((noinline)) void copy_constant(const OpProgram& program,
+                                             int64_t index, uint8_t* dest) {
+  size_t size;
+  const uint8_t* data = get_constant(program.constants, index, &size);
+  memcpy(dest, data, size);
+}
+
+__attribute__((noinline)) void write_constant(const OpProgram& program,
+                                              int64_t index) {
+  size_t size;
+  const uint8_t* data = get_constant(program.constants, index, &size);
+  BfIO::write(data, size);
+}
+
+__attribute__((noinline)) void add_block(const OpProgram& program,
+                                         int64_t index, uint8_t* cells) {
+  size_t size;
+  const uint8_t* deltas = get_constant(program.constants, index, &size);
+  run_block_add(deltas, size, cells);
+}
+
+// Handlers for ops of type Op: PackedOps or, when the program's ops don't fit
+// in those, BfOps with relative jumps.
+template <typename Op>
+struct Handlers {
+  typedef void (*Handler)(const Op* pc, uint8_t* cell, State<Op>* state);
+
+  // Indexed by BfOpKind, then by kNumOpKinds + the index of a superinstruction
+  // in kSuperinstructions. Only packed ops use superinstructions.
+  static const Handler kHandlers[];
+
+  // Runs the program from pc on.
+  static void run(const Op* pc, uint8_t* cell, State<Op>* state) {
+    kHandlers[static_cast<int>(pc->kind)](pc, cell, state);
+  }
+
+// Tail-calls the handler of the op at next_pc.
+#define DISPATCH(next_pc, next_cell)                                           \
+  do {                                                                         \
+    const Op* dispatch_pc = (next_pc);                                         \
+    MUSTTAIL return kHandlers[static_cast<int>(dispatch_pc->kind)](            \
+        dispatch_pc, (next_cell), state);                                      \
+  } while (0)
+
+  static const BfOp* op_of(const Op* pc, State<Op>* state) {
+    return &state->program->ops[pc - state->code];
+  }
+
+  static void inc_ptr(const Op* pc, uint8_t* cell, State<Op>* state) {
+    DISPATCH(pc + 1, cell + pc->argument);
+  }
+
+  static void dec_ptr(const Op* pc, uint8_t* cell, State<Op>* state) {
+    DISPATCH(pc + 1, cell - pc->argument);
+  }
+
+  static void inc_data(const Op* pc, uint8_t* cell, State<Op>* state) {
+    cell[pc->offset] += pc->argument;
+    DISPATCH(pc + 1, cell);
+  }
+
+  static void dec_data(const Op* pc, uint8_t* cell, State<Op>* state) {
+    cell[pc->offset] -= pc->argument;
+    DISPATCH(pc + 1, cell);
+  }
+
+  static void read_stdin(const Op* pc, uint8_t* cell, State<Op>* state) {
+    for (int i = 0; i < pc->argument; ++i) {
+      cell[pc->offset] = BfIO::get();
+    }
+    DISPATCH(pc + 1, cell);
+  }
+
+  static void write_stdout(const Op* pc, uint8_t* cell, State<Op>* state) {
+    for (int i = 0; i < pc->argument; ++i) {
+      BfIO::put(cell[pc->offset]);
+    }
+    DISPATCH(pc + 1, cell);
+  }
+
+  static void loop_set_to_zero(const Op* pc, uint8_t* cell,
+                               State<Op>* state) {
+    cell[pc->offset] = 0;
+    DISPATCH(pc + 1, cell);
+  }
+
+  static void loop_move_ptr(const Op* pc, uint8_t* cell, State<Op>* state) {
+    if (*cell) {
+      cell = state->memory + scan_for_zero(state->memory, MEMORY_SIZE,
+                                           cell - state->memory, pc->argument);
+    }
+    DISPATCH(pc + 1, cell);
+  }
+
+  static void loop_move_data(const Op* pc, uint8_t* cell, State<Op>* state) {
+    uint8_t* from = cell + pc->offset;
+    if (*from) {
+      from[pc->argument] += *from;
+      *from = 0;
+    }
+    DISPATCH(pc + 1, cell);
+  }
+
+  static void jump_if_data_zero(const Op* pc, uint8_t* cell,
+                                State<Op>* state) {
+    DISPATCH(*cell == 0 ? pc + pc->argument + 1 : pc + 1, cell);
+  }
+
+  static void jump_if_data_not_zero(const Op* pc, uint8_t* cell,
+                                    State<Op>* state) {
+    DISPATCH(*cell != 0 ? pc + pc->argument + 1 : pc + 1, cell);
+  }
+
+  static void loop_mul_add(const Op* pc, uint8_t* cell, State<Op>* state) {
+    uint8_t* count_cell = cell + pc->offset;
+    uint8_t count = *count_cell;
+    if (count) {
+      for (const Op* operand = pc + 1; operand <= pc + pc->argument;
+           ++operand) {
+        count_cell[operand->offset] += count * operand->argument;
+      }
+      *count_cell = 0;
+    }
+    DISPATCH(pc + pc->argument + 1, cell);
+  }
+
+  static void set_data(const Op* pc, uint8_t* cell, State<Op>* state) {
+    cell[pc->offset] = pc->argument;
+    DISPATCH(pc + 1, cell);
+  }
+
+  static void tape_snapshot(const Op* pc, uint8_t* cell, State<Op>* state) {
+    copy_constant(*state->program, pc->argument, cell + pc->offset);
+    DISPATCH(pc + 1, cell);
+  }
+
+  static void write_string(const Op* pc, uint8_t* cell, State<Op>* state) {
+    write_constant(*state->program, pc->argument);
+    DISPATCH(pc + 1, cell);
+  }
+
+  static void counted_loop_begin(const Op* pc, uint8_t* cell,
+                                 State<Op>* state) {
+    if (*cell == 0) {
+      DISPATCH(pc + pc->argument + 1, cell);
+    }
+    state->counters.push_back(*cell);
+    DISPATCH(pc + 1, cell);
+  }
+
+  static void counted_loop_end(const Op* pc, uint8_t* cell,
+                               State<Op>* state) {
+    if (--state->counters.back() != 0) {
+      DISPATCH(pc + pc->argument + 1, cell);
+    }
+    state->counters.pop_back();
+    DISPATCH(pc + 1, cell);
+  }
+
+  static void loop_closed_form(const Op* pc, uint8_t* cell,
+                               State<Op>* state) {
+    run_closed_form_loop(op_of(pc, state), cell + pc->offset);
+    DISPATCH(pc + pc->argument + 1, cell);
+  }
+
+  static void divmod(const Op* pc, uint8_t* cell, State<Op>* state) {
+    run_divmod(op_of(pc, state), cell + pc->offset);
+    DISPATCH(pc + pc->argument + 1, cell);
+  }
+
+  static void if_begin(const Op* pc, uint8_t* cell, State<Op>* state) {
+    DISPATCH(*cell == 0 ? pc + pc->argument + 1 : pc + 1, cell);
+  }
+
+  static void if_end(const Op* pc, uint8_t* cell, State<Op>* state) {
+    DISPATCH(pc + 1, cell);
+  }
+
+  static void block_add(const Op* pc, uint8_t* cell, State<Op>* state) {
+    add_block(*state->program, pc->argument, cell + pc->offset);
+    DISPATCH(pc + 1, cell);
+  }
+
+  static void memset_range(const Op* pc, uint8_t* cell, State<Op>* state) {
+    memset(cell + pc->offset, 0, pc->argument);
+    DISPATCH(pc + 1, cell);
+  }
+
+  static void memmove_range(const Op* pc, uint8_t* cell, State<Op>* state) {
+    MemmoveRange range = decode_memmove_range(op_of(pc, state)->argument);
+    uint8_t* source = cell + pc->offset;
+    memmove(source + range.distance, source, range.length);
+    memset(source, 0, range.length);
+    DISPATCH(pc + 1, cell);
+  }
+
+  static void loop_scan_clear(const Op* pc, uint8_t* cell, State<Op>* state) {
+    cell = state->memory + scan_and_clear(state->memory, MEMORY_SIZE,
+                                          cell - state->memory, pc->argument);
+    DISPATCH(pc + 1, cell);
+  }
+
+  static void invalid_op(const Op* pc, uint8_t*, State<Op>* state) {
+    // The ops end with one.
+    if (pc == state->code_end) {
+      return;
+    }
+    DIE << "INVALID_OP encountered on pc=" << pc - state->code;
+  }
+
+  // Operands are run by the op they follow.
+  static void stray_operand(const Op* pc, uint8_t*, State<Op>* state) {
+    DIE << BfOpKind_name(op_of(pc, state)->kind) << " outside of its op on pc="
+        << pc - state->code;
+  }
+
+  static void move_data_dec_ptr_jump_if_not_zero(const Op* pc, uint8_t* cell,
+                                                State<Op>* state) {
+    uint8_t* from = cell + pc->offset;
+    if (*from) {
+      from[pc->argument] += *from;
+      *from = 0;
+    }
+    cell -= pc[1].argument;
+    pc += 2;
+    DISPATCH(*cell != 0 ? pc + pc->argument + 1 : pc + 1, cell);
+  }
+
+  static void inc_data_inc_ptr_jump_if_not_zero(const Op* pc, uint8_t* cell,
+                                                State<Op>* state) {
+    cell[pc->offset] += pc->argument;
+    cell += pc[1].argument;
+    pc += 2;
+    DISPATCH(*cell != 0 ? pc + pc->argument + 1 : pc + 1, cell);
+  }
+
+  static void move_data_inc_ptr_jump_if_not_zero(const Op* pc, uint8_t* cell,
+                                                State<Op>* state) {
+    uint8_t* from = cell + pc->offset;
+    if (*from) {
+      from[pc->argument] += *from;
+      *from = 0;
+    }
+    cell += pc[1].argument;
+    pc += 2;
+    DISPATCH(*cell != 0 ? pc + pc->argument + 1 : pc + 1, cell);
+  }
+
+  static void inc_ptr_jump_if_not_zero(const Op* pc, uint8_t* cell,
+                                       State<Op>* state) {
+    cell += pc->argument;
+    ++pc;
+    DISPATCH(*cell != 0 ? pc + pc->argument + 1 : pc + 1, cell);
+  }
+
+  static void dec_ptr_jump_if_not_zero(const Op* pc, uint8_t* cell,
+                                       State<Op>* state) {
+    cell -= pc->argument;
+    ++pc;
+    DISPATCH(*cell != 0 ? pc + pc->argument + 1 : pc + 1, cell);
+  }
+
+  static void dec_data_move_data(const Op* pc, uint8_t* cell,
+                                 State<Op>* state) {
+    cell[pc->offset] -= pc->argument;
+    uint8_t* from = cell + pc[1].offset;
+    if (*from) {
+      from[pc[1].argument] += *from;
+      *from = 0;
+    }
+    DISPATCH(pc + 2, cell);
+  }
+
+  static void if_begin_dec_data(const Op* pc, uint8_t* cell,
+                                State<Op>* state) {
+    if (*cell == 0) {
+      DISPATCH(pc + pc->argument + 1, cell);
+    }
+    cell[pc[1].offset] -= pc[1].argument;
+    DISPATCH(pc + 2, cell);
+  }
+
+  static void dec_data_inc_data(const Op* pc, uint8_t* cell,
+                                State<Op>* state) {
+    cell[pc->offset] -= pc->argument;
+    cell[pc[1].offset] += pc[1].argument;
+    DISPATCH(pc + 2, cell);
+  }
+
+  static void if_end_if_end(const Op* pc, uint8_t* cell, State<Op>* state) {
+    DISPATCH(pc + 2, cell);
+  }
+
+#undef DISPATCH
+};
+
+template <typename Op>
+const typename Handlers<Op>::Handler Handlers<Op>::kHandlers[] = {
+  &Handlers<Op>::invalid_op,
+  &Handlers<Op>::inc_ptr,
+  &Handlers<Op>::dec_ptr,
+  &Handlers<Op>::inc_data,
+  &Handlers<Op>::dec_data,
+  &Handlers<Op>::read_stdin,
+  &Handlers<Op>::write_stdout,
+  &Handlers<Op>::loop_set_to_zero,
+  &Handlers<Op>::loop_move_ptr,
+  &Handlers<Op>::loop_move_data,
+  &Handlers<Op>::jump_if_data_zero,
+  &Handlers<Op>::jump_if_data_not_zero,
+  &Handlers<Op>::loop_mul_add,
+  &Handlers<Op>::stray_operand,
+  &Handlers<Op>::set_data,
+  &Handlers<Op>::tape_snapshot,
+  &Handlers<Op>::write_string,
+  &Handlers<Op>::counted_loop_begin,
+  &Handlers<Op>::counted_loop_end,
+  &Handlers<Op>::loop_closed_form,
+  &Handlers<Op>::stray_operand,
+  &Handlers<Op>::divmod,
+  &Handlers<Op>::stray_operand,
+  &Handlers<Op>::if_begin,
+  &Handlers<Op>::if_end,
+  &Handlers<Op>::block_add,
+  &Handlers<Op>::memset_range,
+  &Handlers<Op>::memmove_range,
+  &Handlers<Op>::loop_scan_clear,
+#define SUPERINSTRUCTION_HANDLER(label, handler, ...) &Handlers<Op>::handler,
+  BF_SUPERINSTRUCTIONS(SUPERINSTRUCTION_HANDLER)
+#undef SUPERINSTRUCTION_HANDLER
+};
+
+static_assert(sizeof(Handlers<PackedOp>::kHandlers) /
+                      sizeof(Handlers<PackedOp>::kHandlers[0]) ==
+                  kNumOpKinds + kNumSuperinstructions,
+              "kHandlers should have a handler for every op kind and "
+              "superinstruction");
+
+template <typename Op>
+void run_ops(const OpProgram& program, const std::vector<Op>& code) {
+  // BLOCK_ADD windows may run past the last cell; see kMaxBlockAddWidth.
+  std::vector<uint8_t> memory(MEMORY_SIZE + kMaxBlockAddWidth, 0);
+
+  State<Op> state;
+  state.program = &program;
+  state.code = code.data();
+  state.code_end = &code.back();
+  state.memory = memory.data();
+  Handlers<Op>::run(code.data(), memory.data(), &state);
+}
+
+void opttail(const OpProgram& program, bool verbose) {
+  const std::vector<BfOp>& ops = program.ops;
+  if (verbose) {
+    std::cout << "* translation:\n";
+
+    for (size_t i = 0; i < ops.size(); ++i) {
+      std::cout << " [" << i << "] " << BfOp_to_string(ops[i]) << "\n";
+    }
+  }
+
+  std::vector<PackedOp> packed;
+  if (pack_ops(ops, &packed)) {
+    fuse_superinstructions(&packed);
+    run_ops(program, packed);
+  } else {
+    run_ops(program, relative_jump_ops(ops));
+  }
+  BfIO::flush();
+}
+
+int main(int argc, const char** argv) {
+  Flags flags;
+  std::string bf_file_path;
+  parse_command_line(argc, argv, &bf_file_path, &flags);
+
+  const OpProgram program = translate_file(bf_file_path, flags);
+
+  if (flags.verbose) {
+    std::cout << "[>] Running opttail:\n";
+  }
+
+  Timer t2;
+  opttail(program, flags.verbose);
+
+  if (flags.verbose) {
+    std::cout << "[<] Done (elapsed: " << t2.elapsed() << "s)\n";
+  }
+
+  return 0;
+}
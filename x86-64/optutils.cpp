@@ -1,9 +1,22 @@
 #include "optutils.h"
 
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <sstream>
 #include <stack>
+#include <thread>
 
+#include "bfo.h"
+#include "optimizer.h"
 #include "utils.h"
 
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
 namespace optutils {
 
 const char* BfOpKind_name(BfOpKind kind) {
@@ -30,151 +43,729 @@ const char* BfOpKind_name(BfOpKind kind) {
     return "JUMP_IF_DATA_ZERO";
   case BfOpKind::JUMP_IF_DATA_NOT_ZERO:
     return "JUMP_IF_DATA_NOT_ZERO";
+  case BfOpKind::LOOP_MUL_ADD:
+    return "LOOP_MUL_ADD";
+  case BfOpKind::MUL_ADD_OPERAND:
+    return "MUL_ADD_OPERAND";
+  case BfOpKind::SET_DATA:
+    return "SET_DATA";
+  case BfOpKind::TAPE_SNAPSHOT:
+    return "TAPE_SNAPSHOT";
+  case BfOpKind::WRITE_STRING:
+    return "WRITE_STRING";
+  case BfOpKind::COUNTED_LOOP_BEGIN:
+    return "COUNTED_LOOP_BEGIN";
+  case BfOpKind::COUNTED_LOOP_END:
+    return "COUNTED_LOOP_END";
+  case BfOpKind::LOOP_CLOSED_FORM:
+    return "LOOP_CLOSED_FORM";
+  case BfOpKind::CLOSED_FORM_TERM:
+    return "CLOSED_FORM_TERM";
+  case BfOpKind::DIVMOD:
+    return "DIVMOD";
+  case BfOpKind::DIVMOD_OPERAND:
+    return "DIVMOD_OPERAND";
+  case BfOpKind::IF_BEGIN:
+    return "IF_BEGIN";
+  case BfOpKind::IF_END:
+    return "IF_END";
+  case BfOpKind::BLOCK_ADD:
+    return "BLOCK_ADD";
+  case BfOpKind::MEMSET_RANGE:
+    return "MEMSET_RANGE";
+  case BfOpKind::MEMMOVE_RANGE:
+    return "MEMMOVE_RANGE";
+  case BfOpKind::LOOP_SCAN_CLEAR:
+    return "LOOP_SCAN_CLEAR";
   case BfOpKind::INVALID_OP:
     return "INVALID_OP";
   }
   return nullptr;
 }
 
-BfOp::BfOp(BfOpKind kind_param, int64_t argument_param)
-  : kind(kind_param), argument(argument_param) {}
-
-// Optimizes a loop that starts at loop_start (the opening JUMP_IF_DATA_ZERO).
-// The loop runs until the end of ops (implicitly there's a back-jump after the
-// last op in ops).
-//
-// If optimization succeeds, returns a sequence of instructions that replace the
-// loop; otherwise, returns an empty vector.
-std::vector<BfOp> optimize_loop(const std::vector<BfOp>& ops,
-                                size_t loop_start) {
-  std::vector<BfOp> new_ops;
-
-  if (ops.size() - loop_start == 2) {
-    BfOp repeated_op = ops[loop_start + 1];
-    if (repeated_op.kind == BfOpKind::INC_DATA ||
-        repeated_op.kind == BfOpKind::DEC_DATA) {
-      new_ops.push_back(BfOp(BfOpKind::LOOP_SET_TO_ZERO, 0));
-    } else if (repeated_op.kind == BfOpKind::INC_PTR ||
-               repeated_op.kind == BfOpKind::DEC_PTR) {
-      new_ops.push_back(
-          BfOp(BfOpKind::LOOP_MOVE_PTR, repeated_op.kind == BfOpKind::INC_PTR
-                                            ? repeated_op.argument
-                                            : -repeated_op.argument));
-    }
-  } else if (ops.size() - loop_start == 5) {
-    // Detect patterns: -<+> and ->+<
-    if (ops[loop_start + 1].kind == BfOpKind::DEC_DATA &&
-        ops[loop_start + 3].kind == BfOpKind::INC_DATA &&
-        ops[loop_start + 1].argument == 1 &&
-        ops[loop_start + 3].argument == 1) {
-
-      if (ops[loop_start + 2].kind == BfOpKind::INC_PTR &&
-          ops[loop_start + 4].kind == BfOpKind::DEC_PTR &&
-          ops[loop_start + 2].argument == ops[loop_start + 4].argument) {
-        new_ops.push_back(
-            BfOp(BfOpKind::LOOP_MOVE_DATA, ops[loop_start + 2].argument));
-      } else if (ops[loop_start + 2].kind == BfOpKind::DEC_PTR &&
-                 ops[loop_start + 4].kind == BfOpKind::INC_PTR &&
-                 ops[loop_start + 2].argument == ops[loop_start + 4].argument) {
-        new_ops.push_back(
-            BfOp(BfOpKind::LOOP_MOVE_DATA, -ops[loop_start + 2].argument));
+bool is_jump(BfOpKind kind) {
+  return kind == BfOpKind::JUMP_IF_DATA_ZERO ||
+         kind == BfOpKind::JUMP_IF_DATA_NOT_ZERO ||
+         kind == BfOpKind::COUNTED_LOOP_BEGIN ||
+         kind == BfOpKind::COUNTED_LOOP_END || kind == BfOpKind::IF_BEGIN ||
+         kind == BfOpKind::IF_END;
+}
+
+size_t add_constant(std::string* constants, const void* data, size_t size) {
+  size_t offset = constants->size();
+  uint32_t length = size;
+  constants->append(reinterpret_cast<const char*>(&length), sizeof(length));
+  constants->append(static_cast<const char*>(data), size);
+  return offset;
+}
+
+const uint8_t* get_constant(const std::string& constants, size_t offset,
+                            size_t* size) {
+  uint32_t length;
+  memcpy(&length, constants.data() + offset, sizeof(length));
+  *size = length;
+  return reinterpret_cast<const uint8_t*>(constants.data() + offset +
+                                          sizeof(length));
+}
+
+size_t num_operands(const BfOp& op) {
+  return op.kind == BfOpKind::LOOP_MUL_ADD ||
+                 op.kind == BfOpKind::LOOP_CLOSED_FORM ||
+                 op.kind == BfOpKind::DIVMOD
+             ? op.argument
+             : 0;
+}
+
+// Layout: source in the high 32 bits, then is_constant in bit 16, step in bits
+// 8-15 and base in bits 0-7.
+int64_t encode_closed_form_term(const ClosedFormTerm& term) {
+  uint64_t packed = static_cast<uint64_t>(static_cast<uint32_t>(term.source))
+                    << 32;
+  packed |= (term.is_constant ? 1u << 16 : 0u) | term.step << 8 | term.base;
+  return static_cast<int64_t>(packed);
+}
+
+ClosedFormTerm decode_closed_form_term(int64_t argument) {
+  ClosedFormTerm term;
+  term.source = static_cast<int32_t>(static_cast<uint64_t>(argument) >> 32);
+  term.is_constant = argument & (1 << 16);
+  term.step = static_cast<uint8_t>(argument >> 8);
+  term.base = static_cast<uint8_t>(argument);
+  return term;
+}
+
+void run_closed_form_loop(const BfOp* ops, uint8_t* cell) {
+  uint8_t n = *cell;
+  if (n == 0) {
+    return;
+  }
+  size_t num_terms = ops[0].argument;
+  const BfOp* terms = ops + 1;
+
+  // All terms read entry values, so they're gathered before any cell is
+  // written.
+  uint8_t values[kMaxClosedFormTerms];
+  uint8_t coefficients[kMaxClosedFormTerms];
+  for (size_t i = 0; i < num_terms; ++i) {
+    ClosedFormTerm term = decode_closed_form_term(terms[i].argument);
+    values[i] = term.is_constant ? 1 : cell[term.source];
+    coefficients[i] = term.base + (n - 1) * term.step;
+  }
+
+  uint8_t sum = 0;
+  for (size_t i = 0; i < num_terms; ++i) {
+    sum += coefficients[i] * values[i];
+    if (i + 1 == num_terms || terms[i + 1].offset != terms[i].offset) {
+      cell[terms[i].offset] = sum;
+      sum = 0;
+    }
+  }
+  *cell = 0;
+}
+
+// Layout: the quotient, remainder and dividend coefficients in bits 32-39,
+// 24-31 and 16-23, then value in bits 8-15 and the role in bits 0-7.
+int64_t encode_divmod_operand(const DivmodOperand& operand) {
+  uint64_t packed = static_cast<uint8_t>(operand.quotient);
+  packed = packed << 8 | static_cast<uint8_t>(operand.remainder);
+  packed = packed << 8 | static_cast<uint8_t>(operand.dividend);
+  packed = packed << 8 | operand.value;
+  packed = packed << 8 | static_cast<uint8_t>(operand.role);
+  return static_cast<int64_t>(packed);
+}
+
+DivmodOperand decode_divmod_operand(int64_t argument) {
+  DivmodOperand operand;
+  operand.role = static_cast<DivmodOperand::Role>(argument & 0xFF);
+  operand.value = static_cast<uint8_t>(argument >> 8);
+  operand.dividend = static_cast<int8_t>(argument >> 16);
+  operand.remainder = static_cast<int8_t>(argument >> 24);
+  operand.quotient = static_cast<int8_t>(argument >> 32);
+  return operand;
+}
+
+bool run_divmod(const BfOp* ops, uint8_t* cell) {
+  uint8_t n = *cell;
+  size_t num_operands = ops[0].argument;
+  const BfOp* operands = ops + 1;
+
+  // Preconditions are all checked before any cell is written; the remainder
+  // may go to the divisor's own cell.
+  unsigned divisor = 0;
+  for (size_t i = 0; i < num_operands; ++i) {
+    DivmodOperand operand = decode_divmod_operand(operands[i].argument);
+    switch (operand.role) {
+    case DivmodOperand::Role::DIVISOR_CELL:
+      divisor = cell[operands[i].offset];
+      break;
+    case DivmodOperand::Role::DIVISOR_CONSTANT:
+      divisor = operand.value;
+      break;
+    case DivmodOperand::Role::DIVIDEND_BELOW:
+      if (n >= operand.value) {
+        return false;
       }
+      break;
+    case DivmodOperand::Role::ZERO_CELL:
+      if (cell[operands[i].offset]) {
+        return false;
+      }
+      break;
+    case DivmodOperand::Role::ADD_RESULT:
+      break;
     }
   }
-  return new_ops;
+  if (divisor < 2) {
+    return false;
+  }
+
+  unsigned quotient = n / divisor;
+  unsigned remainder = n % divisor;
+  for (size_t i = 0; i < num_operands; ++i) {
+    DivmodOperand operand = decode_divmod_operand(operands[i].argument);
+    if (operand.role == DivmodOperand::Role::ADD_RESULT) {
+      cell[operands[i].offset] += operand.dividend * n +
+                                  operand.remainder * remainder +
+                                  operand.quotient * quotient;
+    }
+  }
+  *cell = 0;
+  return true;
 }
 
-// Translates the given program into a vector of BfOps that can be used for fast
-// interpretation.
-std::vector<BfOp> translate_program(const Program& p) {
-  size_t pc = 0;
-  size_t program_size = p.instructions.size();
-  std::vector<BfOp> ops;
-
-  // Throughout the translation loop, this stack contains offsets (in the ops
-  // vector) of open brackets (JUMP_IF_DATA_ZERO ops) waiting for a closing
-  // bracket. Since brackets nest, these naturally form a stack. The
-  // JUMP_IF_DATA_ZERO ops get added to ops with their argument set to 0 until a
-  // matching closing bracket is encountered, at which point the argument can be
-  // back-patched.
-  std::stack<size_t> open_bracket_stack;
-
-  while (pc < program_size) {
-    char instruction = p.instructions[pc];
+// Layout: distance in the high 32 bits, length in the low 32 bits.
+int64_t encode_memmove_range(const MemmoveRange& range) {
+  uint64_t packed = static_cast<uint32_t>(range.distance);
+  packed = packed << 32 | range.length;
+  return static_cast<int64_t>(packed);
+}
+
+MemmoveRange decode_memmove_range(int64_t argument) {
+  MemmoveRange range;
+  range.length = static_cast<uint32_t>(argument);
+  range.distance = static_cast<int32_t>(argument >> 32);
+  return range;
+}
+
+std::string BfOp_to_string(const BfOp& op) {
+  std::ostringstream ss;
+  if (op.kind == BfOpKind::CLOSED_FORM_TERM) {
+    ClosedFormTerm term = decode_closed_form_term(op.argument);
+    ss << BfOpKind_name(op.kind) << " (" << static_cast<int>(term.base)
+       << " + (n-1)*" << static_cast<int>(term.step) << ")";
+    if (!term.is_constant) {
+      ss << " * [" << term.source << "]";
+    }
+    ss << " @ " << op.offset;
+    return ss.str();
+  }
+  if (op.kind == BfOpKind::DIVMOD_OPERAND) {
+    static const char* const kRoleNames[] = {"divisor", "divisor", "below",
+                                             "zero", "add"};
+    DivmodOperand operand = decode_divmod_operand(op.argument);
+    ss << BfOpKind_name(op.kind) << " "
+       << kRoleNames[static_cast<int>(operand.role)];
+    if (operand.role == DivmodOperand::Role::ADD_RESULT) {
+      ss << " " << static_cast<int>(operand.dividend) << "*n + "
+         << static_cast<int>(operand.remainder) << "*r + "
+         << static_cast<int>(operand.quotient) << "*q";
+    } else if (operand.role == DivmodOperand::Role::DIVISOR_CONSTANT ||
+               operand.role == DivmodOperand::Role::DIVIDEND_BELOW) {
+      ss << " " << static_cast<int>(operand.value);
+    }
+    ss << " @ " << op.offset;
+    return ss.str();
+  }
+  if (op.kind == BfOpKind::MEMMOVE_RANGE) {
+    MemmoveRange range = decode_memmove_range(op.argument);
+    ss << BfOpKind_name(op.kind) << " " << range.length << " by "
+       << range.distance << " @ " << op.offset;
+    return ss.str();
+  }
+  ss << BfOpKind_name(op.kind) << " " << op.argument;
+  if (op.offset != 0) {
+    ss << " @ " << op.offset;
+  }
+  return ss.str();
+}
+
+namespace {
+
+size_t scan_for_zero_scalar(const uint8_t* memory, size_t size, size_t pos,
+                            int64_t stride) {
+  while (memory[pos]) {
+    if ((stride < 0 && pos < static_cast<size_t>(-stride)) ||
+        (stride > 0 && size - pos <= static_cast<size_t>(stride))) {
+      DIE << "LOOP_MOVE_PTR ran off the tape at " << pos;
+    }
+    pos += stride;
+  }
+  return pos;
+}
+
+#if defined(__x86_64__)
+
+// Scans 32 cells at a time: the zero cells of a window form a bit mask, of
+// which only the lanes the stride lands on are kept. Windows start at pos
+// going forward and end at pos going backward, so the lanes are fixed.
+__attribute__((target("avx2")))
+size_t scan_for_zero_avx2(const uint8_t* memory, size_t size, size_t pos,
+                          int64_t stride) {
+  const __m256i zero = _mm256_setzero_si256();
+  if (stride > 0) {
+    uint32_t lanes = stride == 2 ? 0x55555555u
+                                 : stride == 4 ? 0x11111111u : 0x01010101u;
+    while (size - pos >= 32) {
+      __m256i cells =
+          _mm256_loadu_si256(reinterpret_cast<const __m256i*>(memory + pos));
+      uint32_t mask = static_cast<uint32_t>(
+          _mm256_movemask_epi8(_mm256_cmpeq_epi8(cells, zero))) & lanes;
+      if (mask) {
+        return pos + __builtin_ctz(mask);
+      }
+      pos += 32;
+    }
+  } else {
+    uint32_t lanes = stride == -2 ? 0xAAAAAAAAu
+                                  : stride == -4 ? 0x88888888u : 0x80808080u;
+    while (pos >= 31) {
+      __m256i cells = _mm256_loadu_si256(
+          reinterpret_cast<const __m256i*>(memory + pos - 31));
+      uint32_t mask = static_cast<uint32_t>(
+          _mm256_movemask_epi8(_mm256_cmpeq_epi8(cells, zero))) & lanes;
+      if (mask) {
+        return pos - __builtin_clz(mask);
+      }
+      pos -= 32;
+    }
+  }
+  // Finish near the ends of the tape one cell at a time.
+  return scan_for_zero_scalar(memory, size, pos, stride);
+}
+
+__attribute__((target("avx2")))
+void block_add_avx2(const uint8_t* deltas, uint8_t* cells) {
+  __m256i sum = _mm256_add_epi8(
+      _mm256_loadu_si256(reinterpret_cast<const __m256i*>(cells)),
+      _mm256_loadu_si256(reinterpret_cast<const __m256i*>(deltas)));
+  _mm256_storeu_si256(reinterpret_cast<__m256i*>(cells), sum);
+}
+
+#endif // __x86_64__
+
+} // namespace
+
+void run_block_add(const uint8_t* deltas, size_t width, uint8_t* cells) {
+#if defined(__x86_64__)
+  static const bool has_avx2 = __builtin_cpu_supports("avx2");
+  if (width == kMaxBlockAddWidth && has_avx2) {
+    block_add_avx2(deltas, cells);
+    return;
+  }
+  for (size_t i = 0; i < width; i += 16) {
+    __m128i sum = _mm_add_epi8(
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(cells + i)),
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(deltas + i)));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(cells + i), sum);
+  }
+#else
+  // Adds 8 cells at a time in a 64-bit word: the low 7 bits of each byte are
+  // added without carrying into the next byte, and the top bit is fixed up
+  // with an xor.
+  const uint64_t kHighBits = 0x8080808080808080ull;
+  for (size_t i = 0; i < width; i += 8) {
+    uint64_t a, b;
+    memcpy(&a, cells + i, 8);
+    memcpy(&b, deltas + i, 8);
+    uint64_t sum =
+        ((a & ~kHighBits) + (b & ~kHighBits)) ^ ((a ^ b) & kHighBits);
+    memcpy(cells + i, &sum, 8);
+  }
+#endif
+}
+
+size_t scan_for_zero(const uint8_t* memory, size_t size, size_t pos,
+                     int64_t stride) {
+  if (stride == 1) {
+    const void* zero = memchr(memory + pos, 0, size - pos);
+    if (!zero) {
+      DIE << "LOOP_MOVE_PTR ran off the tape at " << pos;
+    }
+    return static_cast<const uint8_t*>(zero) - memory;
+  } else if (stride == -1) {
+    const void* zero = memrchr(memory, 0, pos + 1);
+    if (!zero) {
+      DIE << "LOOP_MOVE_PTR ran off the tape at " << pos;
+    }
+    return static_cast<const uint8_t*>(zero) - memory;
+  }
+
+#if defined(__x86_64__)
+  static const bool has_avx2 = __builtin_cpu_supports("avx2");
+  int64_t abs_stride = stride < 0 ? -stride : stride;
+  if (has_avx2 && (abs_stride == 2 || abs_stride == 4 || abs_stride == 8)) {
+    return scan_for_zero_avx2(memory, size, pos, stride);
+  }
+#endif
+  return scan_for_zero_scalar(memory, size, pos, stride);
+}
+
+bool pack_ops(const std::vector<BfOp>& ops, std::vector<PackedOp>* packed) {
+  std::vector<BfOp> relative = relative_jump_ops(ops);
+  packed->resize(relative.size());
+  for (size_t pc = 0; pc < relative.size(); ++pc) {
+    const BfOp& op = relative[pc];
+    PackedOp& p = (*packed)[pc];
+    p.kind = static_cast<int16_t>(op.kind);
+    p.offset = 0;
+    p.argument = 0;
+    if (op.kind == BfOpKind::CLOSED_FORM_TERM ||
+        op.kind == BfOpKind::DIVMOD_OPERAND) {
+      continue;
+    }
+    if (op.offset < INT16_MIN || op.offset > INT16_MAX) {
+      return false;
+    }
+    p.offset = static_cast<int16_t>(op.offset);
+    if (op.kind == BfOpKind::MEMMOVE_RANGE) {
+      continue;
+    }
+    if (op.argument < INT32_MIN || op.argument > INT32_MAX) {
+      return false;
+    }
+    p.argument = static_cast<int32_t>(op.argument);
+  }
+  return true;
+}
+
+std::vector<BfOp> relative_jump_ops(const std::vector<BfOp>& ops) {
+  std::vector<BfOp> relative(ops);
+  for (size_t pc = 0; pc < relative.size(); ++pc) {
+    if (is_jump(relative[pc].kind)) {
+      relative[pc].argument -= static_cast<int64_t>(pc);
+    }
+  }
+  relative.push_back(BfOp(BfOpKind::INVALID_OP, 0));
+  return relative;
+}
+
+#define SUPERINSTRUCTION_KINDS(label, handler, kind0, kind1, kind2)           \
+  {BfOpKind::kind0, BfOpKind::kind1, BfOpKind::kind2},
+
+const BfOpKind kSuperinstructions[][kMaxSuperinstructionOps] = {
+  BF_SUPERINSTRUCTIONS(SUPERINSTRUCTION_KINDS)
+};
+
+#undef SUPERINSTRUCTION_KINDS
+
+namespace {
+
+// Returns true if the ops of superinstruction start at code[pc].
+bool starts_superinstruction(const std::vector<PackedOp>& code, size_t pc,
+                             const BfOpKind* superinstruction) {
+  for (int i = 0; i < kMaxSuperinstructionOps; ++i) {
+    if (superinstruction[i] == BfOpKind::INVALID_OP) {
+      break;
+    }
+    if (pc + i >= code.size() ||
+        code[pc + i].kind != static_cast<int16_t>(superinstruction[i])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+} // namespace
+
+void fuse_superinstructions(std::vector<PackedOp>* code) {
+  for (size_t pc = 0; pc < code->size(); ++pc) {
+    for (int i = 0; i < kNumSuperinstructions; ++i) {
+      if (starts_superinstruction(*code, pc, kSuperinstructions[i])) {
+        (*code)[pc].kind = static_cast<int16_t>(kNumOpKinds + i);
+        break;
+      }
+    }
+  }
+}
+
+size_t scan_and_clear(uint8_t* memory, size_t size, size_t pos,
+                      int64_t stride) {
+  if (!memory[pos]) {
+    return pos;
+  }
+  size_t end = scan_for_zero(memory, size, pos, stride);
+  if (stride > 0) {
+    memset(memory + pos, 0, end - pos);
+  } else {
+    memset(memory + end + 1, 0, pos - end);
+  }
+  return end;
+}
+
+Translator::Translator()
+  : base_(0), outermost_open_(0), run_char_(0), run_length_(0), run_start_(0),
+    pc_(0) {}
+
+void Translator::feed(const char* commands, size_t size) {
+  for (size_t i = 0; i < size; ++i, ++pc_) {
+    char instruction = commands[i];
+    if (instruction == run_char_) {
+      run_length_++;
+      continue;
+    }
+    flush_run();
+
     if (instruction == '[') {
       // Place a jump op with a placeholder 0 offset. It will be patched-up to
       // the right offset when the matching ']' is found.
-      open_bracket_stack.push(ops.size());
-      ops.push_back(BfOp(BfOpKind::JUMP_IF_DATA_ZERO, 0));
-      pc++;
-    } else if (instruction == ']') {
-      if (open_bracket_stack.empty()) {
-        DIE << "unmatched closing ']' at pc=" << pc;
-      }
-      size_t open_bracket_offset = open_bracket_stack.top();
-      open_bracket_stack.pop();
-
-      // Try to optimize this loop; if optimize_loop succeeds, it returns a
-      // non-empty vector which we can splice into ops in place of the loop.
-      // If the returned vector is empty, we proceed as usual.
-      std::vector<BfOp> optimized_loop =
-          optimize_loop(ops, open_bracket_offset);
-
-      if (optimized_loop.empty()) {
-        // Loop wasn't optimized, so proceed emitting the back-jump to ops. We
-        // have the offset of the matching '['. We can use it to create a new
-        // jump op for the ']' we're handling, as well as patch up the offset of
-        // the matching '['.
-        ops[open_bracket_offset].argument = ops.size();
-        ops.push_back(
-            BfOp(BfOpKind::JUMP_IF_DATA_NOT_ZERO, open_bracket_offset));
-      } else {
-        // Replace this whole loop with optimized_loop.
-        ops.erase(ops.begin() + open_bracket_offset, ops.end());
-        ops.insert(ops.end(), optimized_loop.begin(), optimized_loop.end());
+      if (open_bracket_stack_.empty()) {
+        outermost_open_ = base_ + ops_.size();
       }
-      pc++;
+      open_bracket_stack_.push(base_ + ops_.size());
+      ops_.push_back(BfOp(BfOpKind::JUMP_IF_DATA_ZERO, 0));
+    } else if (instruction == ']') {
+      close_loop();
     } else {
-      // Not a jump; all the other ops can be repeated, so find where the repeat
-      // ends.
-      size_t start = pc++;
-      while (pc < program_size && p.instructions[pc] == instruction) {
-        pc++;
+      // Not a jump; all the other ops can be repeated, so start a run that
+      // ends at the first different command.
+      run_char_ = instruction;
+      run_length_ = 1;
+      run_start_ = pc_;
+    }
+  }
+}
+
+void Translator::feed_source(const char* source, size_t size) {
+  // Filter through a small buffer that stays in L1, so the source is only
+  // streamed through once.
+  char chunk[16 * 1024];
+  for (size_t pos = 0; pos < size; pos += sizeof(chunk)) {
+    size_t len = std::min(sizeof(chunk), size - pos);
+    feed(chunk, filter_commands(source + pos, len, chunk));
+  }
+}
+
+std::vector<BfOp> Translator::take_completed() {
+  size_t num_completed = open_bracket_stack_.empty()
+                             ? ops_.size()
+                             : outermost_open_ - base_;
+  std::vector<BfOp> completed(ops_.begin(), ops_.begin() + num_completed);
+  ops_.erase(ops_.begin(), ops_.begin() + num_completed);
+  base_ += num_completed;
+  return completed;
+}
+
+std::vector<BfOp> Translator::finish() {
+  flush_run();
+  if (!open_bracket_stack_.empty()) {
+    DIE << "unmatched '[' at end of program";
+  }
+  return std::move(ops_);
+}
+
+void Translator::flush_run() {
+  if (run_char_ == 0) {
+    return;
+  }
+
+  // Figure out which op kind the instruction represents and add it to the ops.
+  BfOpKind kind = BfOpKind::INVALID_OP;
+  switch (run_char_) {
+  case '>':
+    kind = BfOpKind::INC_PTR;
+    break;
+  case '<':
+    kind = BfOpKind::DEC_PTR;
+    break;
+  case '+':
+    kind = BfOpKind::INC_DATA;
+    break;
+  case '-':
+    kind = BfOpKind::DEC_DATA;
+    break;
+  case ',':
+    kind = BfOpKind::READ_STDIN;
+    break;
+  case '.':
+    kind = BfOpKind::WRITE_STDOUT;
+    break;
+  default: { DIE << "bad char '" << run_char_ << "' at pc=" << run_start_; }
+  }
+
+  ops_.push_back(BfOp(kind, run_length_));
+  run_char_ = 0;
+  run_length_ = 0;
+}
+
+void Translator::close_loop() {
+  if (open_bracket_stack_.empty()) {
+    DIE << "unmatched closing ']' at pc=" << pc_;
+  }
+  size_t open_bracket_offset = open_bracket_stack_.top();
+  open_bracket_stack_.pop();
+
+  // We have the offset of the matching '['. We can use it to create a new jump
+  // op for the ']' we're handling, as well as patch up the offset of the
+  // matching '['.
+  ops_[open_bracket_offset - base_].argument = base_ + ops_.size();
+  ops_.push_back(BfOp(BfOpKind::JUMP_IF_DATA_NOT_ZERO, open_bracket_offset));
+}
+
+// Translates the given program into a vector of BfOps that can be used for fast
+// interpretation.
+std::vector<BfOp> translate_program(const Program& p) {
+  Translator translator;
+  translator.feed(p.instructions.data(), p.instructions.size());
+  return translator.finish();
+}
+
+std::vector<BfOp> translate_source(const char* source, size_t size) {
+  Translator translator;
+  translator.feed_source(source, size);
+  return translator.finish();
+}
+
+namespace {
+
+// Calls fn(0) ... fn(n - 1) on up to num_threads threads, including the
+// calling one.
+void parallel_for(size_t n, unsigned num_threads,
+                  const std::function<void(size_t)>& fn) {
+  std::atomic<size_t> next(0);
+  auto worker = [&]() {
+    for (size_t i = next++; i < n; i = next++) {
+      fn(i);
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (unsigned t = 1; t < std::min<size_t>(num_threads, n); ++t) {
+    threads.emplace_back(worker);
+  }
+  worker();
+  for (auto& thread : threads) {
+    thread.join();
+  }
+}
+
+// Finds where to cut source into roughly num_pieces pieces for parallel
+// translation. Cuts are only made right after a ']' closing a top-level loop,
+// so no loop or run of commands spans two pieces. Returns the end offsets of
+// the pieces, or an empty vector if the brackets don't match (the sequential
+// translator reports that).
+std::vector<size_t> find_top_level_cuts(const char* source, size_t size,
+                                        size_t num_pieces) {
+  std::vector<size_t> cuts;
+  size_t target_piece_size = std::max<size_t>(size / num_pieces, 1);
+  size_t next_cut = target_piece_size;
+  long depth = 0;
+
+  for (size_t i = 0; i < size; ++i) {
+    if (source[i] == '[') {
+      depth++;
+    } else if (source[i] == ']') {
+      if (--depth < 0) {
+        return {};
+      } else if (depth == 0 && i + 1 >= next_cut) {
+        cuts.push_back(i + 1);
+        next_cut = i + 1 + target_piece_size;
       }
-      // Here pc points to the first new instruction encountered, or to the end
-      // of the program.
-      size_t num_repeats = pc - start;
-
-      // Figure out which op kind the instruction represents and add it to the
-      // ops.
-      BfOpKind kind = BfOpKind::INVALID_OP;
-      switch (instruction) {
-      case '>':
-        kind = BfOpKind::INC_PTR;
-        break;
-      case '<':
-        kind = BfOpKind::DEC_PTR;
-        break;
-      case '+':
-        kind = BfOpKind::INC_DATA;
-        break;
-      case '-':
-        kind = BfOpKind::DEC_DATA;
-        break;
-      case ',':
-        kind = BfOpKind::READ_STDIN;
-        break;
-      case '.':
-        kind = BfOpKind::WRITE_STDOUT;
-        break;
-      default: { DIE << "bad char '" << instruction << "' at pc=" << start; }
+    }
+  }
+  if (depth != 0) {
+    return {};
+  }
+  if (cuts.empty() || cuts.back() != size) {
+    cuts.push_back(size);
+  }
+  return cuts;
+}
+
+} // namespace
+
+std::vector<BfOp> translate_source_parallel(const char* source, size_t size,
+                                            unsigned num_threads) {
+  // A few pieces per thread keep the threads busy when pieces differ in
+  // density; tiny sources aren't worth splitting at all.
+  constexpr size_t kMinPieceSize = 64 * 1024;
+  size_t num_pieces = std::min<size_t>(num_threads * 4, size / kMinPieceSize);
+  std::vector<size_t> cuts;
+  if (num_threads > 1 && num_pieces > 1) {
+    cuts = find_top_level_cuts(source, size, num_pieces);
+  }
+  if (cuts.size() <= 1) {
+    return translate_source(source, size);
+  }
+
+  std::vector<std::vector<BfOp>> pieces(cuts.size());
+  parallel_for(pieces.size(), num_threads, [&](size_t i) {
+    size_t begin = i == 0 ? 0 : cuts[i - 1];
+    pieces[i] = translate_source(source + begin, cuts[i] - begin);
+  });
+
+  // Stitch the pieces together. Each piece numbered its ops from 0, so its
+  // jump arguments are rebased by the number of ops preceding it.
+  std::vector<size_t> bases(pieces.size() + 1, 0);
+  for (size_t i = 0; i < pieces.size(); ++i) {
+    bases[i + 1] = bases[i] + pieces[i].size();
+  }
+  std::vector<BfOp> ops(bases.back(), BfOp(BfOpKind::INVALID_OP, 0));
+  parallel_for(pieces.size(), num_threads, [&](size_t i) {
+    BfOp* out = &ops[bases[i]];
+    for (const BfOp& op : pieces[i]) {
+      *out = op;
+      if (op.kind == BfOpKind::JUMP_IF_DATA_ZERO ||
+          op.kind == BfOpKind::JUMP_IF_DATA_NOT_ZERO) {
+        out->argument += bases[i];
       }
+      ++out;
+    }
+  });
+  return ops;
+}
+
+OpProgram translate_file(const std::string& path, const Flags& flags) {
+  Timer t1;
+  OpProgram program;
 
-      ops.push_back(BfOp(kind, num_repeats));
+  if (!flags.load_bfo.empty()) {
+    uint64_t bfo_hash;
+    read_bfo(flags.load_bfo, &program, &bfo_hash);
+    bool stale = false;
+    if (!path.empty()) {
+      MappedFile file(path);
+      stale = hash_bytes(file.data(), file.size()) != bfo_hash;
     }
+    if (!stale) {
+      if (flags.verbose) {
+        std::cout << "Loaded " << program.ops.size() << " ops from "
+                  << flags.load_bfo << " in " << t1.elapsed() << "s\n";
+      }
+      return program;
+    }
+    std::cerr << "Warning: " << flags.load_bfo << " was built from another "
+              << "version of " << path << "; translating the source\n";
   }
 
-  return ops;
+  MappedFile file(path);
+  std::vector<BfOp> ops =
+      flags.jobs > 1
+          ? translate_source_parallel(file.data(), file.size(), flags.jobs)
+          : translate_source(file.data(), file.size());
+
+  if (flags.verbose) {
+    double elapsed = t1.elapsed();
+    std::cout << "Translation took: " << elapsed << "s ("
+              << file.size() / elapsed / 1e6 << " MB/s, " << ops.size()
+              << " ops, " << flags.jobs << " threads)\n";
+  }
+
+  program = optimize(ops, flags);
+
+  if (!flags.emit_bfo.empty()) {
+    write_bfo(flags.emit_bfo, program, hash_bytes(file.data(), file.size()));
+  }
+  return program;
 }
 
 } // namespace optutils
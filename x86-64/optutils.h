@@ -1,8 +1,11 @@
 #pragma once
 
+#include <stack>
+#include <string>
 #include <vector>
 
 #include "parser.h"
+#include "utils.h"
 
 namespace optutils {
 
@@ -20,29 +23,346 @@ enum class BfOpKind {
   LOOP_MOVE_PTR,
   LOOP_MOVE_DATA,
   JUMP_IF_DATA_ZERO,
-  JUMP_IF_DATA_NOT_ZERO
+  JUMP_IF_DATA_NOT_ZERO,
+
+  // A linear loop: every iteration decrements the current cell by 1 and adds
+  // constant multiples of it to other cells. argument is the number of cells
+  // it adds to; that many MUL_ADD_OPERAND ops follow, each adding argument
+  // times the current cell to the cell at offset. Clears the current cell.
+  LOOP_MUL_ADD,
+  MUL_ADD_OPERAND,
+
+  // Sets the cell to argument, which is in [1, 255]; LOOP_SET_TO_ZERO covers
+  // 0.
+  SET_DATA,
+
+  // Copies the constant at argument (see OpProgram) to the tape, starting at
+  // the cell at offset.
+  TAPE_SNAPSHOT,
+
+  // Writes the constant at argument to stdout.
+  WRITE_STRING,
+
+  // Brackets of a counted loop: its body keeps the pointer balanced, and
+  // changes the loop's cell by exactly -1 per iteration and in no other way,
+  // so it runs as many times as the cell holds on entry. They jump like
+  // JUMP_IF_DATA_ZERO/NOT_ZERO, but executors may keep the trip count in a
+  // native counter instead of testing the cell on every back-edge.
+  COUNTED_LOOP_BEGIN,
+  COUNTED_LOOP_END,
+
+  // A loop in closed form: a loop run n times, where n is the current cell,
+  // whose cells end up as polynomials of their values on entry and n. argument
+  // is the number of CLOSED_FORM_TERM ops that follow; see
+  // run_closed_form_loop. Clears the current cell.
+  LOOP_CLOSED_FORM,
+  CLOSED_FORM_TERM,
+
+  // A recognized division loop (see the divmod pass), placed right before the
+  // loop itself. Divides the current cell by a divisor and adds multiples of
+  // the dividend, quotient and remainder to other cells, then clears the
+  // current cell so the loop that follows doesn't run. argument is the number
+  // of DIVMOD_OPERAND ops that follow; see run_divmod. When an operand's
+  // precondition doesn't hold, it does nothing and leaves the work to the loop.
+  DIVMOD,
+  DIVMOD_OPERAND,
+
+  // Brackets of a loop that runs at most once: its body keeps the pointer
+  // balanced and always leaves the loop's cell at 0. IF_BEGIN jumps past
+  // IF_END like JUMP_IF_DATA_ZERO; IF_END does nothing, since the back-edge
+  // would never be taken.
+  IF_BEGIN,
+  IF_END,
+
+  // Adds the constant at argument, a vector of kBlockAddWidth or
+  // kMaxBlockAddWidth per-cell deltas, to the cells starting at offset.
+  BLOCK_ADD,
+
+  // Clears the argument cells starting at the cell at offset.
+  MEMSET_RANGE,
+
+  // Moves a range of cells to cells that are known to be 0 and don't overlap
+  // it, clearing the range; see MemmoveRange. The range starts at offset.
+  MEMMOVE_RANGE,
+
+  // A [[-]>] or [[-]<] loop: clears cells, moving by argument (+1 or -1),
+  // until it gets to a zero cell, where the pointer stays.
+  LOOP_SCAN_CLEAR
 };
 
 const char* BfOpKind_name(BfOpKind kind);
 
+// Whether ops of kind are brackets, whose argument is the index of the
+// matching one.
+bool is_jump(BfOpKind kind);
+
 struct BfOp {
-  BfOp(BfOpKind kind_param, int64_t argument_param);
+  BfOp(BfOpKind kind_param, int64_t argument_param, int32_t offset_param = 0)
+    : kind(kind_param), offset(offset_param), argument(argument_param) {}
 
   BfOpKind kind;
+
+  // Offset from the data pointer of the cell the op works on. Set on data and
+  // I/O ops by the fold-pointers pass; a MUL_ADD_OPERAND's offset is relative
+  // to its LOOP_MUL_ADD's cell.
+  int32_t offset;
   int64_t argument;
 };
 
-// Optimizes a loop that starts at loop_start (the opening JUMP_IF_DATA_ZERO).
-// The loop runs until the end of ops (implicitly there's a back-jump after the
-// last op in ops).
+// A translated program: its ops and the pool of constant data they refer to.
+// Each pool entry is a 32-bit length followed by that many bytes, and ops refer
+// to an entry by the offset of its length.
+struct OpProgram {
+  std::vector<BfOp> ops;
+  std::string constants;
+};
+
+// Appends an entry holding data[0..size) to *constants and returns its offset.
+size_t add_constant(std::string* constants, const void* data, size_t size);
+
+// Returns the bytes of the entry at offset in constants and sets *size to
+// their number. offset has to be one add_constant returned.
+const uint8_t* get_constant(const std::string& constants, size_t offset,
+                            size_t* size);
+
+// Returns the number of operand ops that follow op: the MUL_ADD_OPERANDs of a
+// LOOP_MUL_ADD, the CLOSED_FORM_TERMs of a LOOP_CLOSED_FORM and the
+// DIVMOD_OPERANDs of a DIVMOD.
+size_t num_operands(const BfOp& op);
+
+// A term of a LOOP_CLOSED_FORM, which runs a loop n times. The new value of
+// the cell at the term's op offset (relative to the loop's cell) is the sum of
+// its terms, which are consecutive: each one is (base + (n - 1) * step) times
+// the entry value of the cell at source, or times 1 if is_constant.
+struct ClosedFormTerm {
+  int32_t source;
+  bool is_constant;
+  uint8_t base;
+  uint8_t step;
+};
+
+// Packs term into the argument of a CLOSED_FORM_TERM op, and back.
+int64_t encode_closed_form_term(const ClosedFormTerm& term);
+ClosedFormTerm decode_closed_form_term(int64_t argument);
+
+// Most terms a LOOP_CLOSED_FORM may have.
+constexpr size_t kMaxClosedFormTerms = 64;
+
+// Executes the LOOP_CLOSED_FORM op at ops[0] on the tape, with cell pointing
+// at the loop's cell.
+void run_closed_form_loop(const BfOp* ops, uint8_t* cell);
+
+// An operand of a DIVMOD, whose cell is the dividend n. Offsets, including
+// the operand op's own, are relative to the DIVMOD's cell. The divisor d comes
+// from the first operand, which is DIVISOR_CELL or DIVISOR_CONSTANT; the
+// rest are preconditions and results.
+struct DivmodOperand {
+  enum class Role : uint8_t {
+    // d is the cell at the op's offset.
+    DIVISOR_CELL,
+    // d is value.
+    DIVISOR_CONSTANT,
+    // Requires n < value.
+    DIVIDEND_BELOW,
+    // Requires the cell at the op's offset to be 0.
+    ZERO_CELL,
+    // Adds dividend * n + remainder * (n % d) + quotient * (n / d) to the
+    // cell at the op's offset.
+    ADD_RESULT,
+  };
+
+  Role role;
+  uint8_t value;
+  int8_t dividend;
+  int8_t remainder;
+  int8_t quotient;
+};
+
+// Packs operand into the argument of a DIVMOD_OPERAND op, and back.
+int64_t encode_divmod_operand(const DivmodOperand& operand);
+DivmodOperand decode_divmod_operand(int64_t argument);
+
+// Executes the DIVMOD op at ops[0] on the tape, with cell pointing at the
+// dividend. It only runs when d >= 2 and all the preconditions hold. Returns
+// whether it ran.
+bool run_divmod(const BfOp* ops, uint8_t* cell);
+
+// Widths of the delta vectors of BLOCK_ADD. A BLOCK_ADD adds to every cell of
+// its window, including cells past the last one it changes, so executors pad
+// their tapes with kMaxBlockAddWidth cells past the end.
+constexpr size_t kBlockAddWidth = 16;
+constexpr size_t kMaxBlockAddWidth = 32;
+
+// Executes BLOCK_ADD: adds deltas[0, width) to cells[0, width), with SSE2, or
+// AVX2 when available, on x86-64.
+void run_block_add(const uint8_t* deltas, size_t width, uint8_t* cells);
+
+// The range of a MEMMOVE_RANGE: length cells starting at the op's offset go to
+// the cells distance away, where |distance| >= length.
+struct MemmoveRange {
+  uint32_t length;
+  int32_t distance;
+};
+
+// Packs range into the argument of a MEMMOVE_RANGE op, and back.
+int64_t encode_memmove_range(const MemmoveRange& range);
+MemmoveRange decode_memmove_range(int64_t argument);
+
+// Returns a printable form of op for verbose listings: its kind name and
+// argument, followed by the offset if it's not 0.
+std::string BfOp_to_string(const BfOp& op);
+
+// Executes LOOP_MOVE_PTR: starting at pos, moves by stride until it gets to a
+// zero cell of memory[0, size), and returns its index. Strides of +-1 use
+// memchr/memrchr and strides of +-2, 4 and 8 a vector compare when AVX2 is
+// available. Dies if the scan runs off the tape.
+size_t scan_for_zero(const uint8_t* memory, size_t size, size_t pos,
+                     int64_t stride);
+
+// Executes LOOP_SCAN_CLEAR: like scan_for_zero for a stride of +-1, and clears
+// the cells it moves past with memset.
+size_t scan_and_clear(uint8_t* memory, size_t size, size_t pos,
+                      int64_t stride);
+
+// An op packed into 8 bytes, half the size of a BfOp, for the interpreters: a
+// large program's ops then take half the cache. Jump arguments are relative to
+// the op's own index. The arguments of MEMMOVE_RANGE, CLOSED_FORM_TERM and
+// DIVMOD_OPERAND ops and the offsets of the latter two aren't packed; they're
+// read from the BfOps.
+struct PackedOp {
+  // The op's BfOpKind. optdt replaces it by the distance of the op's handler
+  // from a base label, which threads the ops without widening them.
+  int16_t kind;
+  int16_t offset;
+  int32_t argument;
+};
+
+static_assert(sizeof(PackedOp) == 8, "PackedOp should take 8 bytes");
+
+// Packs ops into *packed, followed by an INVALID_OP that threaded code can stop
+// on. Returns false if an offset doesn't fit in 16 bits or an argument in 32;
+// the ops are then run from relative_jump_ops(ops) instead, whose fields are
+// wide enough for anything. Offsets into a 30000-cell tape always fit.
+bool pack_ops(const std::vector<BfOp>& ops, std::vector<PackedOp>* packed);
+
+// Returns a copy of ops with jump arguments relative like PackedOp's, followed
+// by an INVALID_OP.
+std::vector<BfOp> relative_jump_ops(const std::vector<BfOp>& ops);
+
+constexpr int kNumOpKinds = static_cast<int>(BfOpKind::LOOP_SCAN_CLEAR) + 1;
+
+// Superinstructions: runs of adjacent ops run by a single handler, and so with
+// a single dispatch, in optdt and opttail. These are the runs that most often
+// execute back to back in mandelbrot.bf and factor.bf at -O2, longest first.
 //
-// If optimization succeeds, returns a sequence of instructions that replace the
-// loop; otherwise, returns an empty vector.
-std::vector<BfOp> optimize_loop(const std::vector<BfOp>& ops,
-                                size_t loop_start);
+// Each entry is X(label, handler, kind0, kind1, kind2): the name of the run's
+// handler label in optdt and handler function in opttail, then the BfOpKinds
+// of the run. Runs shorter than kMaxSuperinstructionOps end in INVALID_OP.
+// kSuperinstructions and the handler tables of optdt and opttail are all
+// generated from this list, so their entries always line up.
+#define BF_SUPERINSTRUCTIONS(X)                                                \
+  X(MOVE_DATA_DEC_PTR_JUMP_IF_NOT_ZERO, move_data_dec_ptr_jump_if_not_zero,    \
+    LOOP_MOVE_DATA, DEC_PTR, JUMP_IF_DATA_NOT_ZERO)                            \
+  X(INC_DATA_INC_PTR_JUMP_IF_NOT_ZERO, inc_data_inc_ptr_jump_if_not_zero,      \
+    INC_DATA, INC_PTR, JUMP_IF_DATA_NOT_ZERO)                                  \
+  X(MOVE_DATA_INC_PTR_JUMP_IF_NOT_ZERO, move_data_inc_ptr_jump_if_not_zero,    \
+    LOOP_MOVE_DATA, INC_PTR, JUMP_IF_DATA_NOT_ZERO)                            \
+  X(INC_PTR_JUMP_IF_NOT_ZERO, inc_ptr_jump_if_not_zero,                        \
+    INC_PTR, JUMP_IF_DATA_NOT_ZERO, INVALID_OP)                                \
+  X(DEC_PTR_JUMP_IF_NOT_ZERO, dec_ptr_jump_if_not_zero,                        \
+    DEC_PTR, JUMP_IF_DATA_NOT_ZERO, INVALID_OP)                                \
+  X(DEC_DATA_MOVE_DATA, dec_data_move_data,                                    \
+    DEC_DATA, LOOP_MOVE_DATA, INVALID_OP)                                      \
+  X(IF_BEGIN_DEC_DATA, if_begin_dec_data,                                      \
+    IF_BEGIN, DEC_DATA, INVALID_OP)                                            \
+  X(DEC_DATA_INC_DATA, dec_data_inc_data,                                      \
+    DEC_DATA, INC_DATA, INVALID_OP)                                            \
+  X(IF_END_IF_END, if_end_if_end,                                              \
+    IF_END, IF_END, INVALID_OP)
+
+constexpr int kMaxSuperinstructionOps = 3;
+
+#define BF_COUNT_SUPERINSTRUCTION(...) +1
+constexpr int kNumSuperinstructions =
+    0 BF_SUPERINSTRUCTIONS(BF_COUNT_SUPERINSTRUCTION);
+#undef BF_COUNT_SUPERINSTRUCTION
+
+extern const BfOpKind kSuperinstructions[][kMaxSuperinstructionOps];
+
+// Gives each op of code that starts a superinstruction the kind kNumOpKinds +
+// its index in kSuperinstructions. The other ops of the run keep their own
+// kinds, so jumps into the middle of it still work.
+void fuse_superinstructions(std::vector<PackedOp>* code);
+
+// Incremental translator from BF source to BfOps. Input can be fed in pieces
+// of any size; runs of repeated commands and bracket matching carry over
+// between pieces, so the result is the same as translating the whole program
+// at once. Only runs are merged and brackets matched; loop idioms and all
+// other rewrites are left to the pass pipeline of optimize() in optimizer.h.
+class Translator {
+public:
+  Translator();
+
+  // Feeds the next size characters of the program; all of them have to be BF
+  // commands.
+  void feed(const char* commands, size_t size);
+
+  // Feeds the next size bytes of raw source; non-command bytes are skipped.
+  void feed_source(const char* source, size_t size);
+
+  // Moves out the ops of all top-level constructs completed so far, i.e.
+  // everything before the outermost loop that's still open. Jump arguments
+  // always index the whole op stream, counting the ops taken earlier.
+  std::vector<BfOp> take_completed();
+
+  // Ends the program and returns the translated ops that haven't been taken
+  // yet. Dies if a '[' is left unmatched.
+  std::vector<BfOp> finish();
+
+private:
+  void flush_run();
+  void close_loop();
+
+  // Ops not taken yet; ops_[i] is op number base_ + i of the program.
+  std::vector<BfOp> ops_;
+  size_t base_;
+
+  // Offsets (in the whole op stream) of open brackets waiting for their
+  // closing bracket, which patches the '[' op's jump argument in close_loop.
+  // outermost_open_ is the bottom of the stack.
+  std::stack<size_t> open_bracket_stack_;
+  size_t outermost_open_;
+
+  // The run of identical non-jump commands seen so far but not yet emitted.
+  // run_char_ is 0 when there's no pending run.
+  char run_char_;
+  size_t run_length_;
+  size_t run_start_;
+
+  // Index of the next command to be fed, counting commands only.
+  size_t pc_;
+};
 
 // Translates the given program into a vector of BfOps that can be used for fast
 // interpretation.
 std::vector<BfOp> translate_program(const Program& p);
 
+// Translates raw BF source (comments included) straight into BfOps, without
+// building an intermediate Program.
+std::vector<BfOp> translate_source(const char* source, size_t size);
+
+// Same as translate_source, but splits the source at top-level loop boundaries
+// and translates the pieces on num_threads threads. The result is identical to
+// translate_source's.
+std::vector<BfOp> translate_source_parallel(const char* source, size_t size,
+                                            unsigned num_threads);
+
+// Maps the BF source file at path and translates it with translate_source, or
+// translate_source_parallel when flags.jobs asks for more than one thread, then
+// optimizes the ops at flags.opt_level. The program is loaded from
+// flags.load_bfo instead when it's set and matches the source, and saved to
+// flags.emit_bfo when that's set. In verbose mode reports the time taken and
+// the front-end throughput.
+OpProgram translate_file(const std::string& path, const Flags& flags);
+
 } // namespace optutils
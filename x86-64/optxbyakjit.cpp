@@ -2,21 +2,30 @@
 //
 // Based on optasmjit by Eli Bendersky [http://eli.thegreenplace.net]
 
-#include <fstream>
+#include <algorithm>
+#include <cstring>
 #include <iomanip>
 #include <stack>
 
 #define XBYAK_NO_OP_NAMES
 #include "xbyak/xbyak.h"
 
+#include "jit_cache.h"
+#include "jit_utils.h"
 #include "optutils.h"
 #include "parser.h"
+#include "streaming.h"
 #include "utils.h"
 
 using namespace optutils;
 
 constexpr int MEMORY_SIZE = 30000;
 
+// Vector scans load 16-cell windows that may overhang the cells they scan by
+// up to 15 cells, and BLOCK_ADD windows may run up to kMaxBlockAddWidth - 1
+// cells past the last cell they change, so the tape is padded on both ends.
+constexpr int MEMORY_PADDING = kMaxBlockAddWidth;
+
 namespace {
 
 // This function will be invoked from JITed code; not using putchar directly
@@ -31,54 +40,436 @@ uint8_t mygetchar() {
   return getchar();
 }
 
+// Copies a TAPE_SNAPSHOT constant to the tape.
+void mymemcpy(uint8_t* dst, const uint8_t* src, uint32_t size) {
+  memcpy(dst, src, size);
+}
+
+// Writes a WRITE_STRING constant; it shares stdout's buffer with myputchar.
+void mywrite(const uint8_t* data, uint32_t size) {
+  fwrite(data, 1, size, stdout);
+}
+
+// Addresses of the host helpers, indexed by HostHelper.
+const void* const kHostHelpers[] = {
+    reinterpret_cast<const void*>(myputchar),
+    reinterpret_cast<const void*>(mygetchar),
+    reinterpret_cast<const void*>(mymemcpy),
+    reinterpret_cast<const void*>(mywrite),
+};
+
+// For LOOP_MOVE_PTR with a stride of +-1, 2, 4 or 8, returns the mask of the
+// lanes the stride lands on in a 16-cell window that starts at the data
+// pointer (going forward) or ends at it (going backward). Returns 0 for other
+// strides, which can't be scanned with vectors.
+uint32_t scan_lanes(int64_t stride) {
+  switch (stride) {
+  case 1:
+  case -1:
+    return 0xFFFF;
+  case 2:
+    return 0x5555;
+  case -2:
+    return 0xAAAA;
+  case 4:
+    return 0x1111;
+  case -4:
+    return 0x8888;
+  case 8:
+    return 0x0101;
+  case -8:
+    return 0x8080;
+  default:
+    return 0;
+  }
+}
+
+// Longest range cleared or copied with unrolled stores; longer ones use
+// rep stosb/movsb.
+constexpr int32_t kMaxUnrolledRange = 256;
+
+// Most cell updates an IF body may have to be emitted without branches.
+constexpr size_t kMaxBranchlessIfOps = 4;
+
+// If the IF_BEGIN at ops[pc] guards nothing but a few cell updates, returns
+// the index of its IF_END; otherwise returns 0.
+size_t branchless_if_end(const std::vector<BfOp>& ops, size_t pc) {
+  for (size_t i = pc + 1; i < ops.size() && i <= pc + 1 + kMaxBranchlessIfOps;
+       ++i) {
+    switch (ops[i].kind) {
+    case BfOpKind::IF_END:
+      return i;
+    case BfOpKind::INC_DATA:
+    case BfOpKind::DEC_DATA:
+    case BfOpKind::SET_DATA:
+    case BfOpKind::LOOP_SET_TO_ZERO:
+      break;
+    default:
+      return 0;
+    }
+  }
+  return 0;
+}
+
+// Number of callee-saved registers that hold the trip counts of counted loops
+// (see OptXbyakJit::counter_reg). Loops nested deeper test their cell instead.
+constexpr int kNumCounterRegs = 4;
+
 struct BracketLabels {
-  BracketLabels(const Xbyak::Label& ol, const Xbyak::Label& cl)
-      : open_label(ol), close_label(cl) {}
+  BracketLabels(const Xbyak::Label& ol, const Xbyak::Label& cl,
+                int counter_param = -1, int num_counters_param = 0)
+      : open_label(ol), close_label(cl), counter(counter_param),
+        num_counters(num_counters_param) {}
 
   Xbyak::Label open_label;
   Xbyak::Label close_label;
+
+  // Index of the counter register holding the loop's trip count, or -1 if
+  // it's not kept in a register; and the number of counter registers in use
+  // inside the loop.
+  int counter;
+  int num_counters;
+};
+
+// Returns the number of counter registers in use by the loops on stack.
+int counters_in_use(const std::stack<BracketLabels>& stack) {
+  return stack.empty() ? 0 : stack.top().num_counters;
+}
+
+// Constant data the code refers to RIP-relatively; it's emitted at label after
+// the code.
+struct EmbeddedConstant {
+  Xbyak::Label label;
+  std::string data;
 };
 
 } // namespace
 
 class OptXbyakJit : public Xbyak::CodeGenerator {
 public:
-  OptXbyakJit() : CodeGenerator(100000) {}
+  OptXbyakJit() : CodeGenerator(100000, Xbyak::AutoGrow) {}
+
+  void run(const std::string& bf_file_path, const Flags& flags) {
+    bool verbose = flags.verbose;
+
+    // A cache hit skips translation and codegen altogether. --emit-bfo needs
+    // the translation, so it turns the cache off.
+    JitCache cache("optxbyakjit", bf_file_path, flags);
+    std::vector<uint8_t> emitted_code;
+    if (!cache.lookup(kHostHelpers, &emitted_code)) {
+      std::vector<Relocation> relocations;
+      emitted_code = compile(bf_file_path, flags, &relocations);
+      cache.store(emitted_code, relocations);
+    }
 
-  void run(const Program& p, bool verbose) {
-    using namespace Xbyak;
+    // Run
 
-    // Initialize state.
-    std::stack<BracketLabels> open_bracket_stack;
+    std::vector<uint8_t> padded_memory(MEMORY_SIZE + 2 * MEMORY_PADDING, 0);
+    uint8_t* memory = padded_memory.data() + MEMORY_PADDING;
 
-    const std::vector<BfOp> ops = translate_program(p);
+    JitProgram jit_program(emitted_code);
+    using JittedFunc = void (*)(uint64_t);
+    JittedFunc func = (JittedFunc)jit_program.program_memory();
+
+    Timer texec;
+
+    // Call it, passing the address of memory as a parameter.
+    func((uint64_t)memory);
 
     if (verbose) {
-      std::cout << "==== OPS ====\n";
-      for (size_t i = 0; i < ops.size(); ++i) {
-        std::cout << std::setw(4) << std::left << i << " ";
-        std::cout << BfOpKind_name(ops[i].kind) << " " << ops[i].argument << "\n";
+      std::cout << "[-] Execution took: " << texec.elapsed() << "s)\n";
+    }
+
+    if (verbose) {
+      const char* filename = "/tmp/bjout.bin";
+      FILE* outfile = fopen(filename, "wb");
+      if (outfile) {
+        size_t n = emitted_code.size();
+        if (fwrite(emitted_code.data(), 1, n, outfile) == n) {
+          std::cout << "* emitted code to " << filename << "\n";
+        }
+        fclose(outfile);
+      }
+
+      std::cout << "* Memory nonzero locations:\n";
+
+      for (size_t i = 0, pcount = 0; i < MEMORY_SIZE; ++i) {
+        if (memory[i]) {
+          std::cout << std::right << "[" << std::setw(3) << i
+                    << "] = " << std::setw(3) << std::left
+                    << static_cast<int32_t>(memory[i]) << "      ";
+          pcount++;
+
+          if (pcount > 0 && pcount % 4 == 0) {
+            std::cout << "\n";
+          }
+        }
       }
-      std::cout << "=============\n";
+      std::cout << "\n";
     }
+  }
 
-    // Initialize asmjit's JIT runtime, code holder and assembler.
+private:
+  // Translates the BF program and compiles it to position-independent machine
+  // code, returning the code. Helper calls are recorded in relocations.
+  std::vector<uint8_t> compile(const std::string& bf_file_path,
+                               const Flags& flags,
+                               std::vector<Relocation>* relocations) {
+    using namespace Xbyak;
+
+    // Initialize state.
+    std::stack<BracketLabels> open_bracket_stack;
+    std::vector<EmbeddedConstant> constants;
+    bool verbose = flags.verbose;
 
     // Registers used in the program:
     //
     // r13: the data pointer
-    // r14 and rax: used temporarily for some instructions
+    // rbx, r12, r14 and r15: trip counts of counted loops
+    // rax and rcx: used temporarily for some instructions
     // rdi: parameter from the host -- the host passes the address of memory
     // here.
 
     const Reg64& dataptr(r13);
 
+    // These are callee-saved in the x64 System V ABI, so save them. Pushing
+    // five registers also leaves the stack 16-byte aligned for helper calls.
+    push(r13);
+    for (int i = 0; i < kNumCounterRegs; ++i) {
+      push(counter_reg(i));
+    }
+
     // We pass the data pointer as an argument to the JITed function, so it's
     // expected to be in rdi. Move it to r13.
     mov(dataptr, rdi);
 
+    // The .bfo flags work on the whole op stream, so they take precedence over
+    // --stream.
+    if (flags.stream && flags.load_bfo.empty() && flags.emit_bfo.empty()) {
+      // Emit each segment as soon as the front end hands it over; reading and
+      // translating the rest of the program continues in the background.
+      Timer tstream;
+      double codegen_time = 0;
+      StreamingFrontEnd front_end(bf_file_path, flags);
+      OpProgram segment;
+      while (front_end.next_segment(&segment)) {
+        Timer tcodegen;
+        emit_ops(segment, &open_bracket_stack, relocations, &constants);
+        codegen_time += tcodegen.elapsed();
+      }
+
+      if (verbose) {
+        front_end.print_timings(std::cout);
+        std::cout << "* stream: codegen " << codegen_time
+                  << "s, compiled code ready after " << tstream.elapsed()
+                  << "s\n";
+      }
+    } else {
+      const OpProgram program = translate_file(bf_file_path, flags);
+
+      if (verbose) {
+        std::cout << "==== OPS ====\n";
+        for (size_t i = 0; i < program.ops.size(); ++i) {
+          std::cout << std::setw(4) << std::left << i << " ";
+          std::cout << BfOp_to_string(program.ops[i]) << "\n";
+        }
+        std::cout << "=============\n";
+      }
+
+      emit_ops(program, &open_bracket_stack, relocations, &constants);
+    }
+
+    for (int i = kNumCounterRegs - 1; i >= 0; --i) {
+      pop(counter_reg(i));
+    }
+    pop(r13);
+    ret();
+
+    for (const EmbeddedConstant& constant : constants) {
+      L(constant.label);
+      for (char c : constant.data) {
+        db(static_cast<uint8_t>(c));
+      }
+    }
+    // The code buffer grows as needed, so labels are only resolved here. All
+    // of them are relative, so the code can then be copied out as is.
+    ready();
+
+    return std::vector<uint8_t>(getCode(), getCode() + getSize());
+  }
+
+  // Returns the i-th register holding trip counts of counted loops, by nesting
+  // depth.
+  const Xbyak::Reg64& counter_reg(int i) const {
+    const Xbyak::Reg64* const regs[kNumCounterRegs] = {&rbx, &r12, &r14, &r15};
+    return *regs[i];
+  }
+
+  // Emits a call to helper. The helper's address is loaded with a movabs
+  // that's listed in relocations, so the code stays valid when it's loaded
+  // from the cache in another process:
+  //
+  //   movabs rax, <helper>
+  //   call rax
+  void emit_helper_call(HostHelper helper,
+                        std::vector<Relocation>* relocations) {
+    db(0x48);
+    db(0xB8);
+    relocations->push_back(
+        Relocation{static_cast<uint32_t>(getSize()), helper});
+    dq(reinterpret_cast<uint64_t>(kHostHelpers[static_cast<size_t>(helper)]));
+    call(rax);
+  }
+
+  // Emits LOOP_MOVE_PTR for a stride scan_lanes accepts, scanning 16 cells at
+  // a time with SSE2:
+  //
+  //   cmpb 0(%r13), 0
+  //   jz done
+  //   pxor xmm1, xmm1
+  // loop:
+  //   movdqu xmm0, [r13]          ; [r13-15] going backward
+  //   pcmpeqb xmm0, xmm1
+  //   pmovmskb eax, xmm0
+  //   and eax, lanes
+  //   jnz found
+  //   add r13, 16                 ; sub going backward
+  //   jmp loop
+  // found:
+  //   bsf eax, eax                ; bsr going backward
+  //   lea r13, [r13+rax]          ; [r13+rax-15] going backward
+  // done:
+  void emit_vector_scan(int64_t stride) {
+    using namespace Xbyak;
+
+    const Reg64& dataptr(r13);
+    bool forward = stride > 0;
+
+    inLocalLabel();
+    cmp(byte[dataptr], 0);
+    jz(".done", T_NEAR);
+    pxor(xmm1, xmm1);
+    L(".loop");
+    movdqu(xmm0, ptr[dataptr + (forward ? 0 : -15)]);
+    pcmpeqb(xmm0, xmm1);
+    pmovmskb(eax, xmm0);
+    and_(eax, scan_lanes(stride));
+    jnz(".found");
+    if (forward) {
+      add(dataptr, 16);
+    } else {
+      sub(dataptr, 16);
+    }
+    jmp(".loop");
+    L(".found");
+    if (forward) {
+      bsf(eax, eax);
+      lea(dataptr, ptr[dataptr + rax]);
+    } else {
+      bsr(eax, eax);
+      lea(dataptr, ptr[dataptr + rax - 15]);
+    }
+    L(".done");
+    outLocalLabel();
+  }
+
+  // Emits MEMSET_RANGE for length cells at offset:
+  //
+  //   pxor xmm0, xmm0                  ; 16 cells or more
+  //   movdqu [r13+offset], xmm0        ; every 16 cells, the last store ending
+  //   ...                              ; at the last cell
+  //
+  //   mov qword [r13+offset], 0        ; 8 to 15 cells (dword for 4 to 7,
+  //   mov qword [r13+offset+length-8], 0  ; bytes below that)
+  //
+  //   lea rdi, [r13+offset]            ; over kMaxUnrolledRange cells
+  //   xor eax, eax
+  //   mov ecx, length
+  //   rep stosb
+  void emit_memset(int32_t offset, int32_t length) {
+    using namespace Xbyak;
+
+    const Reg64& dataptr(r13);
+    if (length > kMaxUnrolledRange) {
+      lea(rdi, ptr[dataptr + offset]);
+      xor_(eax, eax);
+      mov(ecx, length);
+      rep();
+      stosb();
+    } else if (length >= 16) {
+      pxor(xmm0, xmm0);
+      for (int32_t i = 0; i < length; i += 16) {
+        movdqu(ptr[dataptr + (offset + std::min(i, length - 16))], xmm0);
+      }
+    } else if (length >= 8) {
+      mov(qword[dataptr + offset], 0);
+      mov(qword[dataptr + (offset + length - 8)], 0);
+    } else if (length >= 4) {
+      mov(dword[dataptr + offset], 0);
+      mov(dword[dataptr + (offset + length - 4)], 0);
+    } else {
+      for (int32_t i = 0; i < length; ++i) {
+        mov(byte[dataptr + (offset + i)], 0);
+      }
+    }
+  }
+
+  // Emits a copy of length cells from source to destination, which don't
+  // overlap, the way emit_memset clears them: movdqu loads and stores through
+  // xmm0, 8- or 4-byte ones through rax and rcx, or rep movsb from rsi to
+  // rdi.
+  void emit_memcpy(int32_t destination, int32_t source, int32_t length) {
+    using namespace Xbyak;
+
+    const Reg64& dataptr(r13);
+    if (length > kMaxUnrolledRange) {
+      lea(rsi, ptr[dataptr + source]);
+      lea(rdi, ptr[dataptr + destination]);
+      mov(ecx, length);
+      rep();
+      movsb();
+    } else if (length >= 16) {
+      for (int32_t i = 0; i < length; i += 16) {
+        int32_t at = std::min(i, length - 16);
+        movdqu(xmm0, ptr[dataptr + (source + at)]);
+        movdqu(ptr[dataptr + (destination + at)], xmm0);
+      }
+    } else if (length >= 8) {
+      mov(rax, qword[dataptr + source]);
+      mov(rcx, qword[dataptr + (source + length - 8)]);
+      mov(qword[dataptr + destination], rax);
+      mov(qword[dataptr + (destination + length - 8)], rcx);
+    } else if (length >= 4) {
+      mov(eax, dword[dataptr + source]);
+      mov(ecx, dword[dataptr + (source + length - 4)]);
+      mov(dword[dataptr + destination], eax);
+      mov(dword[dataptr + (destination + length - 4)], ecx);
+    } else {
+      for (int32_t i = 0; i < length; ++i) {
+        mov(al, byte[dataptr + (source + i)]);
+        mov(byte[dataptr + (destination + i)], al);
+      }
+    }
+  }
+
+  // Emits code for the ops of program. Brackets left open at the end of the
+  // ops stay on open_bracket_stack, so a program can be emitted in several
+  // pieces. Helper calls are recorded in relocations, and the constants used
+  // in constants.
+  void emit_ops(const OpProgram& program,
+                std::stack<BracketLabels>* open_bracket_stack,
+                std::vector<Relocation>* relocations,
+                std::vector<EmbeddedConstant>* constants) {
+    using namespace Xbyak;
+
+    const Reg64& dataptr(r13);
+    const std::vector<BfOp>& ops = program.ops;
+
     for (size_t pc = 0; pc < ops.size(); ++pc) {
       BfOp op = ops[pc];
+      // The cell data and I/O ops work on, at op.offset from the data
+      // pointer.
+      const Address cell = byte[dataptr + op.offset];
       switch (op.kind) {
       case BfOpKind::INC_PTR:
         add(dataptr, op.argument);
@@ -87,31 +478,94 @@ public:
         sub(dataptr, op.argument);
         break;
       case BfOpKind::INC_DATA:
-        add(byte[dataptr], op.argument);
+        add(cell, op.argument);
         break;
       case BfOpKind::DEC_DATA:
-        sub(byte[dataptr], op.argument);
+        sub(cell, op.argument);
         break;
       case BfOpKind::WRITE_STDOUT:
         for (int i = 0; i < op.argument; ++i) {
-          // call myputchar [dataptr]
-          movzx(rdi, byte[dataptr]);
-          call(myputchar);
+          // call myputchar [dataptr+offset]
+          movzx(rdi, cell);
+          emit_helper_call(HostHelper::PUTCHAR, relocations);
         }
         break;
       case BfOpKind::READ_STDIN:
         for (int i = 0; i < op.argument; ++i) {
-          // [dataptr] = call mygetchar
+          // [dataptr+offset] = call mygetchar
           // Store only the low byte to memory to avoid overwriting unrelated
           // data.
-          call(mygetchar);
-          mov(byte[dataptr], al);
+          emit_helper_call(HostHelper::GETCHAR, relocations);
+          mov(cell, al);
         }
         break;
       case BfOpKind::LOOP_SET_TO_ZERO:
-        mov(byte[dataptr], 0);
+        mov(cell, 0);
         break;
+      case BfOpKind::SET_DATA:
+        mov(cell, static_cast<uint8_t>(op.argument));
+        break;
+      case BfOpKind::TAPE_SNAPSHOT:
+      case BfOpKind::WRITE_STRING: {
+        // The constant is embedded after the code and passed to the helper by
+        // address:
+        //
+        //   lea rdi, [r13+offset]          ; TAPE_SNAPSHOT
+        //   lea rsi, [rip+constant]
+        //   mov edx, size
+        //   call mymemcpy
+        //
+        //   lea rdi, [rip+constant]        ; WRITE_STRING
+        //   mov esi, size
+        //   call mywrite
+        size_t size;
+        const uint8_t* data =
+            get_constant(program.constants, op.argument, &size);
+        constants->push_back(EmbeddedConstant{
+            Label(), std::string(reinterpret_cast<const char*>(data), size)});
+        const Label& label = constants->back().label;
+        if (op.kind == BfOpKind::TAPE_SNAPSHOT) {
+          lea(rdi, ptr[dataptr + op.offset]);
+          lea(rsi, ptr[rip + label]);
+          mov(edx, size);
+          emit_helper_call(HostHelper::MEMCPY, relocations);
+        } else {
+          lea(rdi, ptr[rip + label]);
+          mov(esi, size);
+          emit_helper_call(HostHelper::WRITE, relocations);
+        }
+        break;
+      }
+      case BfOpKind::BLOCK_ADD: {
+        // The deltas are embedded after the code and added 16 cells at a
+        // time:
+        //
+        //   movdqu xmm0, [r13+offset]
+        //   movdqu xmm1, [constant]
+        //   paddb xmm0, xmm1
+        //   movdqu [r13+offset], xmm0
+        //   ...                              ; at +16 for a 32-cell window
+        size_t size;
+        const uint8_t* data =
+            get_constant(program.constants, op.argument, &size);
+        constants->push_back(EmbeddedConstant{
+            Label(), std::string(reinterpret_cast<const char*>(data), size)});
+        const Label& label = constants->back().label;
+        for (int32_t i = 0; i < static_cast<int32_t>(size); i += 16) {
+          const Address cells = ptr[dataptr + (op.offset + i)];
+          movdqu(xmm0, cells);
+          movdqu(xmm1, ptr[rip + label + i]);
+          paddb(xmm0, xmm1);
+          movdqu(cells, xmm0);
+        }
+        break;
+      }
       case BfOpKind::LOOP_MOVE_PTR: {
+        if (scan_lanes(op.argument)) {
+          emit_vector_scan(op.argument);
+          break;
+        }
+
         // Emit a loop that moves the pointer in jumps of op.argument; it's
         // important to do an equivalent of while(...) rather than do...while(...)
         // here so that we don't do the first pointer change if already pointing
@@ -138,32 +592,213 @@ public:
         break;
       }
       case BfOpKind::LOOP_MOVE_DATA: {
-        // Only move if the current data isn't 0:
+        // Only move if the data at offset isn't 0:
         //
-        //   cmpb 0(%r13), 0
+        //   cmpb offset(%r13), 0
         //   jz skip_move
         //   <...> move data
         // skip_move:
         inLocalLabel();
-        cmp(byte[dataptr], 0);
+        cmp(cell, 0);
         jz(".skip_move");
 
-        mov(r14, dataptr);
-        if (op.argument < 0) {
-          sub(r14, -op.argument);
-        } else {
-          add(r14, op.argument);
-        }
         // Use rax as a temporary holding the value of at the original pointer;
         // then use al to add it to the new location, so that only the target
-        // location is affected: addb %al, 0(%r13)
-        movzx(rax, byte[dataptr]);
-        add(byte[r14], al);
-        mov(byte[dataptr], 0);
+        // location is affected: addb %al, (offset+argument)(%r13)
+        movzx(rax, cell);
+        add(byte[dataptr + (op.offset + op.argument)], al);
+        mov(cell, 0);
         L(".skip_move");
         outLocalLabel();
         break;
       }
+      case BfOpKind::LOOP_MUL_ADD: {
+        // Only run if the data at offset isn't 0; the count stays in eax and
+        // each operand adds a multiple of it to its target:
+        //
+        //   movzx eax, byte [r13+offset]
+        //   test al, al
+        //   jz skip
+        //   add byte [r13+target], al        ; multiplier 1
+        //   sub byte [r13+target], al        ; multiplier -1
+        //   imul ecx, eax, multiplier        ; other multipliers
+        //   add byte [r13+target], cl
+        //   ...
+        //   mov byte [r13+offset], 0
+        // skip:
+        inLocalLabel();
+        movzx(eax, cell);
+        test(al, al);
+        jz(".skip", T_NEAR);
+        for (int64_t i = 1; i <= op.argument; ++i) {
+          const BfOp& operand = ops[pc + i];
+          const Address target = byte[dataptr + (op.offset + operand.offset)];
+          if (operand.argument == 1) {
+            add(target, al);
+          } else if (operand.argument == -1) {
+            sub(target, al);
+          } else {
+            imul(ecx, eax, static_cast<int>(operand.argument));
+            add(target, cl);
+          }
+        }
+        mov(cell, 0);
+        L(".skip");
+        outLocalLabel();
+        pc += op.argument;
+        break;
+      }
+      case BfOpKind::MUL_ADD_OPERAND:
+        DIE << "MUL_ADD_OPERAND outside of LOOP_MUL_ADD on pc=" << pc;
+        break;
+      case BfOpKind::LOOP_CLOSED_FORM: {
+        // Only run if the data at offset isn't 0. ecx holds n - 1, and the
+        // new value of each target is summed up in edx and pushed, since
+        // later targets may still need the old values; the values are then
+        // popped into their cells in reverse:
+        //
+        //   movzx ecx, byte [r13+offset]
+        //   test ecx, ecx
+        //   jz skip
+        //   dec ecx
+        //   xor edx, edx                     ; for each target
+        //   imul eax, ecx, step              ; for each term
+        //   add eax, base
+        //   movzx esi, byte [r13+source]     ; the term's cell, unless constant
+        //   imul eax, esi
+        //   add edx, eax
+        //   ...
+        //   push rdx
+        //   ...
+        //   pop rax                          ; for each target, last first
+        //   mov byte [r13+target], al
+        //   ...
+        //   mov byte [r13+offset], 0
+        // skip:
+        inLocalLabel();
+        movzx(ecx, cell);
+        test(ecx, ecx);
+        jz(".skip", T_NEAR);
+        dec(ecx);
+        std::vector<int32_t> targets;
+        for (int64_t i = 1; i <= op.argument; ++i) {
+          const BfOp& term_op = ops[pc + i];
+          ClosedFormTerm term = decode_closed_form_term(term_op.argument);
+          if (targets.empty() || targets.back() != term_op.offset) {
+            targets.push_back(term_op.offset);
+            xor_(edx, edx);
+          }
+          if (term.step) {
+            imul(eax, ecx, term.step);
+            add(eax, term.base);
+          } else {
+            mov(eax, term.base);
+          }
+          if (!term.is_constant) {
+            movzx(esi, byte[dataptr + (op.offset + term.source)]);
+            imul(eax, esi);
+          }
+          add(edx, eax);
+          if (i == op.argument || ops[pc + i + 1].offset != term_op.offset) {
+            push(rdx);
+          }
+        }
+        for (auto it = targets.rbegin(); it != targets.rend(); ++it) {
+          pop(rax);
+          mov(byte[dataptr + (op.offset + *it)], al);
+        }
+        mov(cell, 0);
+        L(".skip");
+        outLocalLabel();
+        pc += op.argument;
+        break;
+      }
+      case BfOpKind::CLOSED_FORM_TERM:
+        DIE << "CLOSED_FORM_TERM outside of LOOP_CLOSED_FORM on pc=" << pc;
+        break;
+      case BfOpKind::DIVMOD: {
+        // Checks the preconditions, jumping to skip (where the original loop
+        // follows) if one fails, then divides with eax = n, ecx = d and
+        // adds the results up in r8d for each target:
+        //
+        //   movzx eax, byte [r13+offset]
+        //   movzx ecx, byte [r13+divisor]    ; mov ecx, divisor if constant
+        //   cmp eax, below                   ; for each DIVIDEND_BELOW
+        //   jae skip
+        //   cmp byte [r13+cell], 0           ; for each ZERO_CELL
+        //   jne skip
+        //   cmp ecx, 2
+        //   jb skip
+        //   mov esi, eax
+        //   xor edx, edx
+        //   div ecx                          ; eax = n / d, edx = n % d
+        //   xor r8d, r8d                     ; for each ADD_RESULT
+        //   imul r9d, esi, dividend          ; for each nonzero coefficient
+        //   add r8d, r9d
+        //   ...
+        //   add byte [r13+target], r8b
+        //   ...
+        //   mov byte [r13+offset], 0
+        // skip:
+        inLocalLabel();
+        movzx(eax, cell);
+        for (int64_t i = 1; i <= op.argument; ++i) {
+          const BfOp& operand_op = ops[pc + i];
+          DivmodOperand operand = decode_divmod_operand(operand_op.argument);
+          const Address operand_cell =
+              byte[dataptr + (op.offset + operand_op.offset)];
+          switch (operand.role) {
+          case DivmodOperand::Role::DIVISOR_CELL:
+            movzx(ecx, operand_cell);
+            break;
+          case DivmodOperand::Role::DIVISOR_CONSTANT:
+            mov(ecx, operand.value);
+            break;
+          case DivmodOperand::Role::DIVIDEND_BELOW:
+            cmp(eax, operand.value);
+            jae(".skip", T_NEAR);
+            break;
+          case DivmodOperand::Role::ZERO_CELL:
+            cmp(operand_cell, 0);
+            jne(".skip", T_NEAR);
+            break;
+          case DivmodOperand::Role::ADD_RESULT:
+            break;
+          }
+        }
+        cmp(ecx, 2);
+        jb(".skip", T_NEAR);
+        mov(esi, eax);
+        xor_(edx, edx);
+        div(ecx);
+        for (int64_t i = 1; i <= op.argument; ++i) {
+          const BfOp& operand_op = ops[pc + i];
+          DivmodOperand operand = decode_divmod_operand(operand_op.argument);
+          if (operand.role != DivmodOperand::Role::ADD_RESULT) {
+            continue;
+          }
+          xor_(r8d, r8d);
+          const std::pair<Xbyak::Reg32, int8_t> terms[] = {
+              {esi, operand.dividend},
+              {edx, operand.remainder},
+              {eax, operand.quotient}};
+          for (const auto& term : terms) {
+            if (term.second) {
+              imul(r9d, term.first, term.second);
+              add(r8d, r9d);
+            }
+          }
+          add(byte[dataptr + (op.offset + operand_op.offset)], r8b);
+        }
+        mov(cell, 0);
+        L(".skip");
+        outLocalLabel();
+        pc += op.argument;
+        break;
+      }
+      case BfOpKind::DIVMOD_OPERAND:
+        DIE << "DIVMOD_OPERAND outside of DIVMOD on pc=" << pc;
+        break;
       case BfOpKind::JUMP_IF_DATA_ZERO: {
         cmp(byte[dataptr], 0);
         Label open_label;
@@ -183,16 +818,17 @@ public:
         L(open_label);
 
         // Save both labels on the stack.
-        open_bracket_stack.push(BracketLabels(open_label, close_label));
+        open_bracket_stack->push(BracketLabels(
+            open_label, close_label, -1, counters_in_use(*open_bracket_stack)));
         break;
       }
       case BfOpKind::JUMP_IF_DATA_NOT_ZERO: {
         // These ops have to be properly nested!
-        if (open_bracket_stack.empty()) {
+        if (open_bracket_stack->empty()) {
           DIE << "unmatched closing ']' at pc=" << pc;
         }
-        BracketLabels labels = open_bracket_stack.top();
-        open_bracket_stack.pop();
+        BracketLabels labels = open_bracket_stack->top();
+        open_bracket_stack->pop();
 
         //    cmpb 0(%r13), 0
         //    jnz open_label
@@ -203,89 +839,181 @@ public:
         L(labels.close_label);
         break;
       }
-      case BfOpKind::INVALID_OP:
-        DIE << "INVALID_OP encountered on pc=" << pc;
+      case BfOpKind::COUNTED_LOOP_BEGIN: {
+        // The trip count is loaded into the next free counter register:
+        //
+        //    movzx rbx, byte [r13]
+        //    test rbx, rbx
+        //    jz close_label
+        // open_label:
+        //    ...
+        //
+        // With no register free, it's emitted like JUMP_IF_DATA_ZERO.
+        int num_counters = counters_in_use(*open_bracket_stack);
+        Label open_label;
+        Label close_label;
+        if (num_counters < kNumCounterRegs) {
+          const Reg64& counter = counter_reg(num_counters);
+          movzx(counter, byte[dataptr]);
+          test(counter, counter);
+          jz(close_label, T_NEAR);
+          L(open_label);
+          open_bracket_stack->push(BracketLabels(
+              open_label, close_label, num_counters, num_counters + 1));
+        } else {
+          cmp(byte[dataptr], 0);
+          jz(close_label, T_NEAR);
+          L(open_label);
+          open_bracket_stack->push(
+              BracketLabels(open_label, close_label, -1, num_counters));
+        }
         break;
       }
-    }
-
-    ret();
-
-    // Run
-
-    std::vector<uint8_t> memory(MEMORY_SIZE, 0);
-
-    auto func = get();
-
-    Timer texec;
-
-    // Call it, passing the address of memory as a parameter.
-    func((uint64_t)memory.data());
-
-    if (verbose) {
-      std::cout << "[-] Execution took: " << texec.elapsed() << "s)\n";
-    }
+      case BfOpKind::COUNTED_LOOP_END: {
+        if (open_bracket_stack->empty()) {
+          DIE << "unmatched closing ']' at pc=" << pc;
+        }
+        BracketLabels labels = open_bracket_stack->top();
+        open_bracket_stack->pop();
 
-    if (verbose) {
-      const char* filename = "/tmp/bjout.bin";
-      FILE* outfile = fopen(filename, "wb");
-      if (outfile) {
-        size_t n = getSize();
-        if (fwrite(static_cast<const void*>(getCode()), 1, n, outfile) == n) {
-          std::cout << "* emitted code to " << filename << "\n";
+        // The back-edge counts down the register instead of reading the
+        // cell:
+        //
+        //    dec rbx
+        //    jnz open_label
+        // close_label:
+        if (labels.counter >= 0) {
+          dec(counter_reg(labels.counter));
+        } else {
+          cmp(byte[dataptr], 0);
         }
-        fclose(outfile);
+        jnz(labels.open_label, T_NEAR);
+        L(labels.close_label);
+        break;
       }
-
-      std::cout << "* Memory nonzero locations:\n";
-
-      for (size_t i = 0, pcount = 0; i < memory.size(); ++i) {
-        if (memory[i]) {
-          std::cout << std::right << "[" << std::setw(3) << i
-                    << "] = " << std::setw(3) << std::left
-                    << static_cast<int32_t>(memory[i]) << "      ";
-          pcount++;
-
-          if (pcount > 0 && pcount % 4 == 0) {
-            std::cout << "\n";
+      case BfOpKind::IF_BEGIN: {
+        // The body of a small IF is run unconditionally on a mask of the
+        // cell's test, so there's no branch to mispredict:
+        //
+        //    cmp byte [r13], 0
+        //    setne al
+        //    movzx eax, al
+        //    neg eax                          ; -1 if the body runs, else 0
+        //    mov ecx, delta                   ; INC_DATA/DEC_DATA
+        //    and ecx, eax
+        //    add byte [r13+offset], cl
+        //    movzx ecx, byte [r13+offset]     ; SET_DATA/LOOP_SET_TO_ZERO
+        //    xor ecx, value
+        //    and ecx, eax
+        //    xor byte [r13+offset], cl
+        //
+        // Other IFs are emitted like JUMP_IF_DATA_ZERO, and their IF_END
+        // only binds close_label.
+        size_t end = branchless_if_end(ops, pc);
+        if (end) {
+          cmp(byte[dataptr], 0);
+          setne(al);
+          movzx(eax, al);
+          neg(eax);
+          for (size_t i = pc + 1; i < end; ++i) {
+            const BfOp& update = ops[i];
+            const Address target = byte[dataptr + update.offset];
+            if (update.kind == BfOpKind::INC_DATA ||
+                update.kind == BfOpKind::DEC_DATA) {
+              uint8_t delta = update.kind == BfOpKind::INC_DATA
+                                  ? update.argument
+                                  : -update.argument;
+              mov(ecx, delta);
+              and_(ecx, eax);
+              add(target, cl);
+            } else {
+              uint8_t value =
+                  update.kind == BfOpKind::SET_DATA ? update.argument : 0;
+              movzx(ecx, target);
+              xor_(ecx, value);
+              and_(ecx, eax);
+              xor_(target, cl);
+            }
           }
+          pc = end;
+          break;
         }
+        Label open_label;
+        Label close_label;
+        cmp(byte[dataptr], 0);
+        jz(close_label, T_NEAR);
+        L(open_label);
+        open_bracket_stack->push(BracketLabels(
+            open_label, close_label, -1, counters_in_use(*open_bracket_stack)));
+        break;
+      }
+      case BfOpKind::IF_END: {
+        if (open_bracket_stack->empty()) {
+          DIE << "unmatched closing ']' at pc=" << pc;
+        }
+        L(open_bracket_stack->top().close_label);
+        open_bracket_stack->pop();
+        break;
+      }
+      case BfOpKind::MEMSET_RANGE:
+        emit_memset(op.offset, static_cast<int32_t>(op.argument));
+        break;
+      case BfOpKind::MEMMOVE_RANGE: {
+        MemmoveRange range = decode_memmove_range(op.argument);
+        int32_t length = static_cast<int32_t>(range.length);
+        emit_memcpy(op.offset + range.distance, op.offset, length);
+        emit_memset(op.offset, length);
+        break;
+      }
+      case BfOpKind::LOOP_SCAN_CLEAR: {
+        // Scans for the zero cell with vectors from rdx = the start, then
+        // clears the cells passed:
+        //
+        //   mov rdx, r13
+        //   <vector scan>
+        //   mov rdi, rdx                     ; lea rdi, [r13+1] going backward
+        //   mov rcx, r13                     ; mov rcx, rdx
+        //   sub rcx, rdx                     ; sub rcx, r13
+        //   xor eax, eax
+        //   rep stosb
+        mov(rdx, dataptr);
+        emit_vector_scan(op.argument);
+        if (op.argument > 0) {
+          mov(rdi, rdx);
+          mov(rcx, dataptr);
+          sub(rcx, rdx);
+        } else {
+          lea(rdi, ptr[dataptr + 1]);
+          mov(rcx, rdx);
+          sub(rcx, dataptr);
+        }
+        xor_(eax, eax);
+        rep();
+        stosb();
+        break;
+      }
+      case BfOpKind::INVALID_OP:
+        DIE << "INVALID_OP encountered on pc=" << pc;
+        break;
       }
-      std::cout << "\n";
     }
   }
-
-private:
-  void (*get() const)(uint64_t) { return getCode<void(*)(uint64_t)>(); }
 };
 
 int main(int argc, const char** argv) {
-  bool verbose = false;
+  Flags flags;
   std::string bf_file_path;
-  parse_command_line(argc, argv, &bf_file_path, &verbose);
-
-  Timer t1;
-  std::ifstream file(bf_file_path);
-  if (!file) {
-    DIE << "unable to open file " << bf_file_path;
-  }
-  Program program = parse_from_stream(file);
-
-  if (verbose) {
-    std::cout << "Parsing took: " << t1.elapsed() << "s\n";
-    std::cout << "Length of program: " << program.instructions.size() << "\n";
-    std::cout << "Program:\n" << program.instructions << "\n";
-  }
+  parse_command_line(argc, argv, &bf_file_path, &flags);
 
-  if (verbose) {
+  if (flags.verbose) {
     std::cout << "[>] Running optasmjit:\n";
   }
 
   Timer t2;
   OptXbyakJit j;
-  j.run(program, verbose);
+  j.run(bf_file_path, flags);
 
-  if (verbose) {
+  if (flags.verbose) {
     std::cout << "[<] Done (elapsed: " << t2.elapsed() << "s)\n";
   }
 
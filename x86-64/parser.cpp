@@ -9,18 +9,151 @@
 #include "utils.h"
 
 #include <iostream>
+#include <algorithm>
 #include <sstream>
 
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+namespace {
+
+bool is_command(char c) {
+  return c == '>' || c == '<' || c == '+' || c == '-' || c == '.' ||
+         c == ',' || c == '[' || c == ']';
+}
+
+size_t filter_commands_scalar(const char* src, size_t size, char* dst) {
+  size_t n = 0;
+  for (size_t i = 0; i < size; ++i) {
+    char c = src[i];
+    dst[n] = c;
+    n += is_command(c);
+  }
+  return n;
+}
+
+#if defined(__x86_64__)
+
+// Appends the bytes of block selected by mask to dst. The whole block has
+// already been loaded, so dst may overlap it.
+inline size_t compact_block(const char* block, uint32_t mask, char* dst) {
+  size_t n = 0;
+  while (mask) {
+    dst[n++] = block[__builtin_ctz(mask)];
+    mask &= mask - 1;
+  }
+  return n;
+}
+
+// The eight commands are '+' ',' '-' '.' (the contiguous range 0x2B-0x2E) plus
+// '<' '>' '[' ']'; the range is tested with a single unsigned min/compare.
+__attribute__((target("avx2")))
+size_t filter_commands_avx2(const char* src, size_t size, char* dst) {
+  const __m256i range_lo = _mm256_set1_epi8(0x2B);
+  const __m256i range_len = _mm256_set1_epi8(3);
+  const __m256i lt = _mm256_set1_epi8('<');
+  const __m256i gt = _mm256_set1_epi8('>');
+  const __m256i lbracket = _mm256_set1_epi8('[');
+  const __m256i rbracket = _mm256_set1_epi8(']');
+
+  size_t n = 0;
+  size_t i = 0;
+  for (; i + 32 <= size; i += 32) {
+    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+    __m256i d = _mm256_sub_epi8(v, range_lo);
+    __m256i m = _mm256_cmpeq_epi8(_mm256_min_epu8(d, range_len), d);
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, lt));
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, gt));
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, lbracket));
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, rbracket));
+    uint32_t mask = _mm256_movemask_epi8(m);
+
+    if (mask == 0xFFFFFFFF) {
+      _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + n), v);
+      n += 32;
+    } else if (mask) {
+      char block[32];
+      _mm256_storeu_si256(reinterpret_cast<__m256i*>(block), v);
+      n += compact_block(block, mask, dst + n);
+    }
+  }
+  return n + filter_commands_scalar(src + i, size - i, dst + n);
+}
+
+__attribute__((target("sse4.2")))
+size_t filter_commands_sse42(const char* src, size_t size, char* dst) {
+  const __m128i set = _mm_setr_epi8('>', '<', '+', '-', '.', ',', '[', ']', 0,
+                                    0, 0, 0, 0, 0, 0, 0);
+
+  size_t n = 0;
+  size_t i = 0;
+  for (; i + 16 <= size; i += 16) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+    // Explicit lengths, so that NUL bytes in the source don't terminate the
+    // comparison early.
+    __m128i m = _mm_cmpestrm(set, 8, v, 16,
+                             _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY |
+                                 _SIDD_BIT_MASK);
+    uint32_t mask = _mm_cvtsi128_si32(m) & 0xFFFF;
+
+    if (mask == 0xFFFF) {
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + n), v);
+      n += 16;
+    } else if (mask) {
+      char block[16];
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(block), v);
+      n += compact_block(block, mask, dst + n);
+    }
+  }
+  return n + filter_commands_scalar(src + i, size - i, dst + n);
+}
+
+#endif // __x86_64__
+
+} // namespace
+
+size_t filter_commands(const char* src, size_t size, char* dst) {
+#if defined(__x86_64__)
+  static const bool has_avx2 = __builtin_cpu_supports("avx2");
+  static const bool has_sse42 = __builtin_cpu_supports("sse4.2");
+  if (has_avx2) {
+    return filter_commands_avx2(src, size, dst);
+  } else if (has_sse42) {
+    return filter_commands_sse42(src, size, dst);
+  }
+#endif
+  return filter_commands_scalar(src, size, dst);
+}
+
 Program parse_from_stream(std::istream& stream) {
   Program program;
 
   for (std::string line; std::getline(stream, line);) {
+    program.source_size += line.size() + 1;
     for (auto c : line) {
-      if (c == '>' || c == '<' || c == '+' || c == '-' || c == '.' ||
-          c == ',' || c == '[' || c == ']') {
+      if (is_command(c)) {
         program.instructions.push_back(c);
       }
     }
   }
   return program;
 }
+
+Program parse_from_file(const std::string& path) {
+  MappedFile file(path);
+  Program program;
+  program.source_size = file.size();
+
+  // The capacity is only reserved, not touched, so a mostly-comment source
+  // doesn't cost its full size in resident memory. Filtering goes through a
+  // small buffer that stays in L1.
+  program.instructions.reserve(file.size());
+  char chunk[16 * 1024];
+  for (size_t pos = 0; pos < file.size(); pos += sizeof(chunk)) {
+    size_t len = std::min(sizeof(chunk), file.size() - pos);
+    size_t n = filter_commands(file.data() + pos, len, chunk);
+    program.instructions.append(chunk, n);
+  }
+  return program;
+}
@@ -5,15 +5,32 @@
 #ifndef PARSER_H
 #define PARSER_H
 
+#include <cstddef>
 #include <iostream>
 #include <string>
 
 struct Program {
   std::string instructions;
+
+  // Size in bytes of the source the instructions were collected from
+  // (including comments and whitespace). Only used for reporting.
+  size_t source_size = 0;
 };
 
 // Parses a BF program from an input stream. Returns a Program if successful; on
 // error, dies with an error message.
 Program parse_from_stream(std::istream& stream);
 
+// Parses a BF program from the file at path. The file is mapped into memory and
+// filtered in a single pass with filter_commands, which is much faster than
+// parse_from_stream for large sources. Dies with an error message if the file
+// can't be read.
+Program parse_from_file(const std::string& path);
+
+// Copies the BF command characters found in src[0..size) to dst, preserving
+// their order, and returns how many were copied. dst must have room for size
+// characters; it may be the same buffer as src. Uses AVX2 or SSE4.2 to classify
+// 32 or 16 bytes at a time when the CPU supports them.
+size_t filter_commands(const char* src, size_t size, char* dst);
+
 #endif /* PARSER_H */
@@ -2,13 +2,13 @@
 //
 // Based on simpleasmjit by Eli Bendersky [http://eli.thegreenplace.net]
 #include <cstdint>
-#include <fstream>
 #include <iomanip>
 #include <iostream>
 #include <memory>
 #include <sstream>
 #include <vector>
 
+#include "bfio.h"
 #include "parser.h"
 #include "utils.h"
 
@@ -59,10 +59,10 @@ void simpledt(const Program& p, bool verbose) {
     memory[dataptr]--;
     JUMP_TO_NEXT;
   READ_STDIN:
-    std::cout.put(memory[dataptr]);
+    BfIO::put(memory[dataptr]);
     JUMP_TO_NEXT;
   WRITE_STDOUT:
-    memory[dataptr] = std::cin.get();
+    memory[dataptr] = BfIO::get();
     JUMP_TO_NEXT;
   JUMP_IF_DATA_ZERO:
     if (memory[dataptr] == 0) {
@@ -109,6 +109,7 @@ void simpledt(const Program& p, bool verbose) {
     JUMP_TO_NEXT;
   }
   HALT:
+  BfIO::flush();
 
   // Done running the program. Dump state if verbose.
   if (verbose) {
@@ -138,14 +139,12 @@ int main(int argc, const char** argv) {
   parse_command_line(argc, argv, &bf_file_path, &verbose);
 
   Timer t1;
-  std::ifstream file(bf_file_path);
-  if (!file) {
-    DIE << "unable to open file " << bf_file_path;
-  }
-  Program program = parse_from_stream(file);
+  Program program = parse_from_file(bf_file_path);
 
   if (verbose) {
-    std::cout << "Parsing took: " << t1.elapsed() << "s\n";
+    double parse_time = t1.elapsed();
+    std::cout << "Parsing took: " << parse_time << "s ("
+              << program.source_size / parse_time / 1e6 << " MB/s)\n";
     std::cout << "Length of program: " << program.instructions.size() << "\n";
     std::cout << "Program:\n" << program.instructions << "\n";
   }
@@ -3,13 +3,13 @@
 // Eli Bendersky [http://eli.thegreenplace.net]
 // This code is in the public domain.
 #include <cstdint>
-#include <fstream>
 #include <iomanip>
 #include <iostream>
 #include <memory>
 #include <sstream>
 #include <vector>
 
+#include "bfio.h"
 #include "parser.h"
 #include "utils.h"
 
@@ -37,10 +37,10 @@ void simpleinterp(const Program& p, bool verbose) {
       memory[dataptr]--;
       break;
     case '.':
-      std::cout.put(memory[dataptr]);
+      BfIO::put(memory[dataptr]);
       break;
     case ',':
-      memory[dataptr] = std::cin.get();
+      memory[dataptr] = BfIO::get();
       break;
     case '[':
       if (memory[dataptr] == 0) {
@@ -88,6 +88,7 @@ void simpleinterp(const Program& p, bool verbose) {
 
     pc++;
   }
+  BfIO::flush();
 
   // Done running the program. Dump state if verbose.
   if (verbose) {
@@ -117,14 +118,12 @@ int main(int argc, const char** argv) {
   parse_command_line(argc, argv, &bf_file_path, &verbose);
 
   Timer t1;
-  std::ifstream file(bf_file_path);
-  if (!file) {
-    DIE << "unable to open file " << bf_file_path;
-  }
-  Program program = parse_from_stream(file);
+  Program program = parse_from_file(bf_file_path);
 
   if (verbose) {
-    std::cout << "Parsing took: " << t1.elapsed() << "s\n";
+    double parse_time = t1.elapsed();
+    std::cout << "Parsing took: " << parse_time << "s ("
+              << program.source_size / parse_time / 1e6 << " MB/s)\n";
     std::cout << "Length of program: " << program.instructions.size() << "\n";
     std::cout << "Program:\n" << program.instructions << "\n";
   }
@@ -4,7 +4,6 @@
 // Eli Bendersky [http://eli.thegreenplace.net]
 // This code is in the public domain.
 #include <cstdio>
-#include <fstream>
 #include <iomanip>
 #include <stack>
 
@@ -187,14 +186,12 @@ int main(int argc, const char** argv) {
   parse_command_line(argc, argv, &bf_file_path, &verbose);
 
   Timer t1;
-  std::ifstream file(bf_file_path);
-  if (!file) {
-    DIE << "unable to open file " << bf_file_path;
-  }
-  Program program = parse_from_stream(file);
+  Program program = parse_from_file(bf_file_path);
 
   if (verbose) {
-    std::cout << "Parsing took: " << t1.elapsed() << "s\n";
+    double parse_time = t1.elapsed();
+    std::cout << "Parsing took: " << parse_time << "s ("
+              << program.source_size / parse_time / 1e6 << " MB/s)\n";
     std::cout << "Length of program: " << program.instructions.size() << "\n";
     std::cout << "Program:\n" << program.instructions << "\n";
   }
@@ -0,0 +1,110 @@
+// Streaming front end for the optimizing JITs.
+#include "streaming.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "utils.h"
+
+namespace optutils {
+
+namespace {
+
+constexpr size_t kChunkSize = 256 * 1024;
+constexpr size_t kMaxQueuedChunks = 8;
+constexpr size_t kMaxQueuedSegments = 64;
+
+} // namespace
+
+StreamingFrontEnd::StreamingFrontEnd(const std::string& path,
+                                     const Flags& flags)
+  : chunks_(kMaxQueuedChunks), segments_(kMaxQueuedSegments),
+    pass_manager_(flags), read_time_(0), translate_time_(0), bytes_read_(0)
+{
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    DIE << "unable to open file " << path;
+  }
+  reader_ = std::thread(&StreamingFrontEnd::read_chunks, this, fd);
+  translator_ = std::thread(&StreamingFrontEnd::translate_chunks, this);
+}
+
+StreamingFrontEnd::~StreamingFrontEnd() {
+  // Drain whatever the consumer didn't take so the stages can't stay blocked
+  // on a full queue.
+  OpProgram segment;
+  while (segments_.pop(&segment)) {
+  }
+  translator_.join();
+  reader_.join();
+}
+
+bool StreamingFrontEnd::next_segment(OpProgram* segment) {
+  return segments_.pop(segment);
+}
+
+void StreamingFrontEnd::print_timings(std::ostream& os) const {
+  os << "* stream: read " << read_time_ << "s (" << bytes_read_
+     << " bytes), translate " << translate_time_ << "s\n";
+  pass_manager_.print_stats(os);
+}
+
+void StreamingFrontEnd::read_chunks(int fd) {
+  for (;;) {
+    Timer t;
+    std::vector<char> chunk(kChunkSize);
+    ssize_t n = read(fd, chunk.data(), chunk.size());
+    read_time_ += t.elapsed();
+    if (n < 0) {
+      DIE << "unable to read BF source";
+    }
+    if (n == 0) {
+      break;
+    }
+    bytes_read_ += n;
+    chunk.resize(n);
+    chunks_.push(std::move(chunk));
+  }
+  close(fd);
+  chunks_.close();
+}
+
+void StreamingFrontEnd::translate_chunks() {
+  Translator translator;
+  // Segments are optimized on their own, so jumps are relinked against the
+  // number of ops handed out so far. Only the first segment starts on a fresh
+  // tape.
+  size_t num_ops = 0;
+  auto push_segment = [&](const std::vector<BfOp>& segment) {
+    if (!segment.empty()) {
+      Timer t;
+      IrProgram program;
+      program.at_start = num_ops == 0;
+      lift(segment, &program);
+      pass_manager_.run(&program);
+      OpProgram optimized;
+      optimized.ops = lower(program, num_ops);
+      optimized.constants = std::move(program.constants);
+      translate_time_ += t.elapsed();
+      num_ops += optimized.ops.size();
+      segments_.push(std::move(optimized));
+    }
+  };
+
+  std::vector<char> chunk;
+  while (chunks_.pop(&chunk)) {
+    Timer t;
+    translator.feed_source(chunk.data(), chunk.size());
+    std::vector<BfOp> segment = translator.take_completed();
+    translate_time_ += t.elapsed();
+    push_segment(segment);
+  }
+
+  Timer t;
+  std::vector<BfOp> segment = translator.finish();
+  translate_time_ += t.elapsed();
+  push_segment(segment);
+  segments_.close();
+}
+
+} // namespace optutils
@@ -0,0 +1,105 @@
+// Streaming front end for the optimizing JITs.
+//
+// A reader thread reads the source file in chunks and a translator thread turns
+// them into BfOps, handing out every run of completed top-level constructs as
+// soon as it's available. The stages are connected by bounded queues, so the
+// code generator can start on the beginning of a large program while the rest
+// is still being read and translated.
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "optimizer.h"
+#include "optutils.h"
+
+namespace optutils {
+
+// A FIFO queue shared between a producer and a consumer thread. push blocks
+// while the queue holds capacity items; pop blocks while it's empty.
+template <typename T>
+class BoundedQueue {
+public:
+  explicit BoundedQueue(size_t capacity) : capacity_(capacity), closed_(false) {}
+
+  void push(T item) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    not_full_.wait(lock, [this] { return items_.size() < capacity_; });
+    items_.push_back(std::move(item));
+    not_empty_.notify_one();
+  }
+
+  // Called by the producer after its last push.
+  void close() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    closed_ = true;
+    not_empty_.notify_one();
+  }
+
+  // Takes the oldest item into *item. Returns false once the queue is closed
+  // and drained.
+  bool pop(T* item) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    not_empty_.wait(lock, [this] { return !items_.empty() || closed_; });
+    if (items_.empty()) {
+      return false;
+    }
+    *item = std::move(items_.front());
+    items_.pop_front();
+    not_full_.notify_one();
+    return true;
+  }
+
+private:
+  std::mutex mutex_;
+  std::condition_variable not_empty_;
+  std::condition_variable not_full_;
+  std::deque<T> items_;
+  size_t capacity_;
+  bool closed_;
+};
+
+class StreamingFrontEnd {
+public:
+  // Starts the reader and translator threads on the file at path. Segments
+  // are optimized at flags.opt_level before they're handed out.
+  StreamingFrontEnd(const std::string& path, const Flags& flags);
+  ~StreamingFrontEnd();
+
+  // Blocks until the next segment is available and moves it into *segment.
+  // Segments come in program order and never split a loop; their jump
+  // arguments index the whole op stream, while each has its own constant
+  // pool. Returns false after the last segment.
+  bool next_segment(OpProgram* segment);
+
+  // Prints the busy time of the reader and translator stages, and the pass
+  // statistics summed over all segments.
+  void print_timings(std::ostream& os) const;
+
+private:
+  StreamingFrontEnd(const StreamingFrontEnd&) = delete;
+  StreamingFrontEnd& operator=(const StreamingFrontEnd&) = delete;
+
+  void read_chunks(int fd);
+  void translate_chunks();
+
+  BoundedQueue<std::vector<char>> chunks_;
+  BoundedQueue<OpProgram> segments_;
+  PassManager pass_manager_;
+
+  // Written by the stage threads, read after they've been joined.
+  double read_time_;
+  double translate_time_;
+  size_t bytes_read_;
+
+  std::thread reader_;
+  std::thread translator_;
+};
+
+} // namespace optutils
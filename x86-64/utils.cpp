@@ -3,9 +3,17 @@
 // Eli Bendersky [http://eli.thegreenplace.net]
 // This code is in the public domain.
 #include "utils.h"
+#include <algorithm>
+#include <cctype>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
 #include <iostream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
 
 namespace internal {
 
@@ -24,32 +32,139 @@ double Timer::elapsed() {
   return elapsed.count();
 }
 
+MappedFile::MappedFile(const std::string& path)
+  : data_(nullptr), size_(0), mapped_(false)
+{
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    DIE << "unable to open file " << path;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    void* ptr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (ptr != MAP_FAILED) {
+      // The loaders walk the file front to back exactly once.
+      madvise(ptr, st.st_size, MADV_SEQUENTIAL);
+      data_ = static_cast<const char*>(ptr);
+      size_ = st.st_size;
+      mapped_ = true;
+    }
+  }
+
+  if (!mapped_) {
+    char chunk[64 * 1024];
+    for (;;) {
+      ssize_t n = read(fd, chunk, sizeof(chunk));
+      if (n < 0) {
+        DIE << "unable to read file " << path;
+      }
+      if (n == 0) {
+        break;
+      }
+      buffer_.append(chunk, n);
+    }
+    data_ = buffer_.data();
+    size_ = buffer_.size();
+  }
+  close(fd);
+}
+
+MappedFile::~MappedFile() {
+  if (mapped_) {
+    munmap(const_cast<char*>(data_), size_);
+  }
+}
+
+uint64_t hash_bytes(const char* data, size_t size) {
+  // FNV-1a over 8-byte words, folding the high half of the state back in after
+  // every word, plus a final avalanche step.
+  const uint64_t kPrime = 0x100000001b3ull;
+  uint64_t h = 0xcbf29ce484222325ull ^ size;
+  size_t i = 0;
+  for (; i + 8 <= size; i += 8) {
+    uint64_t word;
+    memcpy(&word, data + i, 8);
+    h = (h ^ word) * kPrime;
+    h ^= h >> 32;
+  }
+  for (; i < size; ++i) {
+    h = (h ^ static_cast<uint8_t>(data[i])) * kPrime;
+  }
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdull;
+  h ^= h >> 33;
+  return h;
+}
+
 namespace {
 
 void usage_and_exit(const std::string& progname) {
   std::cout << "Expecting " << progname << " [flags] <BF file>\n";
   std::cout << "\nSupported flags:\n";
   std::cout << "    --verbose           enable verbose output\n";
+  std::cout << "    -O0 .. -O3          optimization level (default: -O2)\n";
+  std::cout << "    --stream            pipeline reading, translation and "
+               "codegen (JITs)\n";
+  std::cout << "    --jobs=N            translate on N threads (0: one per "
+               "core)\n";
+  std::cout << "    --emit-bfo=FILE     save the translated ops to FILE\n";
+  std::cout << "    --load-bfo=FILE     run the ops saved in FILE\n";
+  std::cout << "    --peval-steps=N     step budget of the -O3 partial "
+               "evaluator\n";
+  std::cout << "    --no-cache          don't use the JIT code cache (JITs)\n";
+  std::cout << "    --cache-dir=DIR     keep the JIT code cache in DIR\n";
   exit(EXIT_SUCCESS);
 }
 
 } // namespace {
 
 void parse_command_line(int argc, const char** argv, std::string* bf_file_path,
-                        bool* verbose) {
-  *verbose = false;
+                        Flags* flags) {
+  *flags = Flags();
 
   // This loop handles flags that optionally come before the actual arguments.
   // When it's done, arg_i will point to the first non-flag argument.
   int arg_i = 1;
   for (; arg_i < argc; ++arg_i) {
     std::string arg = argv[arg_i];
-    if (!(arg.size() > 2 && arg[0] == '-' && arg[1] == '-')) {
+    if (arg.size() == 3 && arg[0] == '-' && arg[1] == 'O' && arg[2] >= '0' &&
+        arg[2] <= '3') {
+      flags->opt_level = arg[2] - '0';
+    } else if (!(arg.size() > 2 && arg[0] == '-' && arg[1] == '-')) {
       // If this arg doesn't start with a --, it's not a flag. So we expect it
       // to be the BF program.
       break;
     } else if (arg == "--verbose") {
-      *verbose = true;
+      flags->verbose = true;
+    } else if (arg == "--stream") {
+      flags->stream = true;
+    } else if (arg.compare(0, 7, "--jobs=") == 0) {
+      const char* value = arg.c_str() + 7;
+      char* end;
+      long jobs = strtol(value, &end, 10);
+      if (end == value || *end || jobs < 0) {
+        usage_and_exit(argv[0]);
+      }
+      flags->jobs = jobs > 0 ? jobs : std::thread::hardware_concurrency();
+      flags->jobs = std::max(flags->jobs, 1u);
+    } else if (arg.compare(0, 11, "--emit-bfo=") == 0) {
+      flags->emit_bfo = arg.substr(11);
+    } else if (arg.compare(0, 11, "--load-bfo=") == 0) {
+      flags->load_bfo = arg.substr(11);
+    } else if (arg.compare(0, 14, "--peval-steps=") == 0) {
+      // strtoull would also take leading spaces and a sign, negating the
+      // value for '-'.
+      const char* value = arg.c_str() + 14;
+      char* end;
+      flags->peval_steps = strtoull(value, &end, 10);
+      if (!isdigit(static_cast<unsigned char>(*value)) || *end) {
+        usage_and_exit(argv[0]);
+      }
+    } else if (arg == "--no-cache") {
+      flags->no_cache = true;
+    } else if (arg.compare(0, 12, "--cache-dir=") == 0) {
+      flags->cache_dir = arg.substr(12);
     } else if (arg == "--help") {
       usage_and_exit(argv[0]);
     } else {
@@ -57,8 +172,16 @@ void parse_command_line(int argc, const char** argv, std::string* bf_file_path,
     }
   }
 
-  if (arg_i >= argc) {
+  if (arg_i < argc) {
+    *bf_file_path = argv[arg_i];
+  } else if (flags->load_bfo.empty()) {
     usage_and_exit(argv[0]);
   }
-  *bf_file_path = argv[arg_i];
+}
+
+void parse_command_line(int argc, const char** argv, std::string* bf_file_path,
+                        bool* verbose) {
+  Flags flags;
+  parse_command_line(argc, argv, bf_file_path, &flags);
+  *verbose = flags.verbose;
 }
@@ -6,6 +6,7 @@
 #define UTILS_H
 
 #include <chrono>
+#include <cstdint>
 #include <sstream>
 #include <string>
 
@@ -41,11 +42,82 @@ private:
   std::chrono::time_point<std::chrono::high_resolution_clock> t1_;
 };
 
+// Read-only view of the contents of a file. Regular files are mapped into
+// memory with mmap; anything that can't be mapped (pipes, terminals, empty
+// files) is read into a heap buffer instead. Dies with an error message if the
+// file can't be opened or read.
+class MappedFile {
+public:
+  explicit MappedFile(const std::string& path);
+  ~MappedFile();
+
+  const char* data() const {
+    return data_;
+  }
+
+  size_t size() const {
+    return size_;
+  }
+
+private:
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  const char* data_;
+  size_t size_;
+  bool mapped_;
+  std::string buffer_;
+};
+
+// Values of the command-line flags accepted by BF executors. Executors ignore
+// the flags that don't apply to them.
+struct Flags {
+  // --verbose: enable verbose output.
+  bool verbose = false;
+
+  // --stream: overlap reading, translation and code generation.
+  bool stream = false;
+
+  // --jobs=N: number of threads used to translate the program; 0 picks one
+  // per core.
+  unsigned jobs = 1;
+
+  // --emit-bfo=FILE: save the translated ops to FILE.
+  std::string emit_bfo;
+
+  // --load-bfo=FILE: run the ops saved in FILE instead of translating. The BF
+  // file may then be omitted; if it's given, FILE is only used when it was
+  // produced from that source.
+  std::string load_bfo;
+
+  // -O0 .. -O3: optimization level of the BfOp optimizer.
+  int opt_level = 2;
+
+  // --peval-steps=N: how many ops the -O3 partial evaluator may execute while
+  // running the input-free start of the program at translation time.
+  uint64_t peval_steps = 10000000;
+
+  // --no-cache: don't look up or store compiled code in the JIT cache.
+  bool no_cache = false;
+
+  // --cache-dir=DIR: keep the JIT cache in DIR. The default is
+  // $BFJIT_CACHE_DIR, or ~/.cache/bfjit.
+  std::string cache_dir;
+};
+
+// Returns a 64-bit hash of data[0..size). Not cryptographic; used to tell
+// whether derived artifacts were produced from the same source.
+uint64_t hash_bytes(const char* data, size_t size);
+
 // Parses the command-line for BF executors, to obtain the bf file path and
 // values for flags. These are taken by pointers and assigned in this function.
 // If any error occurs during parsing, this function reports it and exits.
 // All flags are expected to be supplied before the positional bf file path,
 // which has to be last on the command line.
+void parse_command_line(int argc, const char** argv, std::string* bf_file_path,
+                        Flags* flags);
+
+// Same as above, for executors that only support --verbose.
 void parse_command_line(int argc, const char** argv, std::string* bf_file_path,
                         bool* verbose);
 